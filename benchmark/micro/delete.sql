@@ -0,0 +1,2 @@
+\set ok random(1, :scale)
+DELETE FROM lineitem WHERE l_orderkey = :ok AND l_linenumber = (SELECT max(l_linenumber) FROM lineitem WHERE l_orderkey = :ok);
@@ -0,0 +1,5 @@
+\set ok random(1, :scale)
+\set ln random(1000, 999999)
+\set sk random(1, 10)
+\set qty random(1, 50)
+INSERT INTO lineitem VALUES (:ok, :client_id * 1000000 + :ln, :sk, :qty, :qty * 950.0, 'AIR') ON CONFLICT DO NOTHING;
@@ -0,0 +1,275 @@
+"""Micro-benchmark of the incremental maintenance path.
+
+Measures the latency of single DML statements on a base table for each view
+shape (single-table, join, aggregate, min/max, DISTINCT, EXISTS), with the
+shape's IMMV being the only one defined. The shape "none" has no IMMV and
+gives the cost of the statement itself.
+
+A temporary instance is created with initdb and pg_ivm loaded via
+shared_preload_libraries, so pg_ivm must be installed into the PostgreSQL
+found by pg_config. Data is generated by schema.sql with a fixed seed, and
+every shape starts from a copy of the same database. Statements are driven
+by pgbench with a fixed random seed.
+
+Usage:
+    make benchmark-micro
+    python3 benchmark/micro/run.py --scale 20000 --shapes aggregate,minmax \\
+        --output result.json --baseline previous.json --tolerance 0.2
+
+Exit status is 1 if any p95 latency exceeds its threshold in --thresholds or
+regresses by more than --tolerance against --baseline.
+"""
+
+import argparse
+import glob
+import json
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+SHAPES = {
+    'none': None,
+    'single':
+        "SELECT l_orderkey, l_linenumber, l_quantity FROM lineitem WHERE l_shipmode = 'AIR'",
+    'join':
+        'SELECT l_orderkey, l_linenumber, o_custkey, l_quantity '
+        'FROM lineitem JOIN orders ON l_orderkey = o_orderkey',
+    'aggregate':
+        'SELECT l_suppkey, sum(l_quantity) AS qty, count(*) AS cnt '
+        'FROM lineitem GROUP BY l_suppkey',
+    'minmax':
+        'SELECT l_suppkey, min(l_quantity) AS min_qty, max(l_quantity) AS max_qty '
+        'FROM lineitem GROUP BY l_suppkey',
+    'distinct':
+        'SELECT DISTINCT l_suppkey, l_shipmode FROM lineitem',
+    'exists':
+        'SELECT o_orderkey, o_custkey FROM orders o WHERE EXISTS '
+        '(SELECT 1 FROM lineitem l WHERE l.l_orderkey = o.o_orderkey AND l.l_quantity > 45)',
+}
+
+SCRIPTS = ['update', 'insert', 'delete']
+
+PERCENTILES = [50, 95, 99]
+
+
+class Instance:
+    """A temporary PostgreSQL instance."""
+
+    def __init__(self, bindir, port):
+        self.bindir = bindir
+        self.port = port
+        self.dir = tempfile.mkdtemp(prefix='pg_ivm_micro_')
+        self.datadir = os.path.join(self.dir, 'data')
+
+    def bin(self, name):
+        return os.path.join(self.bindir, name)
+
+    def start(self):
+        subprocess.run([self.bin('initdb'), '-D', self.datadir, '-A', 'trust', '-U', 'postgres',
+                        '--no-sync'], check=True, stdout=subprocess.DEVNULL)
+        with open(os.path.join(self.datadir, 'postgresql.conf'), 'a') as f:
+            f.write(f"port = {self.port}\n"
+                    f"listen_addresses = ''\n"
+                    f"unix_socket_directories = '{self.dir}'\n"
+                    "shared_preload_libraries = 'pg_ivm'\n"
+                    "shared_buffers = '256MB'\n"
+                    "synchronous_commit = off\n"
+                    "max_parallel_workers_per_gather = 0\n"
+                    "autovacuum = off\n")
+        subprocess.run([self.bin('pg_ctl'), '-D', self.datadir, '-w', '-l',
+                        os.path.join(self.dir, 'server.log'), 'start'],
+                       check=True, stdout=subprocess.DEVNULL)
+
+    def stop(self, keep=False):
+        subprocess.run([self.bin('pg_ctl'), '-D', self.datadir, '-w', '-m', 'fast', 'stop'],
+                       stdout=subprocess.DEVNULL)
+        if keep:
+            print(f'instance kept in {self.dir}')
+        else:
+            shutil.rmtree(self.dir, ignore_errors=True)
+
+    def conn_args(self, dbname):
+        return ['-h', self.dir, '-p', str(self.port), '-U', 'postgres', '-d', dbname]
+
+    def psql(self, dbname, sql=None, file=None, variables=None):
+        args = [self.bin('psql'), '-X', '-q', '-A', '-t', '-v', 'ON_ERROR_STOP=1']
+        args += self.conn_args(dbname)
+        for name, value in (variables or {}).items():
+            args += ['-v', f'{name}={value}']
+        args += ['-f', file] if file else ['-c', sql]
+        result = subprocess.run(args, check=True, capture_output=True, text=True)
+        return result.stdout.strip()
+
+
+def percentile(values, p):
+    """Nearest-rank percentile of sorted values."""
+    if not values:
+        return None
+    rank = max(1, -(-len(values) * p // 100))
+    return values[int(rank) - 1]
+
+
+def run_pgbench(inst, dbname, script, args, logdir):
+    """Run a pgbench script and return latencies of statements in milliseconds."""
+    prefix = os.path.join(logdir, script)
+    subprocess.run([inst.bin('pgbench'), '-n', '-f', os.path.join(HERE, script + '.sql'),
+                    '-D', f'scale={args.scale}', '-c', str(args.clients), '-j', str(args.clients),
+                    '-t', str(args.transactions), f'--random-seed={args.seed}',
+                    '-l', f'--log-prefix={prefix}'] + inst.conn_args(dbname),
+                   check=True, capture_output=True, text=True)
+
+    latencies = []
+    for path in glob.glob(prefix + '.*'):
+        with open(path) as f:
+            for line in f:
+                # client_id transaction_no time script_no time_epoch time_us
+                latencies.append(int(line.split()[2]) / 1000.0)
+        os.unlink(path)
+    return sorted(latencies)
+
+
+def immv_stats(inst, dbname):
+    """Return the maintenance time breakdown of the IMMV from pg_ivm_stat_immv."""
+    row = inst.psql(dbname, """
+        SELECT calls, round(mean_time::numeric, 3), round(rewrite_time::numeric, 3),
+               round(calc_delta_time::numeric, 3), round(apply_delta_time::numeric, 3),
+               round(recalc_time::numeric, 3)
+        FROM pg_ivm_stat_immv WHERE immvrelid = 'mv'::regclass""")
+    if not row:
+        return None
+    values = row.split('|')
+    keys = ['calls', 'mean_ms', 'rewrite_ms', 'calc_delta_ms', 'apply_delta_ms', 'recalc_ms']
+    return {k: (int(v) if k == 'calls' else float(v)) for k, v in zip(keys, values)}
+
+
+def run_shape(inst, shape, args, logdir):
+    dbname = f'bench_{shape}'
+    inst.psql('postgres', f'CREATE DATABASE {dbname} TEMPLATE bench_template')
+    if SHAPES[shape]:
+        inst.psql(dbname, "SELECT create_immv('mv', $q${}$q$)".format(SHAPES[shape]))
+        inst.psql(dbname, 'VACUUM ANALYZE mv')
+    inst.psql(dbname, 'SELECT pg_ivm_stat_immv_reset()')
+
+    result = {}
+    for script in args.scripts:
+        latencies = run_pgbench(inst, dbname, script, args, logdir)
+        entry = {
+            'count': len(latencies),
+            'mean_ms': sum(latencies) / len(latencies) if latencies else None,
+        }
+        for p in PERCENTILES:
+            entry[f'p{p}_ms'] = percentile(latencies, p)
+        result[script] = entry
+
+    if SHAPES[shape]:
+        result['maintenance'] = immv_stats(inst, dbname)
+    inst.psql('postgres', f'DROP DATABASE {dbname}')
+    return result
+
+
+def check(results, args):
+    """Return a list of threshold violations and regressions."""
+    failures = []
+    thresholds = {}
+    baseline = {}
+    if args.thresholds:
+        with open(args.thresholds) as f:
+            thresholds = json.load(f)
+    if args.baseline:
+        with open(args.baseline) as f:
+            baseline = json.load(f)['results']
+
+    for shape, scripts in results.items():
+        for script in args.scripts:
+            p95 = scripts[script]['p95_ms']
+            limit = thresholds.get(shape, {}).get(script)
+            if limit is not None and p95 > limit:
+                failures.append(f'{shape}/{script}: p95 {p95:.3f} ms exceeds {limit:.3f} ms')
+            base = baseline.get(shape, {}).get(script, {}).get('p95_ms')
+            if base is not None and p95 > base * (1 + args.tolerance):
+                failures.append(f'{shape}/{script}: p95 {p95:.3f} ms regressed from '
+                                f'{base:.3f} ms by more than {args.tolerance:.0%}')
+    return failures
+
+
+def report(results, args):
+    header = f"{'shape':<10} {'script':<7} {'mean':>8} " + \
+        ' '.join(f'{"p" + str(p):>8}' for p in PERCENTILES) + f" {'overhead':>9}"
+    print(header)
+    print('-' * len(header))
+    for shape, scripts in results.items():
+        for script in args.scripts:
+            entry = scripts[script]
+            line = f"{shape:<10} {script:<7} {entry['mean_ms']:8.3f} " + \
+                ' '.join(f"{entry[f'p{p}_ms']:8.3f}" for p in PERCENTILES)
+            if shape != 'none' and 'none' in results:
+                line += f" {entry['p50_ms'] - results['none'][script]['p50_ms']:9.3f}"
+            print(line)
+        stats = scripts.get('maintenance')
+        if stats:
+            print(f"{'':<10} maintenance: calls={stats['calls']} mean={stats['mean_ms']} ms, "
+                  f"rewrite={stats['rewrite_ms']} calc_delta={stats['calc_delta_ms']} "
+                  f"apply_delta={stats['apply_delta_ms']} recalc={stats['recalc_ms']} ms total")
+    print('latencies in ms; overhead is p50 minus p50 of shape "none"')
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--pg-config', default='pg_config')
+    parser.add_argument('--port', type=int, default=54329)
+    parser.add_argument('--scale', type=int, default=10000, help='number of orders')
+    parser.add_argument('--clients', type=int, default=1)
+    parser.add_argument('--transactions', type=int, default=2000, help='per client and script')
+    parser.add_argument('--seed', type=int, default=42)
+    parser.add_argument('--shapes', default=','.join(SHAPES))
+    parser.add_argument('--scripts', default=','.join(SCRIPTS))
+    parser.add_argument('--output', help='write results as JSON')
+    parser.add_argument('--baseline', help='JSON written by --output of a previous run')
+    parser.add_argument('--tolerance', type=float, default=0.2,
+                        help='allowed p95 regression against --baseline')
+    parser.add_argument('--thresholds', help='JSON of {shape: {script: max p95 ms}}')
+    parser.add_argument('--keep', action='store_true', help='keep the temporary instance')
+    args = parser.parse_args()
+    args.scripts = args.scripts.split(',')
+    shapes = args.shapes.split(',')
+    for shape in shapes:
+        if shape not in SHAPES:
+            parser.error(f'unknown shape: {shape}')
+
+    bindir = subprocess.run([args.pg_config, '--bindir'], check=True, capture_output=True,
+                            text=True).stdout.strip()
+    inst = Instance(bindir, args.port)
+    results = {}
+    try:
+        inst.start()
+        inst.psql('postgres', 'CREATE DATABASE bench_template')
+        inst.psql('bench_template', 'CREATE EXTENSION pg_ivm')
+        inst.psql('bench_template', file=os.path.join(HERE, 'schema.sql'),
+                  variables={'scale': args.scale})
+        for shape in shapes:
+            print(f'running {shape}', file=sys.stderr)
+            results[shape] = run_shape(inst, shape, args, inst.dir)
+    finally:
+        inst.stop(keep=args.keep)
+
+    report(results, args)
+
+    if args.output:
+        with open(args.output, 'w') as f:
+            json.dump({'settings': {'scale': args.scale, 'clients': args.clients,
+                                    'transactions': args.transactions, 'seed': args.seed},
+                       'results': results}, f, indent=2)
+
+    failures = check(results, args)
+    for failure in failures:
+        print(f'FAIL: {failure}')
+    sys.exit(1 if failures else 0)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,48 @@
+-- TPC-H-like tables for the micro-benchmark, generated with a fixed seed.
+-- :scale is the number of orders; each order has 1 to 7 line items.
+
+SET max_parallel_workers_per_gather = 0;
+SELECT setseed(0.42);
+
+CREATE TABLE supplier (
+  s_suppkey integer PRIMARY KEY,
+  s_name text NOT NULL,
+  s_nationkey integer NOT NULL
+);
+
+CREATE TABLE orders (
+  o_orderkey integer PRIMARY KEY,
+  o_custkey integer NOT NULL,
+  o_orderstatus char(1) NOT NULL,
+  o_orderdate date NOT NULL
+);
+
+CREATE TABLE lineitem (
+  l_orderkey integer NOT NULL,
+  l_linenumber integer NOT NULL,
+  l_suppkey integer NOT NULL,
+  l_quantity numeric(15,2) NOT NULL,
+  l_extendedprice numeric(15,2) NOT NULL,
+  l_shipmode text NOT NULL,
+  PRIMARY KEY (l_orderkey, l_linenumber)
+);
+
+INSERT INTO supplier
+  SELECT i, 'Supplier#' || i, (random() * 24)::integer
+  FROM generate_series(1, greatest(:scale / 100, 10)) i;
+
+INSERT INTO orders
+  SELECT i, 1 + (random() * 999)::integer,
+         (ARRAY['O', 'F'])[1 + (random() < 0.5)::integer],
+         date '1992-01-01' + (random() * 2400)::integer
+  FROM generate_series(1, :scale) i;
+
+INSERT INTO lineitem
+  SELECT o_orderkey, n, 1 + (random() * (greatest(:scale / 100, 10) - 1))::integer,
+         q, q * (900 + random() * 100),
+         (ARRAY['AIR', 'SHIP', 'RAIL', 'TRUCK', 'MAIL'])[1 + (random() * 4)::integer]
+  FROM orders,
+       LATERAL generate_series(1, 1 + (random() * 6)::integer + (o_orderkey * 0)) n,
+       LATERAL (SELECT 1 + (random() * 49)::integer + (n * 0) AS q) r;
+
+VACUUM ANALYZE;
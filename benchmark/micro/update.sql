@@ -0,0 +1,2 @@
+\set ok random(1, :scale)
+UPDATE lineitem SET l_quantity = l_quantity % 50 + 1 WHERE l_orderkey = :ok AND l_linenumber = 1;
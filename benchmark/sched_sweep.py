@@ -0,0 +1,245 @@
+"""Scheduler benchmark sweeping contention models for each scheduling policy.
+
+Each client runs synthetic transactions against the TPC-H database used by
+concurrent_test.py for a fixed duration. A transaction updates one row in
+each of a few base tables, chosen with a Zipf-like skew so that a higher
+skew makes clients overlap on the same tables (and thus the same IMMVs).
+The mix sets the share of single-table, multi-table and read-only
+transactions.
+
+For every combination of policy, client count, skew and mix it reports
+throughput, p50/p95/p99 latency of committed transactions, deadlock and
+serialization failure counts, and the scheduler's give-ups and admission
+wait time read from pg_ivm_scheduler_stats(). Failed transactions are
+counted separately and never enter the latency percentiles.
+
+pg_ivm must be loaded via shared_preload_libraries, and the connecting user
+must be allowed to run ALTER SYSTEM to switch pg_ivm.schedule_policy.
+
+Usage:
+    python3 benchmark/sched_sweep.py --clients 4,8,16 --skew 0,1,2 \\
+        --mix 0.6/0.3/0.1 --duration 30 --output sweep.csv
+"""
+
+import argparse
+import bisect
+import csv
+import itertools
+import random
+import time
+from multiprocessing import Process, Queue
+
+import psycopg
+
+from transactions import get_connection
+
+POLICIES = ['fcfs', 'min_table_affected', 'hot_table_first', 'sjf', 'adaptive']
+
+# Base tables and a no-op update of one row picked by its key
+TABLES = [
+    ('lineitem', 'UPDATE lineitem SET l_comment = l_comment WHERE l_orderkey = %s'),
+    ('orders', 'UPDATE orders SET o_comment = o_comment WHERE o_orderkey = %s'),
+    ('customer', 'UPDATE customer SET c_comment = c_comment WHERE c_custkey = %s'),
+    ('supplier', 'UPDATE supplier SET s_comment = s_comment WHERE s_suppkey = %s'),
+    ('part', 'UPDATE part SET p_comment = p_comment WHERE p_partkey = %s'),
+    ('partsupp', 'UPDATE partsupp SET ps_comment = ps_comment WHERE ps_partkey = %s'),
+    ('nation', 'UPDATE nation SET n_comment = n_comment WHERE n_nationkey = %s'),
+    ('region', 'UPDATE region SET r_comment = r_comment WHERE r_regionkey = %s'),
+]
+
+KEY_RANGES = {
+    'lineitem': 'SELECT min(l_orderkey), max(l_orderkey) FROM lineitem',
+    'orders': 'SELECT min(o_orderkey), max(o_orderkey) FROM orders',
+    'customer': 'SELECT min(c_custkey), max(c_custkey) FROM customer',
+    'supplier': 'SELECT min(s_suppkey), max(s_suppkey) FROM supplier',
+    'part': 'SELECT min(p_partkey), max(p_partkey) FROM part',
+    'partsupp': 'SELECT min(ps_partkey), max(ps_partkey) FROM partsupp',
+    'nation': 'SELECT min(n_nationkey), max(n_nationkey) FROM nation',
+    'region': 'SELECT min(r_regionkey), max(r_regionkey) FROM region',
+}
+
+PERCENTILES = [50, 95, 99]
+
+
+def zipf_cdf(n, skew):
+    """Cumulative distribution of ranks 1..n with weights 1/rank^skew."""
+    weights = [1.0 / (rank ** skew) for rank in range(1, n + 1)]
+    total = sum(weights)
+    cdf = []
+    acc = 0.0
+    for w in weights:
+        acc += w / total
+        cdf.append(acc)
+    return cdf
+
+
+def pick_tables(rng, cdf, count):
+    chosen = set()
+    while len(chosen) < count:
+        chosen.add(min(bisect.bisect_left(cdf, rng.random()), len(cdf) - 1))
+    # update tables in a fixed order as an application would
+    return sorted(chosen)
+
+
+def worker(client_id, args, skew, mix, key_ranges, deadline, queue):
+    rng = random.Random(args.seed * 1000 + client_id)
+    cdf = zipf_cdf(len(TABLES), skew)
+    latencies = []
+    deadlocks = 0
+    serialization_failures = 0
+    others = 0
+
+    conn = get_connection()
+    while time.time() < deadline:
+        r = rng.random()
+        if r < mix[0]:
+            tables = pick_tables(rng, cdf, 1)
+            read_only = False
+        elif r < mix[0] + mix[1]:
+            tables = pick_tables(rng, cdf, min(args.tables_per_txn, len(TABLES)))
+            read_only = False
+        else:
+            tables = pick_tables(rng, cdf, 1)
+            read_only = True
+
+        start = time.time()
+        try:
+            with conn.cursor() as cur:
+                for t in tables:
+                    name, update = TABLES[t]
+                    key = rng.randint(*key_ranges[name])
+                    if read_only:
+                        cur.execute(KEY_RANGES[name])
+                    else:
+                        cur.execute(update, (key,))
+            conn.commit()
+            latencies.append((time.time() - start) * 1000.0)
+        except psycopg.errors.DeadlockDetected:
+            conn.rollback()
+            deadlocks += 1
+        except psycopg.errors.SerializationFailure:
+            conn.rollback()
+            serialization_failures += 1
+        except psycopg.Error:
+            conn.rollback()
+            others += 1
+    conn.close()
+    queue.put((latencies, deadlocks, serialization_failures, others))
+
+
+def percentile(values, p):
+    if not values:
+        return None
+    rank = max(1, -(-len(values) * p // 100))
+    return values[int(rank) - 1]
+
+
+def set_policy(policy):
+    with get_connection() as conn:
+        conn.autocommit = True
+        conn.execute(f"ALTER SYSTEM SET pg_ivm.schedule_policy = '{policy}'")
+        conn.execute('SELECT pg_reload_conf()')
+    # wait for backends to pick up the new setting
+    time.sleep(1)
+    with get_connection() as conn:
+        current = conn.execute('SHOW pg_ivm.schedule_policy').fetchone()[0]
+        if current != policy:
+            raise RuntimeError(f'pg_ivm.schedule_policy is {current}, not {policy}')
+
+
+def run_point(args, policy, clients, skew, mix, key_ranges):
+    with get_connection() as conn:
+        conn.execute('SELECT pg_ivm_scheduler_stats_reset()')
+        conn.commit()
+
+    queue = Queue()
+    deadline = time.time() + args.duration
+    processes = [Process(target=worker, args=(i, args, skew, mix, key_ranges, deadline, queue))
+                 for i in range(clients)]
+    started = time.time()
+    for p in processes:
+        p.start()
+    results = [queue.get() for _ in processes]
+    for p in processes:
+        p.join()
+    elapsed = time.time() - started
+
+    with get_connection() as conn:
+        stats = conn.execute(
+            'SELECT admitted, give_ups, wait_time, max_wait_time, policy_switches '
+            'FROM pg_ivm_scheduler_stats()'
+        ).fetchone()
+
+    latencies = sorted(itertools.chain(*[r[0] for r in results]))
+    row = {
+        'policy': policy,
+        'clients': clients,
+        'skew': skew,
+        'mix': '/'.join(str(m) for m in mix),
+        'committed': len(latencies),
+        'throughput': len(latencies) / elapsed,
+        'deadlocks': sum(r[1] for r in results),
+        'serialization_failures': sum(r[2] for r in results),
+        'other_errors': sum(r[3] for r in results),
+        'admitted': stats[0],
+        'give_ups': stats[1],
+        'sched_wait_ms': stats[2],
+        'sched_max_wait_ms': stats[3],
+        'sched_wait_per_admission_ms': stats[2] / stats[0] if stats[0] else None,
+        'policy_switches': stats[4],
+    }
+    for p in PERCENTILES:
+        row[f'p{p}_ms'] = percentile(latencies, p)
+    return row
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--policies', default=','.join(POLICIES))
+    parser.add_argument('--clients', default='1,4,8,16')
+    parser.add_argument('--skew', default='0,1,2',
+                        help='Zipf exponents of table choice; 0 is uniform')
+    parser.add_argument('--mix', default='0.6/0.3/0.1',
+                        help='shares of single-table/multi-table/read-only transactions; '
+                             'several mixes can be separated by commas')
+    parser.add_argument('--tables-per-txn', type=int, default=3)
+    parser.add_argument('--duration', type=float, default=20, help='seconds per point')
+    parser.add_argument('--seed', type=int, default=42)
+    parser.add_argument('--output', default=time.strftime('sweep_%Y_%m_%d_%H_%M.csv'))
+    args = parser.parse_args()
+
+    policies = args.policies.split(',')
+    clients_list = [int(c) for c in args.clients.split(',')]
+    skews = [float(s) for s in args.skew.split(',')]
+    mixes = [tuple(float(m) for m in mix.split('/')) for mix in args.mix.split(',')]
+    for mix in mixes:
+        if len(mix) != 3 or abs(sum(mix) - 1.0) > 1e-6:
+            parser.error(f'mix must be three shares summing to 1: {mix}')
+
+    with get_connection() as conn:
+        key_ranges = {name: conn.execute(sql).fetchone() for name, sql in KEY_RANGES.items()}
+
+    rows = []
+    try:
+        for policy in policies:
+            set_policy(policy)
+            for clients, skew, mix in itertools.product(clients_list, skews, mixes):
+                row = run_point(args, policy, clients, skew, mix, key_ranges)
+                rows.append(row)
+                print(f"{policy:<18} clients={clients:<3} skew={skew:<4} mix={row['mix']:<12} "
+                      f"tps={row['throughput']:8.1f} p50={row['p50_ms'] or 0:8.2f} "
+                      f"p95={row['p95_ms'] or 0:8.2f} p99={row['p99_ms'] or 0:8.2f} "
+                      f"deadlocks={row['deadlocks']} give_ups={row['give_ups']} "
+                      f"sched_wait={row['sched_wait_ms']:.1f}ms")
+    finally:
+        if rows:
+            with open(args.output, 'w', newline='') as f:
+                writer = csv.DictWriter(f, fieldnames=list(rows[0].keys()))
+                writer.writeheader()
+                writer.writerows(rows)
+            print(f'results written to {args.output}')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,612 @@
+/*-------------------------------------------------------------------------
+ *
+ * compactdelta.c
+ *	  incremental view maintenance extension
+ *    Routines for the compact on-disk format of spilled deltas
+ *
+ * A spilled delta is written to a temporary file in blocks of up to
+ * COMPACT_DELTA_BLOCK_ROWS rows. In a block, values are stored column by
+ * column, so that each column can be encoded in the way suitable for it:
+ *
+ *	- pass-by-value columns (integers, dates, timestamps, ...) are stored as
+ *	  zigzag variable-length integers of the difference from the previous
+ *	  value in the column.
+ *	- other columns are stored as a dictionary of distinct values and one-byte
+ *	  codes if the block has only a few distinct values, as is typical for
+ *	  flags and modes, or as length-prefixed values otherwise.
+ *
+ * NULLs are stored in a bitmap per column and are omitted from the values.
+ *
+ * Portions Copyright (c) 2022, IVM Development Group
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "access/detoast.h"
+#include "common/hashfn.h"
+#include "executor/tuptable.h"
+#include "storage/buffile.h"
+#include "utils/datum.h"
+#include "utils/memutils.h"
+
+#include "pg_ivm.h"
+
+#define COMPACT_DELTA_BLOCK_ROWS 1024
+
+/* Encodings of a column in a block */
+#define COMPACT_ENC_RAW 0
+#define COMPACT_ENC_DELTA 1
+#define COMPACT_ENC_DICT 2
+#define COMPACT_ENC_ALLNULL 3
+
+#define COMPACT_FLAG_HAS_NULLS 0x10
+#define COMPACT_ENC_MASK 0x0f
+
+/* A dictionary can have at most this number of entries, to use one-byte codes */
+#define COMPACT_DICT_MAX 256
+/* Size of the open addressing table used to look up dictionary entries */
+#define COMPACT_DICT_SLOTS 512
+
+struct CompactDelta
+{
+	TupleDesc tupdesc;
+	BufFile *file;
+	int64 nbytes; /* bytes written to the file */
+	int64 ntuples;
+
+	/* rows of the block being built */
+	int nrows;
+	Datum **values; /* per column */
+	bool **isnull;	/* per column */
+
+	MemoryContext blockcxt; /* holds copied values and encoded block */
+};
+
+static void compact_delta_flush(CompactDelta *cd);
+static void compact_delta_write(CompactDelta *cd, void *ptr, size_t size);
+static void encode_column(CompactDelta *cd, int attno, StringInfo buf);
+static void encode_bytes_column(Form_pg_attribute attr, Datum *values, bool *isnull, int nrows,
+								StringInfo buf);
+static const char *datum_bytes(Form_pg_attribute attr, Datum value, Size *len);
+static void append_null_bitmap(StringInfo buf, bool *isnull, int nrows);
+static void append_varint(StringInfo buf, uint64 value);
+static uint64 read_varint(const char **ptr);
+
+/*
+ * compact_delta_begin
+ *
+ * Create a compact delta for tuples of the given descriptor. The caller's
+ * memory context must live as long as the compact delta.
+ */
+CompactDelta *
+compact_delta_begin(TupleDesc tupdesc)
+{
+	CompactDelta *cd = (CompactDelta *) palloc0(sizeof(CompactDelta));
+	int i;
+
+	cd->tupdesc = tupdesc;
+	cd->file = BufFileCreateTemp(false);
+	cd->values = (Datum **) palloc(sizeof(Datum *) * tupdesc->natts);
+	cd->isnull = (bool **) palloc(sizeof(bool *) * tupdesc->natts);
+	for (i = 0; i < tupdesc->natts; i++)
+	{
+		cd->values[i] = (Datum *) palloc(sizeof(Datum) * COMPACT_DELTA_BLOCK_ROWS);
+		cd->isnull[i] = (bool *) palloc(sizeof(bool) * COMPACT_DELTA_BLOCK_ROWS);
+	}
+	cd->blockcxt = AllocSetContextCreate(CurrentMemoryContext,
+										 "IVM compact delta block",
+										 ALLOCSET_DEFAULT_SIZES);
+
+	return cd;
+}
+
+/*
+ * compact_delta_put
+ *
+ * Append the tuple in the slot to the compact delta.
+ */
+void
+compact_delta_put(CompactDelta *cd, TupleTableSlot *slot)
+{
+	MemoryContext oldcxt;
+	int i;
+
+	slot_getallattrs(slot);
+
+	oldcxt = MemoryContextSwitchTo(cd->blockcxt);
+	for (i = 0; i < cd->tupdesc->natts; i++)
+	{
+		Form_pg_attribute attr = TupleDescAttr(cd->tupdesc, i);
+
+		cd->isnull[i][cd->nrows] = slot->tts_isnull[i];
+		if (slot->tts_isnull[i])
+			cd->values[i][cd->nrows] = (Datum) 0;
+		else
+			cd->values[i][cd->nrows] = datumCopy(slot->tts_values[i], attr->attbyval, attr->attlen);
+	}
+	MemoryContextSwitchTo(oldcxt);
+
+	cd->nrows++;
+	cd->ntuples++;
+
+	if (cd->nrows == COMPACT_DELTA_BLOCK_ROWS)
+		compact_delta_flush(cd);
+}
+
+/*
+ * compact_delta_finish
+ *
+ * Write the last block. No tuple can be appended after this.
+ */
+void
+compact_delta_finish(CompactDelta *cd)
+{
+	if (cd->nrows > 0)
+		compact_delta_flush(cd);
+}
+
+/*
+ * compact_delta_read
+ *
+ * Decode all tuples in the compact delta into the tuplestore.
+ */
+void
+compact_delta_read(CompactDelta *cd, Tuplestorestate *tuplestore)
+{
+	TupleDesc tupdesc = cd->tupdesc;
+	int natts = tupdesc->natts;
+	Datum *values = (Datum *) palloc(sizeof(Datum) * natts);
+	bool *nulls = (bool *) palloc(sizeof(bool) * natts);
+
+	if (BufFileSeek(cd->file, 0, 0, SEEK_SET) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(), errmsg("could not rewind temporary file of delta")));
+
+	for (;;)
+	{
+		MemoryContext oldcxt;
+		uint32 blocklen;
+		char *block;
+		const char *ptr;
+		uint32 nrows;
+		size_t nread;
+		int row;
+		int i;
+
+		nread = BufFileRead(cd->file, &blocklen, sizeof(blocklen));
+		if (nread == 0)
+			break;
+		if (nread != sizeof(blocklen))
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not read temporary file of delta")));
+
+		MemoryContextReset(cd->blockcxt);
+		oldcxt = MemoryContextSwitchTo(cd->blockcxt);
+
+		block = palloc(blocklen);
+		if (BufFileRead(cd->file, block, blocklen) != blocklen)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not read temporary file of delta")));
+
+		ptr = block;
+		memcpy(&nrows, ptr, sizeof(nrows));
+		ptr += sizeof(nrows);
+
+		for (i = 0; i < natts; i++)
+		{
+			uint8 flags = (uint8) *ptr++;
+			int encoding = flags & COMPACT_ENC_MASK;
+			const uint8 *bitmap = NULL;
+			Datum prev = (Datum) 0;
+			char **dict = NULL;
+
+			if (flags & COMPACT_FLAG_HAS_NULLS)
+			{
+				bitmap = (const uint8 *) ptr;
+				ptr += (nrows + 7) / 8;
+			}
+
+			if (encoding == COMPACT_ENC_DICT)
+			{
+				int ndict = (int) read_varint(&ptr);
+				int j;
+
+				dict = (char **) palloc(sizeof(char *) * ndict);
+				for (j = 0; j < ndict; j++)
+				{
+					Size len = (Size) read_varint(&ptr);
+
+					dict[j] = palloc(len);
+					memcpy(dict[j], ptr, len);
+					ptr += len;
+				}
+			}
+
+			for (row = 0; row < nrows; row++)
+			{
+				bool isnull = (encoding == COMPACT_ENC_ALLNULL) ||
+							  (bitmap && (bitmap[row / 8] & (1 << (row % 8))));
+
+				cd->isnull[i][row] = isnull;
+				cd->values[i][row] = (Datum) 0;
+				if (isnull)
+					continue;
+
+				switch (encoding)
+				{
+					case COMPACT_ENC_DELTA:
+					{
+						uint64 zigzag = read_varint(&ptr);
+						uint64 delta = (zigzag >> 1) ^ (~(zigzag & 1) + 1);
+
+						prev = (Datum) ((uint64) prev + delta);
+						cd->values[i][row] = prev;
+					}
+					break;
+					case COMPACT_ENC_DICT:
+						cd->values[i][row] = PointerGetDatum(dict[(uint8) *ptr++]);
+						break;
+					case COMPACT_ENC_RAW:
+					{
+						Size len = (Size) read_varint(&ptr);
+						char *data = palloc(len);
+
+						memcpy(data, ptr, len);
+						ptr += len;
+						cd->values[i][row] = PointerGetDatum(data);
+					}
+					break;
+					default:
+						elog(ERROR, "unrecognized encoding of delta column: %d", encoding);
+				}
+			}
+		}
+
+		MemoryContextSwitchTo(oldcxt);
+
+		for (row = 0; row < nrows; row++)
+		{
+			for (i = 0; i < natts; i++)
+			{
+				values[i] = cd->values[i][row];
+				nulls[i] = cd->isnull[i][row];
+			}
+			tuplestore_putvalues(tuplestore, tupdesc, values, nulls);
+		}
+	}
+
+	MemoryContextReset(cd->blockcxt);
+	pfree(values);
+	pfree(nulls);
+}
+
+/*
+ * compact_delta_end
+ *
+ * Release the compact delta and its temporary file.
+ */
+void
+compact_delta_end(CompactDelta *cd)
+{
+	int i;
+
+	BufFileClose(cd->file);
+	MemoryContextDelete(cd->blockcxt);
+	for (i = 0; i < cd->tupdesc->natts; i++)
+	{
+		pfree(cd->values[i]);
+		pfree(cd->isnull[i]);
+	}
+	pfree(cd->values);
+	pfree(cd->isnull);
+	pfree(cd);
+}
+
+/*
+ * compact_delta_bytes
+ *
+ * Return the number of bytes written to the temporary file.
+ */
+int64
+compact_delta_bytes(CompactDelta *cd)
+{
+	return cd->nbytes;
+}
+
+/*
+ * compact_delta_flush
+ *
+ * Encode rows in the current block and write them to the file.
+ */
+static void
+compact_delta_flush(CompactDelta *cd)
+{
+	MemoryContext oldcxt = MemoryContextSwitchTo(cd->blockcxt);
+	StringInfoData buf;
+	uint32 nrows = (uint32) cd->nrows;
+	uint32 blocklen;
+	int i;
+
+	initStringInfo(&buf);
+	appendBinaryStringInfo(&buf, (char *) &nrows, sizeof(nrows));
+	for (i = 0; i < cd->tupdesc->natts; i++)
+		encode_column(cd, i, &buf);
+
+	blocklen = (uint32) buf.len;
+	compact_delta_write(cd, &blocklen, sizeof(blocklen));
+	compact_delta_write(cd, buf.data, buf.len);
+	cd->nbytes += sizeof(blocklen) + buf.len;
+
+	MemoryContextSwitchTo(oldcxt);
+	MemoryContextReset(cd->blockcxt);
+	cd->nrows = 0;
+}
+
+/*
+ * compact_delta_write
+ *
+ * Write bytes to the temporary file. BufFileWrite reports errors by itself
+ * since PostgreSQL 16, but returns the number of bytes written before.
+ */
+static void
+compact_delta_write(CompactDelta *cd, void *ptr, size_t size)
+{
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 160000)
+	BufFileWrite(cd->file, ptr, size);
+#else
+	if (BufFileWrite(cd->file, ptr, size) != size)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not write temporary file of delta")));
+#endif
+}
+
+/*
+ * encode_column
+ *
+ * Append the flags, the null bitmap and the values of a column in the current
+ * block to buf.
+ */
+static void
+encode_column(CompactDelta *cd, int attno, StringInfo buf)
+{
+	Form_pg_attribute attr = TupleDescAttr(cd->tupdesc, attno);
+	Datum *values = cd->values[attno];
+	bool *isnull = cd->isnull[attno];
+	int nrows = cd->nrows;
+	int nnulls = 0;
+	Datum prev = (Datum) 0;
+	int row;
+
+	for (row = 0; row < nrows; row++)
+	{
+		if (isnull[row])
+			nnulls++;
+	}
+
+	if (nnulls == nrows)
+	{
+		appendStringInfoChar(buf, (char) COMPACT_ENC_ALLNULL);
+		return;
+	}
+
+	if (!attr->attbyval)
+	{
+		encode_bytes_column(attr, values, isnull, nrows, buf);
+		return;
+	}
+
+	appendStringInfoChar(buf, (char) (COMPACT_ENC_DELTA | (nnulls > 0 ? COMPACT_FLAG_HAS_NULLS : 0)));
+	if (nnulls > 0)
+		append_null_bitmap(buf, isnull, nrows);
+
+	for (row = 0; row < nrows; row++)
+	{
+		int64 delta;
+
+		if (isnull[row])
+			continue;
+
+		delta = (int64) ((uint64) values[row] - (uint64) prev);
+		append_varint(buf, ((uint64) delta << 1) ^ (uint64) (delta >> 63));
+		prev = values[row];
+	}
+}
+
+/*
+ * encode_bytes_column
+ *
+ * Encode a pass-by-reference column with a dictionary if it has a few distinct
+ * values in the block, otherwise as length-prefixed values.
+ */
+static void
+encode_bytes_column(Form_pg_attribute attr, Datum *values, bool *isnull, int nrows,
+					StringInfo buf)
+{
+	const char **data = (const char **) palloc(sizeof(char *) * nrows);
+	Size *lens = (Size *) palloc(sizeof(Size) * nrows);
+	int16 slots[COMPACT_DICT_SLOTS];
+	int dict_rows[COMPACT_DICT_MAX];
+	uint8 *codes = (uint8 *) palloc(nrows);
+	int ndict = 0;
+	int nnonnull = 0;
+	bool use_dict = true;
+	bool has_nulls = false;
+	int row;
+
+	memset(slots, -1, sizeof(slots));
+
+	for (row = 0; row < nrows; row++)
+	{
+		uint32 slot;
+
+		if (isnull[row])
+		{
+			has_nulls = true;
+			continue;
+		}
+
+		data[row] = datum_bytes(attr, values[row], &lens[row]);
+		nnonnull++;
+
+		if (!use_dict)
+			continue;
+
+		/* look up the value in the dictionary */
+		slot = hash_bytes((const unsigned char *) data[row], (int) lens[row]) % COMPACT_DICT_SLOTS;
+		for (;;)
+		{
+			int entry = slots[slot];
+
+			if (entry < 0)
+			{
+				if (ndict == COMPACT_DICT_MAX)
+				{
+					use_dict = false;
+					break;
+				}
+				slots[slot] = (int16) ndict;
+				dict_rows[ndict] = row;
+				codes[row] = (uint8) ndict;
+				ndict++;
+				break;
+			}
+			if (lens[dict_rows[entry]] == lens[row] &&
+				memcmp(data[dict_rows[entry]], data[row], lens[row]) == 0)
+			{
+				codes[row] = (uint8) entry;
+				break;
+			}
+			slot = (slot + 1) % COMPACT_DICT_SLOTS;
+		}
+	}
+
+	/* A dictionary is worth only if values are repeated. */
+	if (ndict * 2 > nnonnull)
+		use_dict = false;
+
+	appendStringInfoChar(buf,
+						 (char) ((use_dict ? COMPACT_ENC_DICT : COMPACT_ENC_RAW) |
+								 (has_nulls ? COMPACT_FLAG_HAS_NULLS : 0)));
+
+	if (has_nulls)
+		append_null_bitmap(buf, isnull, nrows);
+
+	if (use_dict)
+	{
+		int i;
+
+		append_varint(buf, (uint64) ndict);
+		for (i = 0; i < ndict; i++)
+		{
+			append_varint(buf, (uint64) lens[dict_rows[i]]);
+			appendBinaryStringInfo(buf, data[dict_rows[i]], (int) lens[dict_rows[i]]);
+		}
+		for (row = 0; row < nrows; row++)
+		{
+			if (!isnull[row])
+				appendStringInfoChar(buf, (char) codes[row]);
+		}
+	}
+	else
+	{
+		for (row = 0; row < nrows; row++)
+		{
+			if (isnull[row])
+				continue;
+			append_varint(buf, (uint64) lens[row]);
+			appendBinaryStringInfo(buf, data[row], (int) lens[row]);
+		}
+	}
+}
+
+/*
+ * datum_bytes
+ *
+ * Return the bytes of a pass-by-reference value as stored in a tuple. Values
+ * pointing to external TOAST data are fetched, because the TOAST data might
+ * be gone by the time the delta is read.
+ */
+static const char *
+datum_bytes(Form_pg_attribute attr, Datum value, Size *len)
+{
+	if (attr->attlen == -1)
+	{
+		struct varlena *ptr = (struct varlena *) DatumGetPointer(value);
+
+		if (VARATT_IS_EXTERNAL(ptr))
+			ptr = detoast_external_attr(ptr);
+		*len = VARSIZE_ANY(ptr);
+		return (const char *) ptr;
+	}
+
+	*len = datumGetSize(value, false, attr->attlen);
+	return DatumGetPointer(value);
+}
+
+/*
+ * append_null_bitmap
+ *
+ * Append a bitmap in which bits of NULL values are set.
+ */
+static void
+append_null_bitmap(StringInfo buf, bool *isnull, int nrows)
+{
+	int nbytes = (nrows + 7) / 8;
+	int row;
+
+	enlargeStringInfo(buf, nbytes);
+	memset(buf->data + buf->len, 0, nbytes);
+	for (row = 0; row < nrows; row++)
+	{
+		if (isnull[row])
+			buf->data[buf->len + row / 8] |= (1 << (row % 8));
+	}
+	buf->len += nbytes;
+	buf->data[buf->len] = '\0';
+}
+
+/*
+ * append_varint
+ *
+ * Append an unsigned integer in 7 bits per byte, least significant first.
+ */
+static void
+append_varint(StringInfo buf, uint64 value)
+{
+	while (value >= 0x80)
+	{
+		appendStringInfoChar(buf, (char) ((value & 0x7f) | 0x80));
+		value >>= 7;
+	}
+	appendStringInfoChar(buf, (char) value);
+}
+
+/*
+ * read_varint
+ *
+ * Read an unsigned integer written by append_varint and advance the pointer.
+ */
+static uint64
+read_varint(const char **ptr)
+{
+	const uint8 *p = (const uint8 *) *ptr;
+	uint64 value = 0;
+	int shift = 0;
+
+	for (;;)
+	{
+		uint8 byte = *p++;
+
+		value |= ((uint64) (byte & 0x7f)) << shift;
+		if ((byte & 0x80) == 0)
+			break;
+		shift += 7;
+	}
+
+	*ptr = (const char *) p;
+	return value;
+}
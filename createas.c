@@ -47,6 +47,7 @@
 #include "utils/regproc.h"
 #include "utils/snapmgr.h"
 #include "utils/syscache.h"
+#include "utils/typcache.h"
 
 #include "pg_ivm.h"
 
@@ -73,14 +74,14 @@ typedef struct
 } check_ivm_restriction_context;
 
 static void CreateIvmTriggersOnBaseTablesRecurse(Query *qry, Node *node, Oid matviewOid,
-												 Relids *relids, bool ex_lock);
-static void CreateIvmTrigger(Oid relOid, Oid viewOid, int16 type, int16 timing, bool ex_lock);
+												 Relids *relids, char lock_scope);
+static void CreateIvmTrigger(Oid relOid, Oid viewOid, int16 type, int16 timing, char lock_scope);
 static void check_ivm_restriction(Node *node);
 static bool check_ivm_restriction_walker(Node *node, check_ivm_restriction_context *context);
 static Bitmapset *get_primary_key_attnos_from_query(Query *query, List **constraintList);
 static bool check_aggregate_supports_ivm(Oid aggfnoid);
 
-static void StoreImmvQuery(Oid viewOid, bool ispopulated, Query *viewQuery);
+static void StoreImmvQuery(Oid viewOid, bool ispopulated, bool multiset, Query *viewQuery);
 
 #if defined(PG_VERSION_NUM) && (PG_VERSION_NUM < 140000)
 static bool CreateTableAsRelExists(CreateTableAsStmt *ctas);
@@ -90,10 +91,15 @@ static bool CreateTableAsRelExists(CreateTableAsStmt *ctas);
  * ExecCreateImmv -- execute a create_immv() function
  *
  * This imitates PostgreSQL's ExecCreateTableAs().
+ *
+ * If multiset is true, the IMMV stores a row per distinct tuple of the view
+ * with its multiplicity in __ivm_count__, instead of duplicated rows. Such
+ * an IMMV is maintained as if the view had DISTINCT on all columns, so that
+ * deletions decrement the counts through the unique index.
  */
 ObjectAddress
 ExecCreateImmv(ParseState *pstate, CreateTableAsStmt *stmt, ParamListInfo params,
-			   QueryEnvironment *queryEnv, QueryCompletion *qc)
+			   QueryEnvironment *queryEnv, QueryCompletion *qc, bool multiset)
 {
 	Query *query = castNode(Query, stmt->query);
 	IntoClause *into = stmt->into;
@@ -165,6 +171,47 @@ ExecCreateImmv(ParseState *pstate, CreateTableAsStmt *stmt, ParamListInfo params
 
 		check_ivm_restriction((Node *) query);
 
+		if (multiset)
+		{
+			ListCell *lc;
+
+			if (viewQuery->distinctClause || viewQuery->hasAggs || viewQuery->groupClause)
+				ereport(ERROR,
+						(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						 errmsg("multiset storage is not supported on IMMVs with DISTINCT, "
+								"GROUP BY or aggregates"),
+						 errdetail("Such IMMVs already store a row per distinct tuple.")));
+
+			/* Duplicated rows are found by the equality of all columns */
+			foreach(lc, viewQuery->targetList)
+			{
+				TargetEntry *tle = lfirst_node(TargetEntry, lc);
+				Oid typid = exprType((Node *) tle->expr);
+				TypeCacheEntry *typentry;
+
+				if (tle->resjunk)
+					continue;
+
+				typentry = lookup_type_cache(typid, TYPECACHE_EQ_OPR);
+				if (!OidIsValid(typentry->eq_opr))
+					ereport(ERROR,
+							(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+							 errmsg("multiset storage is not supported on IMMVs with column \"%s\" "
+									"of type %s",
+									tle->resname,
+									format_type_be(typid)),
+							 errdetail("Rows of a multiset IMMV are compared by the equality "
+									   "operators of their columns, but type %s has none.",
+									   format_type_be(typid))));
+			}
+
+			viewQuery = copyObject(viewQuery);
+			viewQuery->distinctClause = transformDistinctClause(NULL,
+																&viewQuery->targetList,
+																viewQuery->sortClause,
+																false);
+		}
+
 		/* For IMMV, we need to rewrite matview query */
 		query = rewriteQueryForIMMV(viewQuery, into->colNames);
 	}
@@ -245,7 +292,7 @@ ExecCreateImmv(ParseState *pstate, CreateTableAsStmt *stmt, ParamListInfo params
 	}
 
 	/* Create the "view" part of an IMMV. */
-	StoreImmvQuery(address.objectId, !into->skipData, viewQuery);
+	StoreImmvQuery(address.objectId, !into->skipData, multiset, viewQuery);
 
 	if (is_matview)
 	{
@@ -523,7 +570,7 @@ void
 CreateIvmTriggersOnBaseTables(Query *qry, Oid matviewOid)
 {
 	Relids relids = NULL;
-	bool ex_lock = false;
+	char lock_scope = IVM_LOCK_SCOPE_GROUP;
 	RangeTblEntry *rte;
 
 	/* Immediately return if we don't have any base tables. */
@@ -534,34 +581,31 @@ CreateIvmTriggersOnBaseTables(Query *qry, Oid matviewOid)
 	 * If the view has more than one base tables, we need an exclusive lock
 	 * on the view so that the view would be maintained serially to avoid
 	 * the inconsistency that occurs when two base tables are modified in
-	 * concurrent transactions. However, if the view has only one table,
-	 * we can use a weaker lock.
+	 * concurrent transactions. However, the lock is not needed while base
+	 * tables are modified, so it is deferred until the view is maintained.
+	 * The transaction maintaining the view later then computes the delta
+	 * against the state committed by the former one. If the view has only
+	 * one table, we can use a weaker lock on the view and lock only the groups
+	 * of the view touched by the deltas at the maintenance time.
 	 *
 	 * The type of lock should be determined here, because if we check the
 	 * view definition at maintenance time, we need to acquire a weaker lock,
 	 * and upgrading the lock level after this increases probability of
 	 * deadlock.
-	 *
-	 * XXX: For the current extension version, DISTINCT and aggregates with GROUP
-	 * need exclusive lock to prevent inconsistency that can be avoided by using
-	 * nulls_not_distinct which is available only in PG15 or later.
-	 * XXX: This lock is not necessary if all columns in group keys or distinct
-	 * target list are not nullable.
 	 */
 
 	rte = list_nth(qry->rtable, 0);
-	if (list_length(qry->rtable) > 1 || rte->rtekind != RTE_RELATION || qry->distinctClause ||
-		(qry->hasAggs && qry->groupClause))
-		ex_lock = true;
+	if (list_length(qry->rtable) > 1 || rte->rtekind != RTE_RELATION)
+		lock_scope = IVM_LOCK_SCOPE_DEFERRED;
 
-	CreateIvmTriggersOnBaseTablesRecurse(qry, (Node *) qry, matviewOid, &relids, ex_lock);
+	CreateIvmTriggersOnBaseTablesRecurse(qry, (Node *) qry, matviewOid, &relids, lock_scope);
 
 	bms_free(relids);
 }
 
 static void
 CreateIvmTriggersOnBaseTablesRecurse(Query *qry, Node *node, Oid matviewOid, Relids *relids,
-									 bool ex_lock)
+									 char lock_scope)
 {
 	if (node == NULL)
 		return;
@@ -580,7 +624,7 @@ CreateIvmTriggersOnBaseTablesRecurse(Query *qry, Node *node, Oid matviewOid, Rel
 												 (Node *) query->jointree,
 												 matviewOid,
 												 relids,
-												 ex_lock);
+												 lock_scope);
 			foreach (lc, query->cteList)
 			{
 				CommonTableExpr *cte = (CommonTableExpr *) lfirst(lc);
@@ -589,7 +633,7 @@ CreateIvmTriggersOnBaseTablesRecurse(Query *qry, Node *node, Oid matviewOid, Rel
 													 cte->ctequery,
 													 matviewOid,
 													 relids,
-													 ex_lock);
+													 lock_scope);
 			}
 		}
 		break;
@@ -605,42 +649,42 @@ CreateIvmTriggersOnBaseTablesRecurse(Query *qry, Node *node, Oid matviewOid, Rel
 								 matviewOid,
 								 TRIGGER_TYPE_INSERT,
 								 TRIGGER_TYPE_BEFORE,
-								 ex_lock);
+								 lock_scope);
 				CreateIvmTrigger(rte->relid,
 								 matviewOid,
 								 TRIGGER_TYPE_DELETE,
 								 TRIGGER_TYPE_BEFORE,
-								 ex_lock);
+								 lock_scope);
 				CreateIvmTrigger(rte->relid,
 								 matviewOid,
 								 TRIGGER_TYPE_UPDATE,
 								 TRIGGER_TYPE_BEFORE,
-								 ex_lock);
+								 lock_scope);
 				CreateIvmTrigger(rte->relid,
 								 matviewOid,
 								 TRIGGER_TYPE_TRUNCATE,
 								 TRIGGER_TYPE_BEFORE,
-								 true);
+								 IVM_LOCK_SCOPE_VIEW);
 				CreateIvmTrigger(rte->relid,
 								 matviewOid,
 								 TRIGGER_TYPE_INSERT,
 								 TRIGGER_TYPE_AFTER,
-								 ex_lock);
+								 lock_scope);
 				CreateIvmTrigger(rte->relid,
 								 matviewOid,
 								 TRIGGER_TYPE_DELETE,
 								 TRIGGER_TYPE_AFTER,
-								 ex_lock);
+								 lock_scope);
 				CreateIvmTrigger(rte->relid,
 								 matviewOid,
 								 TRIGGER_TYPE_UPDATE,
 								 TRIGGER_TYPE_AFTER,
-								 ex_lock);
+								 lock_scope);
 				CreateIvmTrigger(rte->relid,
 								 matviewOid,
 								 TRIGGER_TYPE_TRUNCATE,
 								 TRIGGER_TYPE_AFTER,
-								 true);
+								 IVM_LOCK_SCOPE_VIEW);
 
 				*relids = bms_add_member(*relids, rte->relid);
 			}
@@ -652,7 +696,7 @@ CreateIvmTriggersOnBaseTablesRecurse(Query *qry, Node *node, Oid matviewOid, Rel
 													 (Node *) subquery,
 													 matviewOid,
 													 relids,
-													 ex_lock);
+													 lock_scope);
 			}
 		}
 		break;
@@ -663,7 +707,7 @@ CreateIvmTriggersOnBaseTablesRecurse(Query *qry, Node *node, Oid matviewOid, Rel
 			ListCell *l;
 
 			foreach (l, f->fromlist)
-				CreateIvmTriggersOnBaseTablesRecurse(qry, lfirst(l), matviewOid, relids, ex_lock);
+				CreateIvmTriggersOnBaseTablesRecurse(qry, lfirst(l), matviewOid, relids, lock_scope);
 		}
 		break;
 
@@ -671,8 +715,8 @@ CreateIvmTriggersOnBaseTablesRecurse(Query *qry, Node *node, Oid matviewOid, Rel
 		{
 			JoinExpr *j = (JoinExpr *) node;
 
-			CreateIvmTriggersOnBaseTablesRecurse(qry, j->larg, matviewOid, relids, ex_lock);
-			CreateIvmTriggersOnBaseTablesRecurse(qry, j->rarg, matviewOid, relids, ex_lock);
+			CreateIvmTriggersOnBaseTablesRecurse(qry, j->larg, matviewOid, relids, lock_scope);
+			CreateIvmTriggersOnBaseTablesRecurse(qry, j->rarg, matviewOid, relids, lock_scope);
 		}
 		break;
 
@@ -685,7 +729,7 @@ CreateIvmTriggersOnBaseTablesRecurse(Query *qry, Node *node, Oid matviewOid, Rel
  * CreateIvmTrigger -- create IVM trigger on a base table
  */
 static void
-CreateIvmTrigger(Oid relOid, Oid viewOid, int16 type, int16 timing, bool ex_lock)
+CreateIvmTrigger(Oid relOid, Oid viewOid, int16 type, int16 timing, char lock_scope)
 {
 	ObjectAddress refaddr;
 	ObjectAddress address;
@@ -749,18 +793,6 @@ CreateIvmTrigger(Oid relOid, Oid viewOid, int16 type, int16 timing, bool ex_lock
 		}
 	}
 
-	/*
-	 * XXX: When using DELETE or UPDATE, we must use exclusive lock for now
-	 * because apply_old_delta(_with_count) doesn't work in concurrent situations.
-	 *
-	 * If the view doesn't have aggregate, distinct, or tuple duplicate, then it
-	 * would work. However, we don't have any way to guarantee the view has a unique
-	 * key before opening the IMMV at the maintenance time because users may drop
-	 * the unique index. We need something to resolve the issue!!
-	 */
-	if (type == TRIGGER_TYPE_DELETE || type == TRIGGER_TYPE_UPDATE)
-		ex_lock = true;
-
 	ivm_trigger->funcname =
 		(timing == TRIGGER_TYPE_BEFORE ? SystemFuncName("IVM_immediate_before") :
 										 SystemFuncName("IVM_immediate_maintenance"));
@@ -775,8 +807,7 @@ CreateIvmTrigger(Oid relOid, Oid viewOid, int16 type, int16 timing, bool ex_lock
 	ivm_trigger->args =
 		list_make2(makeString(
 					   DatumGetPointer(DirectFunctionCall1(oidout, ObjectIdGetDatum(viewOid)))),
-				   makeString(
-					   DatumGetPointer(DirectFunctionCall1(boolout, BoolGetDatum(ex_lock)))));
+				   makeString(psprintf("%c", lock_scope)));
 
 	address = CreateTrigger(ivm_trigger,
 							NULL,
@@ -978,11 +1009,6 @@ check_ivm_restriction_walker(Node *node, check_ivm_restriction_context *context)
 							(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
 							 errmsg("VALUES is not supported on incrementally maintainable "
 									"materialized view")));
-				if (rte->relkind == RELKIND_RELATION && isImmv(rte->relid))
-					ereport(ERROR,
-							(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-							 errmsg("including IMMV in definition is not supported on "
-									"incrementally maintainable materialized view")));
 
 				if (rte->rtekind == RTE_SUBQUERY)
 				{
@@ -1724,10 +1750,11 @@ get_primary_key_attnos_from_query(Query *query, List **constraintList)
 }
 
 /*
- * Store the query for the IMMV to pg_ivwm_immv
+ * Store the query for the IMMV to pg_ivwm_immv, with the parts of the
+ * maintenance descriptor derived from it
  */
 static void
-StoreImmvQuery(Oid viewOid, bool ispopulated, Query *viewQuery)
+StoreImmvQuery(Oid viewOid, bool ispopulated, bool multiset, Query *viewQuery)
 {
 	char *querytree = nodeToString((Node *) viewQuery);
 	Datum values[Natts_pg_ivm_immv];
@@ -1743,6 +1770,10 @@ StoreImmvQuery(Oid viewOid, bool ispopulated, Query *viewQuery)
 	values[Anum_pg_ivm_immv_immvrelid - 1] = ObjectIdGetDatum(viewOid);
 	values[Anum_pg_ivm_immv_ispopulated - 1] = BoolGetDatum(ispopulated);
 	values[Anum_pg_ivm_immv_viewdef - 1] = CStringGetTextDatum(querytree);
+	values[Anum_pg_ivm_immv_ismultiset - 1] = BoolGetDatum(multiset);
+	BuildImmvMaintDesc(viewQuery,
+					   &values[Anum_pg_ivm_immv_keyattnums - 1],
+					   &values[Anum_pg_ivm_immv_aggkinds - 1]);
 
 	pgIvmImmv = table_open(PgIvmImmvRelationId(), RowExclusiveLock);
 
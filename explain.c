@@ -0,0 +1,257 @@
+/*-------------------------------------------------------------------------
+ *
+ * explain.c
+ *	  show plans of queries executed for incremental view maintenance
+ *
+ * pg_ivm_explain_maintenance() executes a DML statement in a subtransaction
+ * which is always rolled back, and collects the plans of queries executed
+ * while the given IMMV is maintained, with actual row counts and timings, as
+ * auto_explain does.
+ *
+ * Portions Copyright (c) 2022, IVM Development Group
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "access/xact.h"
+#include "commands/explain.h"
+#include "executor/instrument.h"
+#include "executor/spi.h"
+#include "funcapi.h"
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/resowner.h"
+
+#include "pg_ivm.h"
+
+#define IVM_EXPLAIN_COLS 5
+
+/*
+ * IvmExplainEntry
+ *
+ * A query executed for maintenance and its plan.
+ */
+typedef struct IvmExplainEntry
+{
+	char *step;		   /* maintenance step which executed the query */
+	char *query;	   /* query text, or NULL if not available */
+	char *plan;		   /* EXPLAIN ANALYZE output */
+	uint64 rows;	   /* rows processed by the query */
+	double total_time; /* execution time in milliseconds */
+} IvmExplainEntry;
+
+static Oid explain_immv = InvalidOid;	   /* IMMV whose maintenance is explained */
+static const char *explain_step = NULL;	   /* current step of the maintenance */
+static List *explain_entries = NIL;		   /* List of IvmExplainEntry */
+static MemoryContext explain_cxt = NULL;   /* context for explain_entries */
+
+PG_FUNCTION_INFO_V1(pg_ivm_explain_maintenance);
+
+/*
+ * IvmExplainSetStep
+ *
+ * Set the name of the maintenance step of the IMMV being executed. Queries
+ * executed until the next call are explained if the IMMV is the target of
+ * pg_ivm_explain_maintenance(). NULL stops explaining.
+ */
+void
+IvmExplainSetStep(Oid immvid, const char *step)
+{
+	if (OidIsValid(explain_immv) && immvid == explain_immv)
+		explain_step = step;
+}
+
+/*
+ * IvmExplainQueryString
+ *
+ * Return the text of a query built for maintenance to be passed to the
+ * executor. The query is deparsed only if it is explained.
+ */
+const char *
+IvmExplainQueryString(Query *query)
+{
+	if (!explain_step)
+		return "";
+
+	return pg_ivm_get_querydef(query, true);
+}
+
+/*
+ * IvmExplainExecutorStart
+ *
+ * Called before the executor is started. Request instrumentation of every
+ * plan node if the query is explained.
+ */
+void
+IvmExplainExecutorStart(QueryDesc *queryDesc, int eflags)
+{
+	if (!explain_step || (eflags & EXEC_FLAG_EXPLAIN_ONLY))
+		return;
+
+	queryDesc->instrument_options |= INSTRUMENT_ALL;
+}
+
+/*
+ * IvmExplainExecutorStarted
+ *
+ * Called after the executor is started. Set up to track total elapsed time.
+ */
+void
+IvmExplainExecutorStarted(QueryDesc *queryDesc, int eflags)
+{
+	if (!explain_step || (eflags & EXEC_FLAG_EXPLAIN_ONLY))
+		return;
+
+	if (queryDesc->totaltime == NULL)
+	{
+		MemoryContext oldcxt = MemoryContextSwitchTo(queryDesc->estate->es_query_cxt);
+
+		queryDesc->totaltime = InstrAlloc(1, INSTRUMENT_ALL, false);
+		MemoryContextSwitchTo(oldcxt);
+	}
+}
+
+/*
+ * IvmExplainExecutorEnd
+ *
+ * Called before the executor is shut down. Save the plan with the actual
+ * row counts and timings if the query is explained.
+ */
+void
+IvmExplainExecutorEnd(QueryDesc *queryDesc)
+{
+	ExplainState *es;
+	IvmExplainEntry *entry;
+	MemoryContext oldcxt;
+
+	if (!explain_step || !queryDesc->totaltime || !queryDesc->planstate)
+		return;
+
+	oldcxt = MemoryContextSwitchTo(queryDesc->estate->es_query_cxt);
+
+	/*
+	 * Make sure stats accumulation is done.  (Note: it's okay if several
+	 * levels of hook all do this.)
+	 */
+	InstrEndLoop(queryDesc->totaltime);
+
+	es = NewExplainState();
+	es->analyze = true;
+	es->verbose = true;
+	es->costs = true;
+	es->timing = true;
+	es->summary = false;
+	es->format = EXPLAIN_FORMAT_TEXT;
+
+	ExplainBeginOutput(es);
+	ExplainPrintPlan(es, queryDesc);
+	ExplainEndOutput(es);
+
+	/* Remove last line break */
+	if (es->str->len > 0 && es->str->data[es->str->len - 1] == '\n')
+		es->str->data[--es->str->len] = '\0';
+
+	MemoryContextSwitchTo(explain_cxt);
+
+	entry = (IvmExplainEntry *) palloc(sizeof(IvmExplainEntry));
+	entry->step = pstrdup(explain_step);
+	entry->query = queryDesc->sourceText[0] ? pstrdup(queryDesc->sourceText) : NULL;
+	entry->plan = pstrdup(es->str->data);
+	entry->rows = queryDesc->estate->es_processed;
+	entry->total_time = queryDesc->totaltime->total * 1000.0;
+	explain_entries = lappend(explain_entries, entry);
+
+	MemoryContextSwitchTo(oldcxt);
+}
+
+/*
+ * pg_ivm_explain_maintenance
+ *
+ * Execute a DML statement and show the plans of queries executed for
+ * maintaining the IMMV. Changes made by the statement are rolled back.
+ */
+Datum
+pg_ivm_explain_maintenance(PG_FUNCTION_ARGS)
+{
+	Oid immvid = PG_GETARG_OID(0);
+	char *dml = text_to_cstring(PG_GETARG_TEXT_PP(1));
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	MemoryContext oldcxt = CurrentMemoryContext;
+	ResourceOwner oldowner = CurrentResourceOwner;
+	ListCell *lc;
+
+	if (!isImmv(immvid))
+		ereport(ERROR,
+				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+				 errmsg("\"%s\" is not an IMMV", get_rel_name(immvid))));
+
+	if (OidIsValid(explain_immv))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("pg_ivm_explain_maintenance cannot be called recursively")));
+
+	InitMaterializedSRF(fcinfo, 0);
+
+	explain_cxt = AllocSetContextCreate(CurrentMemoryContext,
+										"pg_ivm explain maintenance",
+										ALLOCSET_DEFAULT_SIZES);
+	explain_entries = NIL;
+	explain_immv = immvid;
+
+	/* Execute the statement in a subtransaction so that it can be rolled back. */
+	BeginInternalSubTransaction(NULL);
+	MemoryContextSwitchTo(oldcxt);
+
+	PG_TRY();
+	{
+		int rc;
+
+		if (SPI_connect() != SPI_OK_CONNECT)
+			elog(ERROR, "SPI_connect failed");
+
+		rc = SPI_exec(dml, 0);
+		if (rc < 0)
+			elog(ERROR, "SPI_exec failed: %s", SPI_result_code_string(rc));
+
+		if (SPI_finish() != SPI_OK_FINISH)
+			elog(ERROR, "SPI_finish failed");
+	}
+	PG_FINALLY();
+	{
+		explain_immv = InvalidOid;
+		explain_step = NULL;
+	}
+	PG_END_TRY();
+
+	/* Discard the changes made by the statement. */
+	RollbackAndReleaseCurrentSubTransaction();
+	MemoryContextSwitchTo(oldcxt);
+	CurrentResourceOwner = oldowner;
+
+	foreach (lc, explain_entries)
+	{
+		IvmExplainEntry *entry = (IvmExplainEntry *) lfirst(lc);
+		Datum values[IVM_EXPLAIN_COLS];
+		bool nulls[IVM_EXPLAIN_COLS];
+
+		memset(nulls, 0, sizeof(nulls));
+		values[0] = CStringGetTextDatum(entry->step);
+		if (entry->query)
+			values[1] = CStringGetTextDatum(entry->query);
+		else
+			nulls[1] = true;
+		values[2] = CStringGetTextDatum(entry->plan);
+		values[3] = Int64GetDatum((int64) entry->rows);
+		values[4] = Float8GetDatum(entry->total_time);
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+
+	explain_entries = NIL;
+	MemoryContextDelete(explain_cxt);
+	explain_cxt = NULL;
+
+	return (Datum) 0;
+}
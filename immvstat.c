@@ -0,0 +1,537 @@
+/*-------------------------------------------------------------------------
+ *
+ * immvstat.c
+ *	  cumulative statistics of incremental view maintenance per IMMV
+ *
+ * Counters are kept in a hash table in shared memory keyed by the database
+ * and the IMMV, and are saved to a file at shutdown and loaded at startup as
+ * pg_stat_statements does. They are available only when pg_ivm is loaded via
+ * shared_preload_libraries.
+ *
+ * Portions Copyright (c) 1996-2022, PostgreSQL Global Development Group
+ * Portions Copyright (c) 2022, IVM Development Group
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include <unistd.h>
+
+#include "access/xact.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "storage/fd.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "utils/builtins.h"
+
+#include "pg_ivm.h"
+
+/* Location of the stats file, which survives restarts */
+#define IMMV_STAT_DUMP_FILE PGSTAT_STAT_PERMANENT_DIRECTORY "/pg_ivm_stat_immv.stat"
+
+/* Magic number identifying the stats file format */
+#define IMMV_STAT_FILE_HEADER 0x49564d01
+
+/* Maximum number of IMMVs tracked; reports on other IMMVs are dropped */
+#define IMMV_STAT_MAX_ENTRIES 1000
+
+#define IMMV_STAT_COLS 14
+
+typedef struct ImmvStatKey
+{
+	Oid dbid;	/* database OID */
+	Oid immvid; /* IMMV OID */
+} ImmvStatKey;
+
+typedef struct ImmvStatEntry
+{
+	ImmvStatKey key;		   /* hash key of entry - MUST BE FIRST */
+	ImmvStatCounters counters; /* cumulative counters */
+	slock_t mutex;			   /* protects the counters only */
+} ImmvStatEntry;
+
+typedef struct ImmvStatSharedState
+{
+	LWLock *lock; /* protects hashtable search/modification */
+} ImmvStatSharedState;
+
+static ImmvStatSharedState *immv_stat_state = NULL;
+static HTAB *immv_stat_hash = NULL;
+
+/*
+ * IMMV dropped in the current transaction, whose statistics are removed at
+ * commit
+ */
+typedef struct ImmvStatPendingDrop
+{
+	Oid immvid;				/* IMMV OID */
+	SubTransactionId subid; /* subtransaction which dropped the IMMV */
+} ImmvStatPendingDrop;
+
+static List *immv_stat_pending_drops = NIL;
+
+PG_FUNCTION_INFO_V1(pg_ivm_stat_immv);
+PG_FUNCTION_INFO_V1(pg_ivm_stat_immv_reset);
+
+static void immv_stat_shmem_shutdown(int code, Datum arg);
+static void immv_stat_load_file(void);
+static ImmvStatEntry *immv_stat_enter(ImmvStatKey *key);
+
+/*
+ * ImmvStatShmemRequest
+ *
+ * Request shared memory and a lock for the statistics. This must be called
+ * from shmem_request_hook.
+ */
+void
+ImmvStatShmemRequest(void)
+{
+	Size size;
+
+	size = MAXALIGN(sizeof(ImmvStatSharedState));
+	size = add_size(size, hash_estimate_size(IMMV_STAT_MAX_ENTRIES, sizeof(ImmvStatEntry)));
+
+	RequestAddinShmemSpace(size);
+	RequestNamedLWLockTranche("pg_ivm_stat", 1);
+}
+
+/*
+ * ImmvStatShmemStartup
+ *
+ * Allocate or attach to the shared memory for the statistics, and load the
+ * stats file on the first time through. This must be called from
+ * shmem_startup_hook.
+ */
+void
+ImmvStatShmemStartup(void)
+{
+	HASHCTL info;
+	bool found;
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	immv_stat_state = ShmemInitStruct("pg_ivm_stat", sizeof(ImmvStatSharedState), &found);
+	if (!found)
+		immv_stat_state->lock = &(GetNamedLWLockTranche("pg_ivm_stat")->lock);
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(ImmvStatKey);
+	info.entrysize = sizeof(ImmvStatEntry);
+	immv_stat_hash = ShmemInitHash("pg_ivm_stat hash",
+								   IMMV_STAT_MAX_ENTRIES,
+								   IMMV_STAT_MAX_ENTRIES,
+								   &info,
+								   HASH_ELEM | HASH_BLOBS);
+
+	LWLockRelease(AddinShmemInitLock);
+
+	/*
+	 * If we're in the postmaster (or a standalone backend...), set up a shmem
+	 * exit hook to dump the statistics to disk.
+	 */
+	if (!IsUnderPostmaster)
+		on_shmem_exit(immv_stat_shmem_shutdown, (Datum) 0);
+
+	/* Done if some other process already completed our initialization. */
+	if (found)
+		return;
+
+	immv_stat_load_file();
+}
+
+/*
+ * ImmvStatReport
+ *
+ * Add counters of this backend to the statistics of the IMMV.
+ */
+void
+ImmvStatReport(Oid immvid, const ImmvStatCounters *counters)
+{
+	ImmvStatKey key;
+	ImmvStatEntry *entry;
+
+	/* Nothing to do if shared memory is not set up for us */
+	if (!immv_stat_state || !immv_stat_hash)
+		return;
+
+	memset(&key, 0, sizeof(key));
+	key.dbid = MyDatabaseId;
+	key.immvid = immvid;
+
+	LWLockAcquire(immv_stat_state->lock, LW_SHARED);
+
+	entry = (ImmvStatEntry *) hash_search(immv_stat_hash, &key, HASH_FIND, NULL);
+	if (!entry)
+	{
+		/* Need exclusive lock to make a new hashtable entry */
+		LWLockRelease(immv_stat_state->lock);
+		LWLockAcquire(immv_stat_state->lock, LW_EXCLUSIVE);
+
+		entry = immv_stat_enter(&key);
+		if (!entry)
+		{
+			LWLockRelease(immv_stat_state->lock);
+			return;
+		}
+	}
+
+	SpinLockAcquire(&entry->mutex);
+	entry->counters.calls += counters->calls;
+	entry->counters.total_time += counters->total_time;
+	entry->counters.max_time = Max(entry->counters.max_time, counters->total_time);
+	entry->counters.rewrite_time += counters->rewrite_time;
+	entry->counters.calc_delta_time += counters->calc_delta_time;
+	entry->counters.apply_delta_time += counters->apply_delta_time;
+	entry->counters.recalc_time += counters->recalc_time;
+	entry->counters.lock_wait_time += counters->lock_wait_time;
+	entry->counters.old_rows += counters->old_rows;
+	entry->counters.new_rows += counters->new_rows;
+	entry->counters.recalc_groups += counters->recalc_groups;
+	entry->counters.full_refreshes += counters->full_refreshes;
+	SpinLockRelease(&entry->mutex);
+
+	LWLockRelease(immv_stat_state->lock);
+}
+
+/*
+ * ImmvStatDropAtCommit
+ *
+ * Remove the statistics of the IMMV when the current transaction commits.
+ * This is called when the IMMV is dropped.
+ */
+void
+ImmvStatDropAtCommit(Oid immvid)
+{
+	MemoryContext oldcxt;
+	ImmvStatPendingDrop *drop;
+
+	/* Nothing to do if shared memory is not set up for us */
+	if (!immv_stat_state || !immv_stat_hash)
+		return;
+
+	oldcxt = MemoryContextSwitchTo(TopTransactionContext);
+	drop = (ImmvStatPendingDrop *) palloc(sizeof(ImmvStatPendingDrop));
+	drop->immvid = immvid;
+	drop->subid = GetCurrentSubTransactionId();
+	immv_stat_pending_drops = lappend(immv_stat_pending_drops, drop);
+	MemoryContextSwitchTo(oldcxt);
+}
+
+/*
+ * AtEOXact_ImmvStat
+ *
+ * Remove the statistics of IMMVs dropped in the transaction if it commits.
+ */
+void
+AtEOXact_ImmvStat(bool isCommit)
+{
+	ListCell *lc;
+
+	if (isCommit && immv_stat_pending_drops != NIL)
+	{
+		LWLockAcquire(immv_stat_state->lock, LW_EXCLUSIVE);
+
+		foreach (lc, immv_stat_pending_drops)
+		{
+			ImmvStatPendingDrop *drop = (ImmvStatPendingDrop *) lfirst(lc);
+			ImmvStatKey key;
+
+			memset(&key, 0, sizeof(key));
+			key.dbid = MyDatabaseId;
+			key.immvid = drop->immvid;
+			hash_search(immv_stat_hash, &key, HASH_REMOVE, NULL);
+		}
+
+		LWLockRelease(immv_stat_state->lock);
+	}
+
+	/* The list is freed with TopTransactionContext. */
+	immv_stat_pending_drops = NIL;
+}
+
+/*
+ * AtEOSubXact_ImmvStat
+ *
+ * Pass IMMVs dropped in the subtransaction to the parent if it commits, or
+ * forget them if it aborts.
+ */
+void
+AtEOSubXact_ImmvStat(bool isCommit, SubTransactionId mySubid, SubTransactionId parentSubid)
+{
+	ListCell *lc;
+
+	foreach (lc, immv_stat_pending_drops)
+	{
+		ImmvStatPendingDrop *drop = (ImmvStatPendingDrop *) lfirst(lc);
+
+		if (drop->subid != mySubid)
+			continue;
+
+		if (isCommit)
+			drop->subid = parentSubid;
+		else
+			immv_stat_pending_drops = foreach_delete_current(immv_stat_pending_drops, lc);
+	}
+}
+
+/*
+ * ImmvStatElapsed
+ *
+ * Return milliseconds elapsed since start.
+ */
+double
+ImmvStatElapsed(instr_time start)
+{
+	instr_time duration;
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+
+	return INSTR_TIME_GET_MILLISEC(duration);
+}
+
+/*
+ * immv_stat_enter
+ *
+ * Find or create an entry with the given key. Returns NULL if the hash table
+ * is full. Caller must hold an exclusive lock on immv_stat_state->lock.
+ */
+static ImmvStatEntry *
+immv_stat_enter(ImmvStatKey *key)
+{
+	ImmvStatEntry *entry;
+	bool found;
+
+	entry = (ImmvStatEntry *) hash_search(immv_stat_hash, key, HASH_FIND, NULL);
+	if (entry)
+		return entry;
+
+	if (hash_get_num_entries(immv_stat_hash) >= IMMV_STAT_MAX_ENTRIES)
+		return NULL;
+
+	entry = (ImmvStatEntry *) hash_search(immv_stat_hash, key, HASH_ENTER, &found);
+	Assert(!found);
+
+	memset(&entry->counters, 0, sizeof(ImmvStatCounters));
+	SpinLockInit(&entry->mutex);
+
+	return entry;
+}
+
+/*
+ * immv_stat_shmem_shutdown
+ *
+ * Dump the statistics into a file at shutdown.
+ */
+static void
+immv_stat_shmem_shutdown(int code, Datum arg)
+{
+	FILE *file;
+	HASH_SEQ_STATUS hash_seq;
+	ImmvStatEntry *entry;
+	uint32 header = IMMV_STAT_FILE_HEADER;
+	int32 num_entries;
+
+	/* Don't try to dump during a crash. */
+	if (code)
+		return;
+
+	/* Safety check ... shouldn't get here unless shmem is set up. */
+	if (!immv_stat_state || !immv_stat_hash)
+		return;
+
+	file = AllocateFile(IMMV_STAT_DUMP_FILE ".tmp", PG_BINARY_W);
+	if (file == NULL)
+		goto error;
+
+	num_entries = hash_get_num_entries(immv_stat_hash);
+	if (fwrite(&header, sizeof(uint32), 1, file) != 1 ||
+		fwrite(&num_entries, sizeof(int32), 1, file) != 1)
+		goto error;
+
+	hash_seq_init(&hash_seq, immv_stat_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (fwrite(&entry->key, sizeof(ImmvStatKey), 1, file) != 1 ||
+			fwrite(&entry->counters, sizeof(ImmvStatCounters), 1, file) != 1)
+		{
+			hash_seq_term(&hash_seq);
+			goto error;
+		}
+	}
+
+	if (FreeFile(file))
+	{
+		file = NULL;
+		goto error;
+	}
+
+	/* Rename file into place, so we atomically replace any old one. */
+	(void) durable_rename(IMMV_STAT_DUMP_FILE ".tmp", IMMV_STAT_DUMP_FILE, LOG);
+
+	return;
+
+error:
+	ereport(LOG,
+			(errcode_for_file_access(),
+			 errmsg("could not write file \"%s\": %m", IMMV_STAT_DUMP_FILE ".tmp")));
+	if (file)
+		FreeFile(file);
+	unlink(IMMV_STAT_DUMP_FILE ".tmp");
+}
+
+/*
+ * immv_stat_load_file
+ *
+ * Load the statistics dumped at the last shutdown. The file is removed after
+ * loading so that stale statistics are not loaded again after a crash.
+ */
+static void
+immv_stat_load_file(void)
+{
+	FILE *file;
+	uint32 header;
+	int32 num_entries;
+	int i;
+
+	file = AllocateFile(IMMV_STAT_DUMP_FILE, PG_BINARY_R);
+	if (file == NULL)
+	{
+		if (errno != ENOENT)
+			goto read_error;
+		/* No existing persisted stats file, so we're done */
+		return;
+	}
+
+	if (fread(&header, sizeof(uint32), 1, file) != 1 ||
+		fread(&num_entries, sizeof(int32), 1, file) != 1)
+		goto read_error;
+
+	if (header != IMMV_STAT_FILE_HEADER)
+		goto data_error;
+
+	for (i = 0; i < num_entries; i++)
+	{
+		ImmvStatKey key;
+		ImmvStatCounters counters;
+		ImmvStatEntry *entry;
+
+		if (fread(&key, sizeof(ImmvStatKey), 1, file) != 1 ||
+			fread(&counters, sizeof(ImmvStatCounters), 1, file) != 1)
+			goto read_error;
+
+		entry = immv_stat_enter(&key);
+		if (!entry)
+			break;
+		entry->counters = counters;
+	}
+
+	FreeFile(file);
+	unlink(IMMV_STAT_DUMP_FILE);
+
+	return;
+
+read_error:
+	ereport(LOG,
+			(errcode_for_file_access(),
+			 errmsg("could not read file \"%s\": %m", IMMV_STAT_DUMP_FILE)));
+	goto fail;
+data_error:
+	ereport(LOG,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("ignoring invalid data in file \"%s\"", IMMV_STAT_DUMP_FILE)));
+fail:
+	if (file)
+		FreeFile(file);
+	unlink(IMMV_STAT_DUMP_FILE);
+}
+
+/*
+ * pg_ivm_stat_immv
+ *
+ * Return the statistics of all IMMVs.
+ */
+Datum
+pg_ivm_stat_immv(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	HASH_SEQ_STATUS hash_seq;
+	ImmvStatEntry *entry;
+
+	if (!immv_stat_state || !immv_stat_hash)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_ivm must be loaded via shared_preload_libraries")));
+
+	InitMaterializedSRF(fcinfo, 0);
+
+	LWLockAcquire(immv_stat_state->lock, LW_SHARED);
+
+	hash_seq_init(&hash_seq, immv_stat_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		Datum values[IMMV_STAT_COLS];
+		bool nulls[IMMV_STAT_COLS];
+		ImmvStatCounters tmp;
+		int i = 0;
+
+		/* copy counters to a local variable to keep locking time short */
+		SpinLockAcquire(&entry->mutex);
+		tmp = entry->counters;
+		SpinLockRelease(&entry->mutex);
+
+		memset(nulls, 0, sizeof(nulls));
+		values[i++] = ObjectIdGetDatum(entry->key.dbid);
+		values[i++] = ObjectIdGetDatum(entry->key.immvid);
+		values[i++] = Int64GetDatumFast(tmp.calls);
+		values[i++] = Float8GetDatumFast(tmp.total_time);
+		values[i++] = Float8GetDatumFast(tmp.max_time);
+		values[i++] = Float8GetDatumFast(tmp.rewrite_time);
+		values[i++] = Float8GetDatumFast(tmp.calc_delta_time);
+		values[i++] = Float8GetDatumFast(tmp.apply_delta_time);
+		values[i++] = Float8GetDatumFast(tmp.recalc_time);
+		values[i++] = Float8GetDatumFast(tmp.lock_wait_time);
+		values[i++] = Int64GetDatumFast(tmp.old_rows);
+		values[i++] = Int64GetDatumFast(tmp.new_rows);
+		values[i++] = Int64GetDatumFast(tmp.recalc_groups);
+		values[i++] = Int64GetDatumFast(tmp.full_refreshes);
+		Assert(i == IMMV_STAT_COLS);
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+
+	LWLockRelease(immv_stat_state->lock);
+
+	return (Datum) 0;
+}
+
+/*
+ * pg_ivm_stat_immv_reset
+ *
+ * Discard the statistics of all IMMVs.
+ */
+Datum
+pg_ivm_stat_immv_reset(PG_FUNCTION_ARGS)
+{
+	HASH_SEQ_STATUS hash_seq;
+	ImmvStatEntry *entry;
+
+	if (!immv_stat_state || !immv_stat_hash)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_ivm must be loaded via shared_preload_libraries")));
+
+	LWLockAcquire(immv_stat_state->lock, LW_EXCLUSIVE);
+
+	hash_seq_init(&hash_seq, immv_stat_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+		hash_search(immv_stat_hash, &entry->key, HASH_REMOVE, NULL);
+
+	LWLockRelease(immv_stat_state->lock);
+
+	PG_RETURN_VOID();
+}
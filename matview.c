@@ -16,17 +16,23 @@
 #include "access/table.h"
 #include "access/tableam.h"
 #include "access/xact.h"
+#include "catalog/indexing.h"
+#include "catalog/pg_am_d.h"
 #include "catalog/pg_depend.h"
 #include "catalog/heap.h"
 #include "catalog/pg_trigger.h"
+#include "catalog/pg_type.h"
 #include "commands/cluster.h"
 #include "commands/defrem.h"
 #include "commands/matview.h"
 #include "commands/tablecmds.h"
+#include "commands/trigger.h"
+#include "common/hashfn.h"
 #include "executor/execdesc.h"
 #include "executor/executor.h"
 #include "executor/spi.h"
 #include "executor/tstoreReceiver.h"
+#include "funcapi.h"
 #include "miscadmin.h"
 #include "nodes/makefuncs.h"
 #include "nodes/nodeFuncs.h"
@@ -42,13 +48,19 @@
 #include "rewrite/rowsecurity.h"
 #include "storage/lmgr.h"
 #include "tcop/tcopprot.h"
+#include "utils/acl.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
 #include "utils/fmgroids.h"
 #include "utils/fmgrprotos.h"
 #include "utils/hsearch.h"
+#include "utils/inval.h"
 #include "utils/lsyscache.h"
+#include "utils/memutils.h"
 #include "utils/rel.h"
 #include "utils/snapmgr.h"
+#include "utils/syscache.h"
+#include "utils/tuplesort.h"
 #include "utils/typcache.h"
 
 #include "pg_ivm.h"
@@ -58,6 +70,16 @@
 /* MV query type codes */
 #define MV_PLAN_RECALC 1
 #define MV_PLAN_SET_VALUE 2
+#define MV_PLAN_SET_VALUES_BATCH 3
+
+/*
+ * Groups of an IMMV are locked by advisory locks on the view. A group key is
+ * hashed into one of IVM_GROUP_LOCK_PARTITIONS partitions to bound the number
+ * of locks held by a transaction. The last field of the lock tag is chosen not
+ * to conflict with pg_advisory_lock() family, which uses 1 and 2.
+ */
+#define IVM_GROUP_LOCK_PARTITIONS 128
+#define IVM_GROUP_LOCKTAG_FIELD4 0x4956
 
 /*
  * MI_QueryKey
@@ -96,10 +118,13 @@ typedef struct MV_TriggerHashEntry
 	int after_trig_count;  /* count of after triggers invoked */
 
 	Snapshot snapshot; /* Snapshot just before table change */
+	char lock_scope;   /* IVM_LOCK_SCOPE_XXX, see pg_ivm.h */
 
 	List *tables; /* List of MV_TriggerTable */
 	bool has_old; /* tuples are deleted from any table? */
 	bool has_new; /* tuples are inserted into any table? */
+
+	ImmvStatCounters stat; /* statistics reported after maintenance */
 } MV_TriggerHashEntry;
 
 /*
@@ -110,8 +135,8 @@ typedef struct MV_TriggerHashEntry
 typedef struct MV_TriggerTable
 {
 	Oid table_id;		   /* OID of the modified table */
-	List *old_tuplestores; /* tuplestores for deleted tuples */
-	List *new_tuplestores; /* tuplestores for inserted tuples */
+	List *old_tuplestores; /* MV_DeltaStores for deleted tuples */
+	List *new_tuplestores; /* MV_DeltaStores for inserted tuples */
 	List *old_rtes;		   /* RTEs of ENRs for old_tuplestores*/
 	List *new_rtes;		   /* RTEs of ENRs for new_tuplestores */
 
@@ -122,8 +147,82 @@ typedef struct MV_TriggerTable
 	TupleTableSlot *slot; /* for checking visibility in the pre-state table */
 } MV_TriggerTable;
 
+/*
+ * MV_DeltaStore
+ *
+ * A copy of a transition table kept until the view is maintained. All of
+ * them in the transaction share the memory budget given by pg_ivm.delta_mem.
+ * A transition table is passed to the triggers of all IMMVs on the table,
+ * so its copy is shared among them. It is kept until the triggers of all
+ * the IMMVs have fired and the last IMMV using it is maintained, or until
+ * the query firing them finishes. The transition table is freed at that
+ * time, so source is cleared then and a table allocated later at the same
+ * address is not taken for it.
+ *
+ * Only the input of the view delta calculation is shared. Each IMMV joins
+ * the copy with the other tables of its own query in calc_delta, since it
+ * is maintained with its own snapshot and lock scope in its own trigger.
+ */
+typedef struct MV_DeltaStore
+{
+	Tuplestorestate *source;	 /* transition table copied, or NULL */
+	int64 ntuples;				 /* number of tuples in source */
+	int depth;					 /* mv_query_depth of the query firing triggers */
+	int refcount;				 /* number of IMMVs using the store */
+	int unfired;				 /* IVM triggers yet to fire for source */
+	Tuplestorestate *tuplestore; /* NULL while the tuples are in compact */
+	CompactDelta *compact;		 /* tuples spilled in the compact format */
+	TupleDesc tupdesc;			 /* descriptor of tuples, used when spilling */
+	int64 bytes;				 /* estimated size of tuples held in memory */
+	int64 compact_bytes;		 /* estimated size of tuples spilled in compact */
+	bool spilled;				 /* tuples are written to a temporary file? */
+} MV_DeltaStore;
+
+/*
+ * MV_MaintDesc
+ *
+ * Maintenance descriptor of an IMMV, that is, the parts of the maintenance
+ * queries which depend only on the view definition. It is built from
+ * pg_ivm_immv at the first maintenance of the IMMV in the backend, and kept
+ * until the IMMV is invalidated.
+ */
+typedef struct MV_MaintDesc
+{
+	Oid matview_id;		/* OID of the materialized view, hash key */
+	bool valid;			/* false if the IMMV may have been changed */
+	MemoryContext cxt;	/* memory context holding the fields below */
+	char *matviewname;	/* quoted qualified name of the view */
+	char *target_list;	/* quoted names of all columns of the view */
+	List *keys;			/* Form_pg_attribute of columns identifying a row */
+	List *sort_columns; /* Form_pg_attribute of columns to sort deltas by */
+	char *aggs_list;	/* aggregates selected from a delta, or NULL */
+	char *aggs_set_old; /* SET clause of aggregates for deleted tuples */
+	char *aggs_set_new; /* SET clause of aggregates for inserted tuples */
+	List *minmax_list;	/* names of min/max columns */
+	List *is_min_list;	/* true for min, false for max */
+} MV_MaintDesc;
+
 static HTAB *mv_query_cache = NULL;
 static HTAB *mv_trigger_info = NULL;
+static HTAB *mv_maint_desc_cache = NULL;
+
+/*
+ * MV_DeltaStores in the current transaction. Since a delta store is never
+ * modified after it is created, the creation order is also the order of least
+ * recent use.
+ */
+static List *mv_delta_stores = NIL;
+static int64 mv_delta_held_bytes = 0;
+
+/* Statistics shown by pg_ivm_delta_mem_stats() */
+static int64 mv_delta_peak_bytes = 0;
+static int64 mv_delta_spilled_bytes = 0;
+static int64 mv_delta_spilled_stores = 0;
+static int64 mv_delta_spilled_file_bytes = 0;
+static int64 mv_delta_shared_stores = 0;
+
+/* Nesting level of queries whose AFTER triggers may be firing */
+static int mv_query_depth = 0;
 
 static bool in_delta_calculation = false;
 
@@ -140,10 +239,26 @@ typedef enum
 
 static int immv_maintenance_depth = 0;
 
+/* GUC variables */
+int ivm_delta_sort_threshold = 1000;
+int ivm_delta_mem = 65536;
+
+static ObjectAddress refresh_immv_by_oid(Oid matviewOid, bool skipData, const char *queryString,
+										 QueryCompletion *qc);
+static List *get_dependent_immvs(Relation matviewRel, bool populated_only);
+static void refresh_dependent_immvs(List *immvs, bool skipData, const char *queryString,
+									bool check_owner);
 static uint64 refresh_immv_datafill(DestReceiver *dest, Query *query, QueryEnvironment *queryEnv,
 									TupleDesc *resultTupleDesc, const char *queryString);
 
 static void refresh_by_heap_swap(Oid matviewOid, Oid OIDNewHeap, char relpersistence);
+static MV_DeltaStore *delta_store_copy(Tuplestorestate *tuplestore, Relation rel, Trigger *trigger);
+static int count_ivm_triggers(Relation rel, Trigger *trigger);
+static void delta_store_spill(MV_DeltaStore *store);
+static Tuplestorestate *delta_store_get_tuplestore(MV_DeltaStore *store);
+static void delta_store_end(MV_DeltaStore *store);
+static void delta_store_free(MV_DeltaStore *store);
+static int delta_mem_available(void);
 static void OpenImmvIncrementalMaintenance(void);
 static void CloseImmvIncrementalMaintenance(void);
 
@@ -164,9 +279,36 @@ static Query *rewrite_query_for_postupdate_state(Query *query, MV_TriggerTable *
 												 List *rte_path);
 static ListCell *getRteListCell(Query *query, List *rte_path);
 
+static char get_ivm_lock_scope(Trigger *trigger);
+static MV_MaintDesc *get_maint_desc(Relation matviewRel, Query *query);
+static void fetch_maint_desc(Oid matviewOid, Query *query, Datum *keyattnums, Datum *aggkinds);
+static void invalidate_maint_desc(Datum arg, Oid relid);
+static void invalidate_maint_desc_namespace(Datum arg, int cacheid, uint32 hashvalue);
 static void apply_delta(Oid matviewOid, Tuplestorestate *old_tuplestores,
 						Tuplestorestate *new_tuplestores, TupleDesc tupdesc_old,
-						TupleDesc tupdesc_new, Query *query, bool use_count, char *count_colname);
+						TupleDesc tupdesc_new, Query *query, bool use_count, char *count_colname,
+						bool lock_groups, ImmvStatCounters *stat);
+static void apply_combined_delta(Oid matviewOid, MV_TriggerHashEntry *entry,
+								 Tuplestorestate *old_tuplestore, Tuplestorestate *new_tuplestore,
+								 TupleDesc tupdesc_old, TupleDesc tupdesc_new, Query *query,
+								 bool use_count, char *count_colname);
+static Tuplestorestate *begin_delta_tuplestore(DestReceiver **dest);
+static void append_delta_tuples(Tuplestorestate *dst, Tuplestorestate *src, TupleDesc tupdesc);
+static bool add_delta_keys(HTAB **delta_keys, List *keys, Tuplestorestate *old_tuplestore,
+						   TupleDesc tupdesc_old, Tuplestorestate *new_tuplestore,
+						   TupleDesc tupdesc_new);
+static void forget_delta_keys(HTAB **delta_keys);
+static void lock_delta_groups(Oid matviewOid, List *keys, Tuplestorestate *old_tuplestores,
+							  TupleDesc tupdesc_old, Tuplestorestate *new_tuplestores,
+							  TupleDesc tupdesc_new);
+static void mark_delta_groups(Tuplestorestate *tuplestore, TupleDesc tupdesc, List *keys,
+							  bool *touched);
+static uint32 *get_delta_key_hashes(Tuplestorestate *tuplestore, TupleDesc tupdesc, List *keys,
+									int64 *nhashes);
+static void sort_delta_by_index_key(Tuplestorestate *tuplestore, TupleDesc tupdesc,
+									List *sort_columns);
+static List *get_sort_columns(Relation matviewRel, List *keys);
+static List *get_unique_index_columns(Relation matviewRel);
 static void append_set_clause_for_count(const char *resname, StringInfo buf_old, StringInfo buf_new,
 										StringInfo aggs_list);
 static void append_set_clause_for_sum(const char *resname, StringInfo buf_old, StringInfo buf_new,
@@ -199,6 +341,8 @@ static void recalc_and_set_values(SPITupleTable *tuptable_recalc, int64 num_tupl
 static SPIPlanPtr get_plan_for_recalc(Relation matviewRel, List *namelist, List *keys,
 									  Oid *keyTypes);
 static SPIPlanPtr get_plan_for_set_values(Relation matviewRel, List *namelist, Oid *valTypes);
+static SPIPlanPtr get_plan_for_set_values_batch(Relation matviewRel, List *namelist,
+												Oid *arrayTypes);
 static void generate_equal(StringInfo querybuf, Oid opttype, const char *leftop,
 						   const char *rightop);
 
@@ -212,6 +356,7 @@ static void clean_up_IVM_hash_entry(MV_TriggerHashEntry *entry, bool is_abort);
 PG_FUNCTION_INFO_V1(IVM_immediate_before);
 PG_FUNCTION_INFO_V1(IVM_immediate_maintenance);
 PG_FUNCTION_INFO_V1(ivm_visible_in_prestate);
+PG_FUNCTION_INFO_V1(pg_ivm_delta_mem_stats);
 
 /*
  * ExecRefreshImmv -- execute a refresh_immv() function
@@ -223,6 +368,28 @@ ExecRefreshImmv(const RangeVar *relation, bool skipData, const char *queryString
 				QueryCompletion *qc)
 {
 	Oid matviewOid;
+
+	/*
+	 * Get a lock until end of transaction.
+	 */
+	matviewOid = RangeVarGetRelidExtended(relation,
+										  AccessExclusiveLock,
+										  0,
+										  RangeVarCallbackOwnsTable,
+										  NULL);
+
+	return refresh_immv_by_oid(matviewOid, skipData, queryString, qc);
+}
+
+/*
+ * refresh_immv_by_oid
+ *
+ * Refresh the IMMV, and then the IMMVs defined on it. The caller must have
+ * checked the permission on the IMMV.
+ */
+static ObjectAddress
+refresh_immv_by_oid(Oid matviewOid, bool skipData, const char *queryString, QueryCompletion *qc)
+{
 	Relation matviewRel;
 	Query *dataQuery = NULL; /* initialized to keep compiler happy */
 	Query *viewQuery;
@@ -239,6 +406,7 @@ ExecRefreshImmv(const RangeVar *relation, bool skipData, const char *queryString
 	int save_nestlevel;
 	ObjectAddress address;
 	bool oldPopulated;
+	List *dependent_immvs;
 
 	Relation pgIvmImmv;
 	TupleDesc tupdesc;
@@ -253,13 +421,15 @@ ExecRefreshImmv(const RangeVar *relation, bool skipData, const char *queryString
 	// lockmode = concurrent ? ExclusiveLock : AccessExclusiveLock;
 	lockmode = AccessExclusiveLock;
 
-	/*
-	 * Get a lock until end of transaction.
-	 */
-	matviewOid = RangeVarGetRelidExtended(relation, lockmode, 0, RangeVarCallbackOwnsTable, NULL);
 	matviewRel = table_open(matviewOid, lockmode);
 	relowner = matviewRel->rd_rel->relowner;
 
+	/*
+	 * IMMVs defined on this IMMV are not maintained by refreshing it, so they
+	 * are refreshed next.
+	 */
+	dependent_immvs = get_dependent_immvs(matviewRel, false);
+
 	/*
 	 * Switch to the owner's userid, so that any functions are run as that
 	 * user.  Also lock down security-restricted operations and arrange to
@@ -322,7 +492,7 @@ ExecRefreshImmv(const RangeVar *relation, bool skipData, const char *queryString
 	systable_endscan(scan);
 	table_close(pgIvmImmv, NoLock);
 
-	viewQuery = get_immv_query(matviewRel);
+	viewQuery = get_immv_query(matviewRel, NULL);
 
 	/* For IMMV, we need to rewrite matview query */
 	if (!skipData)
@@ -442,6 +612,15 @@ ExecRefreshImmv(const RangeVar *relation, bool skipData, const char *queryString
 	if (!skipData && !oldPopulated)
 		CreateIvmTriggersOnBaseTables(viewQuery, matviewOid);
 
+	if (!skipData)
+	{
+		ImmvStatCounters stat;
+
+		memset(&stat, 0, sizeof(ImmvStatCounters));
+		stat.full_refreshes = 1;
+		ImmvStatReport(matviewOid, &stat);
+	}
+
 	table_close(matviewRel, NoLock);
 
 	/* Roll back any GUC changes */
@@ -450,6 +629,8 @@ ExecRefreshImmv(const RangeVar *relation, bool skipData, const char *queryString
 	/* Restore userid and security context */
 	SetUserIdAndSecContext(save_userid, save_sec_context);
 
+	refresh_dependent_immvs(dependent_immvs, skipData, queryString, true);
+
 	ObjectAddressSet(address, RelationRelationId, matviewOid);
 
 	/*
@@ -466,6 +647,125 @@ ExecRefreshImmv(const RangeVar *relation, bool skipData, const char *queryString
 	return address;
 }
 
+/*
+ * get_dependent_immvs
+ *
+ * Return OIDs of IMMVs defined on the IMMV. They are found by dependencies
+ * of IMMVs on relations in their queries, which are recorded when they are
+ * created, since IVM triggers on the IMMV are dropped while an IMMV is not
+ * populated. If populated_only is true, only IMMVs with IVM triggers on the
+ * IMMV, that is, populated ones, are returned.
+ */
+static List *
+get_dependent_immvs(Relation matviewRel, bool populated_only)
+{
+	TriggerDesc *trigdesc = matviewRel->trigdesc;
+	List *triggered = NIL;
+	List *immvs = NIL;
+	Relation depRel;
+	ScanKeyData key[2];
+	SysScanDesc scan;
+	HeapTuple tup;
+	int i;
+
+	if (populated_only)
+	{
+		if (trigdesc == NULL)
+			return NIL;
+
+		for (i = 0; i < trigdesc->numtriggers; i++)
+		{
+			Trigger *trigger = &trigdesc->triggers[i];
+
+			if (strncmp(trigger->tgname, "IVM_trigger_", 12) != 0 || trigger->tgnargs < 1)
+				continue;
+
+			triggered = list_append_unique_oid(
+				triggered,
+				DatumGetObjectId(DirectFunctionCall1(oidin, CStringGetDatum(trigger->tgargs[0]))));
+		}
+
+		if (triggered == NIL)
+			return NIL;
+	}
+
+	depRel = table_open(DependRelationId, AccessShareLock);
+
+	ScanKeyInit(&key[0],
+				Anum_pg_depend_refclassid,
+				BTEqualStrategyNumber,
+				F_OIDEQ,
+				ObjectIdGetDatum(RelationRelationId));
+	ScanKeyInit(&key[1],
+				Anum_pg_depend_refobjid,
+				BTEqualStrategyNumber,
+				F_OIDEQ,
+				ObjectIdGetDatum(RelationGetRelid(matviewRel)));
+
+	scan = systable_beginscan(depRel, DependReferenceIndexId, true, NULL, 2, key);
+	while (HeapTupleIsValid(tup = systable_getnext(scan)))
+	{
+		Form_pg_depend dep = (Form_pg_depend) GETSTRUCT(tup);
+
+		if (dep->classid != RelationRelationId || dep->objsubid != 0 ||
+			dep->deptype != DEPENDENCY_NORMAL)
+			continue;
+		if (populated_only && !list_member_oid(triggered, dep->objid))
+			continue;
+		if (list_member_oid(immvs, dep->objid) || !isImmv(dep->objid))
+			continue;
+
+		immvs = lappend_oid(immvs, dep->objid);
+	}
+	systable_endscan(scan);
+
+	table_close(depRel, AccessShareLock);
+
+	return immvs;
+}
+
+/*
+ * refresh_dependent_immvs
+ *
+ * Refresh the IMMVs defined on an IMMV after the IMMV is refreshed without
+ * firing their triggers. They are populated or not as well as the IMMV.
+ * IMMVs dropped since they were found are skipped. If check_owner is true,
+ * the current user must own them as refresh_immv() requires; it is false
+ * when the refresh is a part of the maintenance of the IMMV.
+ */
+static void
+refresh_dependent_immvs(List *immvs, bool skipData, const char *queryString,
+						bool check_owner)
+{
+	ListCell *lc;
+
+	foreach (lc, immvs)
+	{
+		Oid immvOid = lfirst_oid(lc);
+
+		/* Skip IMMVs dropped concurrently since they were found */
+		LockRelationOid(immvOid, AccessExclusiveLock);
+		if (!SearchSysCacheExists1(RELOID, ObjectIdGetDatum(immvOid)))
+		{
+			UnlockRelationOid(immvOid, AccessExclusiveLock);
+			continue;
+		}
+
+		if (check_owner &&
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 160000)
+			!object_ownercheck(RelationRelationId, immvOid, GetUserId()))
+#else
+			!pg_class_ownercheck(immvOid, GetUserId()))
+#endif
+			aclcheck_error(ACLCHECK_NOT_OWNER,
+						   get_relkind_objtype(get_rel_relkind(immvOid)),
+						   get_rel_name(immvOid));
+
+		elog(IVM_LOG_LEVEL, "refreshing IMMV %u defined on a refreshed IMMV", immvOid);
+		refresh_immv_by_oid(immvOid, skipData, queryString, NULL);
+	}
+}
+
 /*
  * refresh_immv_datafill
  *
@@ -587,9 +887,13 @@ CloseImmvIncrementalMaintenance(void)
 
 /*
  * get_immv_query - get the Query of IMMV.
+ *
+ * If multiset is not NULL, it is set to true if the IMMV stores a row per
+ * distinct tuple with its multiplicity. The Query of such an IMMV has
+ * DISTINCT on all columns, which is not a part of the view definition.
  */
 Query *
-get_immv_query(Relation matviewRel)
+get_immv_query(Relation matviewRel, bool *multiset)
 {
 	Relation pgIvmImmv = table_open(PgIvmImmvRelationId(), AccessShareLock);
 	TupleDesc tupdesc = RelationGetDescr(pgIvmImmv);
@@ -620,26 +924,425 @@ get_immv_query(Relation matviewRel)
 	Assert(!isnull);
 	query = (Query *) stringToNode(TextDatumGetCString(datum));
 
+	if (multiset)
+	{
+		datum = heap_getattr(tup, Anum_pg_ivm_immv_ismultiset, tupdesc, &isnull);
+		*multiset = !isnull && DatumGetBool(datum);
+	}
+
 	systable_endscan(scan);
 	table_close(pgIvmImmv, NoLock);
 
 	return query;
 }
 
-static Tuplestorestate *
-tuplestore_copy(Tuplestorestate *tuplestore, Relation rel)
+/*
+ * BuildImmvMaintDesc
+ *
+ * Derive the parts of the maintenance descriptor of an IMMV stored in
+ * pg_ivm_immv from its view definition query: numbers of the columns used as
+ * keys to identify a row of the view, and the kind of aggregate of each
+ * column, IVM_AGG_XXX. Both are returned as arrays.
+ */
+void
+BuildImmvMaintDesc(Query *query, Datum *keyattnums, Datum *aggkinds)
 {
-	Tuplestorestate *res = NULL;
-	TupleDesc tupdesc = RelationGetDescr(rel);
-	TupleTableSlot *slot = MakeSingleTupleTableSlot(tupdesc, &TTSOpsMinimalTuple);
+	int natts = list_length(query->targetList);
+	Datum *keys = (Datum *) palloc(sizeof(Datum) * Max(natts, 1));
+	Datum *kinds = (Datum *) palloc(sizeof(Datum) * Max(natts, 1));
+	int nkeys = 0;
+	ListCell *lc;
+	int i = 0;
+
+	foreach (lc, query->targetList)
+	{
+		TargetEntry *tle = (TargetEntry *) lfirst(lc);
+		char kind = IVM_AGG_NONE;
+
+		kinds[i++] = CharGetDatum(IVM_AGG_NONE);
+
+		if (tle->resjunk)
+			continue;
+
+		/*
+		 * For views without aggregates, all attributes are used as keys to identify a
+		 * tuple in a view.
+		 */
+		if (!query->hasAggs)
+			keys[nkeys++] = Int16GetDatum(i);
 
+		if (query->hasAggs && IsA(tle->expr, Aggref))
+		{
+			const char *aggname = get_func_name(((Aggref *) tle->expr)->aggfnoid);
+
+			/*
+			 * We can use function names here because it is already checked if these
+			 * can be used in IMMV by its OID at the definition time.
+			 */
+			if (!strcmp(aggname, "count"))
+				kind = IVM_AGG_COUNT;
+			else if (!strcmp(aggname, "sum"))
+				kind = IVM_AGG_SUM;
+			else if (!strcmp(aggname, "avg"))
+				kind = IVM_AGG_AVG;
+			else if (!strcmp(aggname, "min"))
+				kind = IVM_AGG_MIN;
+			else if (!strcmp(aggname, "max"))
+				kind = IVM_AGG_MAX;
+			else
+				elog(ERROR, "unsupported aggregate function: %s", aggname);
+
+			kinds[i - 1] = CharGetDatum(kind);
+		}
+	}
+
+	/* If we have GROUP BY clause, we use its entries as keys. */
+	if (query->hasAggs && query->groupClause)
+	{
+		foreach (lc, query->groupClause)
+		{
+			SortGroupClause *sgcl = (SortGroupClause *) lfirst(lc);
+			TargetEntry *tle = get_sortgroupclause_tle(sgcl, query->targetList);
+
+			keys[nkeys++] = Int16GetDatum(tle->resno);
+		}
+	}
+
+	*keyattnums = PointerGetDatum(
+		construct_array(keys, nkeys, INT2OID, sizeof(int16), true, TYPALIGN_SHORT));
+	*aggkinds = PointerGetDatum(
+		construct_array(kinds, natts, CHAROID, sizeof(char), true, TYPALIGN_CHAR));
+}
+
+/*
+ * delta_store_copy
+ *
+ * Copy a transition table into a new delta store, or return the store of
+ * the transition table already copied for another IMMV by the trigger fired
+ * by the same query. If the total size of the delta stores in the
+ * transaction exceeds pg_ivm.delta_mem, least recently used ones are spilled
+ * to temporary files.
+ */
+static MV_DeltaStore *
+delta_store_copy(Tuplestorestate *tuplestore, Relation rel, Trigger *trigger)
+{
+	MemoryContext oldcxt;
+	MV_DeltaStore *store;
+	TupleTableSlot *slot;
+	ListCell *lc;
+
+	foreach (lc, mv_delta_stores)
+	{
+		store = (MV_DeltaStore *) lfirst(lc);
+
+		if (store->source == tuplestore &&
+			store->depth == mv_query_depth &&
+			store->ntuples == tuplestore_tuple_count(tuplestore) &&
+			RelationGetDescr(rel)->tdtypeid == store->tupdesc->tdtypeid)
+		{
+			store->refcount++;
+			if (store->unfired > 0)
+				store->unfired--;
+			mv_delta_shared_stores++;
+
+			/* move it to the end as the most recently used */
+			oldcxt = MemoryContextSwitchTo(TopTransactionContext);
+			mv_delta_stores = list_delete_ptr(mv_delta_stores, store);
+			mv_delta_stores = lappend(mv_delta_stores, store);
+			MemoryContextSwitchTo(oldcxt);
+
+			return store;
+		}
+	}
+
+	oldcxt = MemoryContextSwitchTo(TopTransactionContext);
+	store = (MV_DeltaStore *) palloc(sizeof(MV_DeltaStore));
+
+	store->source = tuplestore;
+	store->ntuples = tuplestore_tuple_count(tuplestore);
+	store->depth = mv_query_depth;
+	store->refcount = 1;
+	store->unfired = count_ivm_triggers(rel, trigger) - 1;
+	store->tupdesc = CreateTupleDescCopy(RelationGetDescr(rel));
+	store->tuplestore = tuplestore_begin_heap(false, false, delta_mem_available());
+	store->compact = NULL;
+	store->bytes = 0;
+	store->compact_bytes = 0;
+
+	slot = MakeSingleTupleTableSlot(store->tupdesc, &TTSOpsMinimalTuple);
 	tuplestore_rescan(tuplestore);
-	res = tuplestore_begin_heap(false, false, work_mem);
 	while (tuplestore_gettupleslot(tuplestore, true, false, slot))
-		tuplestore_puttupleslot(res, slot);
+	{
+		bool shouldFree;
+		MinimalTuple tuple = ExecFetchSlotMinimalTuple(slot, &shouldFree);
+
+		store->bytes += tuple->t_len;
+		tuplestore_puttupleslot(store->tuplestore, slot);
+	}
 	ExecDropSingleTupleTableSlot(slot);
 
-	return res;
+	/* The tuplestore spills by itself if the tuples exceed what is left of the budget. */
+	store->spilled = !tuplestore_in_memory(store->tuplestore);
+	if (store->spilled)
+	{
+		mv_delta_spilled_bytes += store->bytes;
+		mv_delta_spilled_stores++;
+		store->bytes = 0;
+	}
+
+	mv_delta_stores = lappend(mv_delta_stores, store);
+	mv_delta_held_bytes += store->bytes;
+	mv_delta_peak_bytes = Max(mv_delta_peak_bytes, mv_delta_held_bytes);
+
+	MemoryContextSwitchTo(oldcxt);
+
+	foreach (lc, mv_delta_stores)
+	{
+		MV_DeltaStore *victim = (MV_DeltaStore *) lfirst(lc);
+
+		if (mv_delta_held_bytes <= (int64) ivm_delta_mem * 1024L)
+			break;
+
+		if (!victim->spilled)
+			delta_store_spill(victim);
+	}
+
+	return store;
+}
+
+/*
+ * count_ivm_triggers
+ *
+ * Count the IVM triggers on the table which fire for the same event as the
+ * given trigger, that is, the IMMVs which will use its transition tables.
+ * Triggers which do not fire in the current session_replication_role are
+ * skipped as trigger.c does.
+ */
+static int
+count_ivm_triggers(Relation rel, Trigger *trigger)
+{
+	TriggerDesc *trigdesc = rel->trigdesc;
+	int count = 0;
+	int i;
+
+	for (i = 0; i < trigdesc->numtriggers; i++)
+	{
+		Trigger *t = &trigdesc->triggers[i];
+
+		if (t->tgfoid != trigger->tgfoid || t->tgtype != trigger->tgtype)
+			continue;
+
+		if (SessionReplicationRole == SESSION_REPLICATION_ROLE_REPLICA)
+		{
+			if (t->tgenabled == TRIGGER_FIRES_ON_ORIGIN || t->tgenabled == TRIGGER_DISABLED)
+				continue;
+		}
+		else
+		{
+			if (t->tgenabled == TRIGGER_FIRES_ON_REPLICA || t->tgenabled == TRIGGER_DISABLED)
+				continue;
+		}
+
+		count++;
+	}
+
+	return count;
+}
+
+/*
+ * delta_store_spill
+ *
+ * Move tuples in the delta store into a temporary file. The tuples are
+ * written in the compact format, which is much smaller than the minimal
+ * tuples a tuplestore would write for wide tables with repetitive values.
+ */
+static void
+delta_store_spill(MV_DeltaStore *store)
+{
+	MemoryContext oldcxt = MemoryContextSwitchTo(TopTransactionContext);
+	CompactDelta *compact = compact_delta_begin(store->tupdesc);
+	TupleTableSlot *slot = MakeSingleTupleTableSlot(store->tupdesc, &TTSOpsMinimalTuple);
+
+	tuplestore_rescan(store->tuplestore);
+	while (tuplestore_gettupleslot(store->tuplestore, true, false, slot))
+		compact_delta_put(compact, slot);
+	compact_delta_finish(compact);
+	ExecDropSingleTupleTableSlot(slot);
+
+	tuplestore_end(store->tuplestore);
+	store->tuplestore = NULL;
+	store->compact = compact;
+	store->spilled = true;
+
+	elog(IVM_LOG_LEVEL,
+		 "spilled a delta of " INT64_FORMAT " bytes into " INT64_FORMAT " bytes",
+		 store->bytes,
+		 compact_delta_bytes(compact));
+
+	mv_delta_held_bytes -= store->bytes;
+	mv_delta_spilled_bytes += store->bytes;
+	mv_delta_spilled_file_bytes += compact_delta_bytes(compact);
+	mv_delta_spilled_stores++;
+	store->compact_bytes = store->bytes;
+	store->bytes = 0;
+
+	MemoryContextSwitchTo(oldcxt);
+}
+
+/*
+ * delta_store_get_tuplestore
+ *
+ * Return the tuplestore of the delta store. If the tuples are spilled in the
+ * compact format, they are decoded into a new tuplestore, which can spill
+ * by itself if the remaining budget is not enough. Decoded tuples held in
+ * memory are charged to the budget again until the store is released, and
+ * the store is not spilled again since its tuplestore is being read.
+ */
+static Tuplestorestate *
+delta_store_get_tuplestore(MV_DeltaStore *store)
+{
+	if (store->compact)
+	{
+		MemoryContext oldcxt = MemoryContextSwitchTo(TopTransactionContext);
+
+		store->tuplestore = tuplestore_begin_heap(false, false, delta_mem_available());
+		compact_delta_read(store->compact, store->tuplestore);
+		compact_delta_end(store->compact);
+		store->compact = NULL;
+
+		if (tuplestore_in_memory(store->tuplestore))
+		{
+			store->bytes = store->compact_bytes;
+			mv_delta_held_bytes += store->bytes;
+			mv_delta_peak_bytes = Max(mv_delta_peak_bytes, mv_delta_held_bytes);
+		}
+
+		MemoryContextSwitchTo(oldcxt);
+	}
+
+	return store->tuplestore;
+}
+
+/*
+ * delta_store_end
+ *
+ * Release the delta store and its budget, if no other IMMV uses it and no
+ * other IMMV on the table is going to share it.
+ */
+static void
+delta_store_end(MV_DeltaStore *store)
+{
+	if (--store->refcount > 0 || store->unfired > 0)
+		return;
+
+	delta_store_free(store);
+}
+
+/*
+ * delta_store_free
+ *
+ * Free the delta store and return its budget.
+ */
+static void
+delta_store_free(MV_DeltaStore *store)
+{
+	mv_delta_stores = list_delete_ptr(mv_delta_stores, store);
+	mv_delta_held_bytes -= store->bytes;
+
+	if (store->compact)
+		compact_delta_end(store->compact);
+	if (store->tuplestore)
+		tuplestore_end(store->tuplestore);
+	FreeTupleDesc(store->tupdesc);
+	pfree(store);
+}
+
+/*
+ * IVM_BeginQueryFinish
+ *
+ * Called when the executor starts to finish a query, where its AFTER
+ * triggers are fired.
+ */
+void
+IVM_BeginQueryFinish(void)
+{
+	mv_query_depth++;
+}
+
+/*
+ * IVM_EndQueryFinish
+ *
+ * Called when the executor has finished a query, even on error. The
+ * transition tables of the query have been freed, so delta stores copied
+ * from them are not shared any more, and ones left only for IMMVs whose
+ * triggers did not fire are freed.
+ */
+void
+IVM_EndQueryFinish(void)
+{
+	List *unused = NIL;
+	ListCell *lc;
+
+	foreach (lc, mv_delta_stores)
+	{
+		MV_DeltaStore *store = (MV_DeltaStore *) lfirst(lc);
+
+		if (store->depth < mv_query_depth)
+			continue;
+
+		store->source = NULL;
+		store->unfired = 0;
+		if (store->refcount == 0)
+			unused = lappend(unused, store);
+	}
+
+	foreach (lc, unused)
+		delta_store_free((MV_DeltaStore *) lfirst(lc));
+	list_free(unused);
+
+	mv_query_depth--;
+	Assert(mv_query_depth >= 0);
+}
+
+/*
+ * delta_mem_available
+ *
+ * Return the memory in kilobytes which a new tuplestore for a view delta
+ * can use within pg_ivm.delta_mem. Keep a small minimum so that a tuplestore
+ * is not spilled on every tuple.
+ */
+static int
+delta_mem_available(void)
+{
+	int64 available = ivm_delta_mem - mv_delta_held_bytes / 1024L;
+
+	return (int) Max(available, 64);
+}
+
+/*
+ * pg_ivm_delta_mem_stats
+ *
+ * Show memory usage of deltas held in this backend.
+ */
+Datum
+pg_ivm_delta_mem_stats(PG_FUNCTION_ARGS)
+{
+	TupleDesc tupdesc;
+	Datum values[6];
+	bool nulls[6];
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	memset(nulls, 0, sizeof(nulls));
+	values[0] = Int64GetDatum(mv_delta_held_bytes);
+	values[1] = Int64GetDatum(mv_delta_peak_bytes);
+	values[2] = Int64GetDatum(mv_delta_spilled_bytes);
+	values[3] = Int64GetDatum(mv_delta_spilled_stores);
+	values[4] = Int64GetDatum(mv_delta_spilled_file_bytes);
+	values[5] = Int64GetDatum(mv_delta_shared_stores);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
 }
 
 /* ----------------------------------------------------
@@ -659,17 +1362,35 @@ IVM_immediate_before(PG_FUNCTION_ARGS)
 {
 	TriggerData *trigdata = (TriggerData *) fcinfo->context;
 	char *matviewOid_text = trigdata->tg_trigger->tgargs[0];
-	char *ex_lock_text = trigdata->tg_trigger->tgargs[1];
 	Oid matviewOid;
 	MV_TriggerHashEntry *entry;
 	bool found;
-	bool ex_lock;
+	char lock_scope;
+	instr_time lock_start;
+	double lock_wait_time;
 
 	matviewOid = DatumGetObjectId(DirectFunctionCall1(oidin, CStringGetDatum(matviewOid_text)));
-	ex_lock = DatumGetBool(DirectFunctionCall1(boolin, CStringGetDatum(ex_lock_text)));
+	lock_scope = get_ivm_lock_scope(trigdata->tg_trigger);
+
+	/*
+	 * Deferring the lock works only if changes committed during the wait are
+	 * visible at the maintenance time.
+	 */
+	if (lock_scope == IVM_LOCK_SCOPE_DEFERRED && IsolationUsesXactSnapshot())
+		lock_scope = IVM_LOCK_SCOPE_VIEW;
+
+	INSTR_TIME_SET_CURRENT(lock_start);
+
+	/*
+	 * Take IMMV locks of the scheduler deferred from ExecutorStart. A change
+	 * of an IMMV by its maintenance is not a query seen by the scheduler, so
+	 * IMMVs defined on it are locked below.
+	 */
+	if (!ImmvIncrementalMaintenanceIsEnabled())
+		SchedulerLockImmvs(trigdata->tg_relation, trigdata->tg_trigger);
 
 	/* If the view has more than one tables, we have to use an exclusive lock. */
-	if (ex_lock)
+	if (lock_scope == IVM_LOCK_SCOPE_VIEW)
 	{
 		/*
 		 * Wait for concurrent transactions which update this materialized view at
@@ -698,8 +1419,21 @@ IVM_immediate_before(PG_FUNCTION_ARGS)
 							relname)));
 		}
 	}
+	else if (lock_scope == IVM_LOCK_SCOPE_DEFERRED)
+	{
+		/*
+		 * ExclusiveLock is taken later in IVM_immediate_maintenance. Taking a
+		 * lock conflicting with it here would cause a dead-lock on upgrading.
+		 */
+		LockRelationOid(matviewOid, AccessShareLock);
+	}
 	else
+	{
+		/* Groups touched by the change are locked later in apply_delta. */
 		LockRelationOid(matviewOid, RowExclusiveLock);
+	}
+
+	lock_wait_time = ImmvStatElapsed(lock_start);
 
 	elog(IVM_LOG_LEVEL, "Pid %d: IVM_immediate_before: Locking matviewOid: %d", MyProcPid, matviewOid);
 
@@ -725,16 +1459,76 @@ IVM_immediate_before(PG_FUNCTION_ARGS)
 		entry->before_trig_count = 0;
 		entry->after_trig_count = 0;
 		entry->snapshot = RegisterSnapshot(snapshot);
+		entry->lock_scope = lock_scope;
 		entry->tables = NIL;
 		entry->has_old = false;
 		entry->has_new = false;
+		memset(&entry->stat, 0, sizeof(ImmvStatCounters));
 	}
+	else if (lock_scope == IVM_LOCK_SCOPE_VIEW)
+		entry->lock_scope = IVM_LOCK_SCOPE_VIEW;
 
 	entry->before_trig_count++;
+	entry->stat.lock_wait_time += lock_wait_time;
 
 	return PointerGetDatum(NULL);
 }
 
+/*
+ * get_ivm_lock_scope
+ *
+ * Get the lock scope of the IMMV from the arguments of an IVM trigger.
+ */
+static char
+get_ivm_lock_scope(Trigger *trigger)
+{
+	char *lock_scope_text = trigger->tgargs[1];
+
+	switch (lock_scope_text[0])
+	{
+		/* "true" and "false" are written by older versions */
+		case IVM_LOCK_SCOPE_VIEW:
+		case 't':
+			return IVM_LOCK_SCOPE_VIEW;
+		case IVM_LOCK_SCOPE_GROUP:
+		case 'f':
+			return IVM_LOCK_SCOPE_GROUP;
+		case IVM_LOCK_SCOPE_DEFERRED:
+			return IVM_LOCK_SCOPE_DEFERRED;
+		default:
+			elog(ERROR, "invalid lock scope of IVM trigger: \"%s\"", lock_scope_text);
+	}
+
+	return IVM_LOCK_SCOPE_VIEW; /* keep compiler quiet */
+}
+
+/*
+ * GetIvmSchedulerLockMode
+ *
+ * Get the lock mode on the IMMV which the query scheduler takes before the
+ * base table is modified by the event of the BEFORE trigger. This is the
+ * mode IVM_immediate_before takes: IMMVs maintained under RowExclusiveLock
+ * can be maintained by concurrent statements, so the scheduler takes the
+ * same mode. IMMVs whose ExclusiveLock is deferred to the maintenance get
+ * AccessShareLock, so that statements modifying their base tables are not
+ * serialized by the scheduler either; the later upgrade to ExclusiveLock
+ * cannot dead-lock because AccessShareLock does not conflict with it.
+ * Otherwise it takes ExclusiveLock, which is taken anyway before
+ * maintenance, so that locks are not upgraded later.
+ */
+LOCKMODE
+GetIvmSchedulerLockMode(Trigger *trigger)
+{
+	char lock_scope = get_ivm_lock_scope(trigger);
+
+	if (lock_scope == IVM_LOCK_SCOPE_GROUP)
+		return RowExclusiveLock;
+	if (lock_scope == IVM_LOCK_SCOPE_DEFERRED && !IsolationUsesXactSnapshot())
+		return AccessShareLock;
+
+	return ExclusiveLock;
+}
+
 /*
  * IVM_immediate_maintenance
  *
@@ -753,12 +1547,15 @@ IVM_immediate_maintenance(PG_FUNCTION_ARGS)
 	Query *rewritten = NULL;
 	char *matviewOid_text = trigdata->tg_trigger->tgargs[0];
 	Relation matviewRel;
-	int old_depth = immv_maintenance_depth;
 
 	Oid relowner;
 	Tuplestorestate *old_tuplestore = NULL;
 	Tuplestorestate *new_tuplestore = NULL;
 	DestReceiver *dest_new = NULL, *dest_old = NULL;
+	Tuplestorestate *term_old_tuplestore = NULL;
+	Tuplestorestate *term_new_tuplestore = NULL;
+	DestReceiver *term_dest_new = NULL, *term_dest_old = NULL;
+	HTAB *delta_keys = NULL;
 	Oid save_userid;
 	int save_sec_context;
 	int save_nestlevel;
@@ -772,6 +1569,14 @@ IVM_immediate_maintenance(PG_FUNCTION_ARGS)
 	MemoryContext oldcxt;
 	ListCell *lc;
 	int i;
+	instr_time maintenance_start;
+	instr_time step_start;
+	TupleDesc tupdesc_old = NULL;
+	TupleDesc tupdesc_new = NULL;
+	int nterms = 0;
+	int total_terms = 0;
+	bool pending_use_count = false;
+	char *pending_count_colname = NULL;
 
 	/* Create a ParseState for rewriting the view definition query */
 	pstate = make_parsestate(NULL);
@@ -827,17 +1632,19 @@ IVM_immediate_maintenance(PG_FUNCTION_ARGS)
 	/* Save the transition tables and make a request to not free immediately */
 	if (trigdata->tg_oldtable)
 	{
+		MV_DeltaStore *store = delta_store_copy(trigdata->tg_oldtable, rel, trigdata->tg_trigger);
+
 		oldcxt = MemoryContextSwitchTo(TopTransactionContext);
-		table->old_tuplestores =
-			lappend(table->old_tuplestores, tuplestore_copy(trigdata->tg_oldtable, rel));
+		table->old_tuplestores = lappend(table->old_tuplestores, store);
 		entry->has_old = true;
 		MemoryContextSwitchTo(oldcxt);
 	}
 	if (trigdata->tg_newtable)
 	{
+		MV_DeltaStore *store = delta_store_copy(trigdata->tg_newtable, rel, trigdata->tg_trigger);
+
 		oldcxt = MemoryContextSwitchTo(TopTransactionContext);
-		table->new_tuplestores =
-			lappend(table->new_tuplestores, tuplestore_copy(trigdata->tg_newtable, rel));
+		table->new_tuplestores = lappend(table->new_tuplestores, store);
 		entry->has_new = true;
 		MemoryContextSwitchTo(oldcxt);
 	}
@@ -850,6 +1657,7 @@ IVM_immediate_maintenance(PG_FUNCTION_ARGS)
 	/*
 	 * If this is the last AFTER trigger call, continue and update the view.
 	 */
+	INSTR_TIME_SET_CURRENT(maintenance_start);
 
 	/*
 	 * Advance command counter to make the updated base table row locally
@@ -857,6 +1665,30 @@ IVM_immediate_maintenance(PG_FUNCTION_ARGS)
 	 */
 	CommandCounterIncrement();
 
+	/*
+	 * If locking the view was deferred, wait for concurrent transactions
+	 * maintaining this view here. After that, renew the snapshot used for
+	 * checking the pre-update state so that changes committed during the
+	 * wait are regarded as a part of the pre-update state. Changes made by
+	 * this statement are still invisible because the command id is kept.
+	 */
+	if (entry->lock_scope == IVM_LOCK_SCOPE_DEFERRED)
+	{
+		Snapshot snapshot;
+
+		INSTR_TIME_SET_CURRENT(step_start);
+		LockRelationOid(matviewOid, ExclusiveLock);
+		entry->stat.lock_wait_time += ImmvStatElapsed(step_start);
+
+		PushCopiedSnapshot(GetLatestSnapshot());
+		snapshot = GetActiveSnapshot();
+		snapshot->curcid = entry->snapshot->curcid;
+
+		UnregisterSnapshot(entry->snapshot);
+		entry->snapshot = RegisterSnapshot(snapshot);
+		PopActiveSnapshot();
+	}
+
 	matviewRel = table_open(matviewOid, NoLock);
 
 	/* Make sure IMMV is a table. */
@@ -888,7 +1720,7 @@ IVM_immediate_maintenance(PG_FUNCTION_ARGS)
 	save_nestlevel = NewGUCNestLevel();
 
 	/* get view query*/
-	query = get_immv_query(matviewRel);
+	query = get_immv_query(matviewRel, NULL);
 
 	/*
 	 * When a base table is truncated, the view content will be empty if the
@@ -928,6 +1760,7 @@ IVM_immediate_maintenance(PG_FUNCTION_ARGS)
 			uint64 processed = 0;
 			Query *dataQuery = rewriteQueryForIMMV(query, NIL);
 			char relpersistence = matviewRel->rd_rel->relpersistence;
+			List *dependent_immvs = get_dependent_immvs(matviewRel, true);
 
 			/*
 			 * Create the transient table that will receive the regenerated data. Lock
@@ -956,8 +1789,17 @@ IVM_immediate_maintenance(PG_FUNCTION_ARGS)
 			/* Inform cumulative stats system about our activity */
 			pgstat_count_truncate(matviewRel);
 			pgstat_count_heap_insert(matviewRel, processed);
+
+			entry->stat.full_refreshes++;
+
+			/* The heap swap fires no trigger of IMMVs defined on this IMMV. */
+			refresh_dependent_immvs(dependent_immvs, false, "", false);
 		}
 
+		entry->stat.calls++;
+		entry->stat.total_time = ImmvStatElapsed(maintenance_start);
+		ImmvStatReport(matviewOid, &entry->stat);
+
 		/* Clean up hash entry and delete tuplestores */
 		clean_up_IVM_hash_entry(entry, false);
 
@@ -978,6 +1820,7 @@ IVM_immediate_maintenance(PG_FUNCTION_ARGS)
 	/*
 	 * rewrite query for calculating deltas
 	 */
+	INSTR_TIME_SET_CURRENT(step_start);
 
 	rewritten = copyObject(query);
 
@@ -1003,45 +1846,36 @@ IVM_immediate_maintenance(PG_FUNCTION_ARGS)
 	/* Rewrite for DISTINCT clause and aggregates functions */
 	rewritten = rewrite_query_for_distinct_and_aggregates(rewritten, pstate);
 
+	entry->stat.rewrite_time += ImmvStatElapsed(step_start);
+
 	/* Create tuplestores to store view deltas */
 	if (entry->has_old)
-	{
-		oldcxt = MemoryContextSwitchTo(TopTransactionContext);
-
-		old_tuplestore = tuplestore_begin_heap(false, false, work_mem);
-		dest_old = CreateDestReceiver(DestTuplestore);
-#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 140000)
-		SetTuplestoreDestReceiverParams(dest_old,
-										old_tuplestore,
-										TopTransactionContext,
-										false,
-										NULL,
-										NULL);
-#else
-		SetTuplestoreDestReceiverParams(dest_old, old_tuplestore, TopTransactionContext, false);
-#endif
-		MemoryContextSwitchTo(oldcxt);
-	}
+		old_tuplestore = begin_delta_tuplestore(&dest_old);
 	if (entry->has_new)
-	{
-		oldcxt = MemoryContextSwitchTo(TopTransactionContext);
+		new_tuplestore = begin_delta_tuplestore(&dest_new);
 
-		new_tuplestore = tuplestore_begin_heap(false, false, work_mem);
-		dest_new = CreateDestReceiver(DestTuplestore);
-#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 140000)
-		SetTuplestoreDestReceiverParams(dest_new,
-										new_tuplestore,
-										TopTransactionContext,
-										false,
-										NULL,
-										NULL);
-#else
-		SetTuplestoreDestReceiverParams(dest_new, new_tuplestore, TopTransactionContext, false);
-#endif
-		MemoryContextSwitchTo(oldcxt);
+	/*
+	 * Terms after the first are calculated in separate tuplestores, to be
+	 * checked before they are combined with the terms so far.
+	 */
+	foreach (lc, entry->tables)
+		total_terms += list_length(((MV_TriggerTable *) lfirst(lc))->rte_paths);
+	if (total_terms > 1)
+	{
+		if (entry->has_old)
+			term_old_tuplestore = begin_delta_tuplestore(&term_dest_old);
+		if (entry->has_new)
+			term_new_tuplestore = begin_delta_tuplestore(&term_dest_new);
 	}
 
-	/* for all modified tables */
+	/*
+	 * For all modified tables, calculate the terms of the view delta due to
+	 * changes on each of them. The terms are accumulated in the same
+	 * tuplestores and applied to the view at once, unless they have to be
+	 * applied with different count columns, or they touch the same rows of
+	 * the view. The maintenance queries expect at most one tuple for a row
+	 * of the view in each delta, so such terms are applied one by one.
+	 */
 	foreach (lc, entry->tables)
 	{
 		ListCell *lc2;
@@ -1054,8 +1888,6 @@ IVM_immediate_maintenance(PG_FUNCTION_ARGS)
 			List *rte_path = lfirst(lc2);
 			Query *querytree = rewritten;
 			RangeTblEntry *rte;
-			TupleDesc tupdesc_old;
-			TupleDesc tupdesc_new;
 			bool use_count = false;
 			char *count_colname = NULL;
 
@@ -1086,46 +1918,99 @@ IVM_immediate_maintenance(PG_FUNCTION_ARGS)
 				use_count = true;
 			}
 
+			/* apply the terms so far if this one is counted differently */
+			if (nterms > 0 &&
+				(use_count != pending_use_count ||
+				 (use_count && strcmp(count_colname, pending_count_colname) != 0)))
+			{
+				apply_combined_delta(matviewOid,
+									 entry,
+									 old_tuplestore,
+									 new_tuplestore,
+									 tupdesc_old,
+									 tupdesc_new,
+									 query,
+									 pending_use_count,
+									 pending_count_colname);
+				nterms = 0;
+				forget_delta_keys(&delta_keys);
+			}
+
 			/* calculate delta tables */
+			INSTR_TIME_SET_CURRENT(step_start);
+			IvmExplainSetStep(matviewOid, "calc_delta");
 			calc_delta(table,
 					   rte_path,
 					   rewritten,
-					   dest_old,
-					   dest_new,
+					   nterms == 0 ? dest_old : term_dest_old,
+					   nterms == 0 ? dest_new : term_dest_new,
 					   &tupdesc_old,
 					   &tupdesc_new,
 					   queryEnv);
+			entry->stat.calc_delta_time += ImmvStatElapsed(step_start);
+			IvmExplainSetStep(matviewOid, NULL);
 
-			/* Set the table in the query to post-update state */
-			rewritten = rewrite_query_for_postupdate_state(rewritten, table, rte_path);
-
-			PG_TRY();
+			/* combine the term with the terms so far if they don't share rows */
+			if (nterms > 0)
 			{
-				/* apply the delta tables to the materialized view */
-				apply_delta(matviewOid,
-							old_tuplestore,
-							new_tuplestore,
-							tupdesc_old,
-							tupdesc_new,
-							query,
-							use_count,
-							count_colname);
-			}
-			PG_CATCH();
-			{
-				immv_maintenance_depth = old_depth;
-				PG_RE_THROW();
+				List *keys = get_maint_desc(matviewRel, query)->keys;
+
+				if (delta_keys == NULL)
+					(void) add_delta_keys(&delta_keys,
+										  keys,
+										  old_tuplestore,
+										  tupdesc_old,
+										  new_tuplestore,
+										  tupdesc_new);
+
+				if (!add_delta_keys(&delta_keys,
+									keys,
+									term_old_tuplestore,
+									tupdesc_old,
+									term_new_tuplestore,
+									tupdesc_new))
+				{
+					apply_combined_delta(matviewOid,
+										 entry,
+										 old_tuplestore,
+										 new_tuplestore,
+										 tupdesc_old,
+										 tupdesc_new,
+										 query,
+										 pending_use_count,
+										 pending_count_colname);
+					nterms = 0;
+					forget_delta_keys(&delta_keys);
+				}
+
+				append_delta_tuples(old_tuplestore, term_old_tuplestore, tupdesc_old);
+				append_delta_tuples(new_tuplestore, term_new_tuplestore, tupdesc_new);
 			}
-			PG_END_TRY();
 
-			/* clear view delta tuplestores */
-			if (old_tuplestore)
-				tuplestore_clear(old_tuplestore);
-			if (new_tuplestore)
-				tuplestore_clear(new_tuplestore);
+			/* Set the table in the query to post-update state */
+			rewritten = rewrite_query_for_postupdate_state(rewritten, table, rte_path);
+
+			pending_use_count = use_count;
+			pending_count_colname = count_colname;
+			nterms++;
 		}
 	}
 
+	if (nterms > 0)
+		apply_combined_delta(matviewOid,
+							 entry,
+							 old_tuplestore,
+							 new_tuplestore,
+							 tupdesc_old,
+							 tupdesc_new,
+							 query,
+							 pending_use_count,
+							 pending_count_colname);
+
+	entry->stat.calls++;
+	entry->stat.total_time = ImmvStatElapsed(maintenance_start);
+	ImmvStatReport(matviewOid, &entry->stat);
+
 	/* Clean up hash entry and delete tuplestores */
 	clean_up_IVM_hash_entry(entry, false);
 	if (old_tuplestore)
@@ -1138,6 +2023,16 @@ IVM_immediate_maintenance(PG_FUNCTION_ARGS)
 		dest_new->rDestroy(dest_new);
 		tuplestore_end(new_tuplestore);
 	}
+	if (term_old_tuplestore)
+	{
+		term_dest_old->rDestroy(term_dest_old);
+		tuplestore_end(term_old_tuplestore);
+	}
+	if (term_new_tuplestore)
+	{
+		term_dest_new->rDestroy(term_dest_new);
+		tuplestore_end(term_new_tuplestore);
+	}
 
 	/* Pop the original snapshot. */
 	PopActiveSnapshot();
@@ -1153,6 +2048,166 @@ IVM_immediate_maintenance(PG_FUNCTION_ARGS)
 	return PointerGetDatum(NULL);
 }
 
+/*
+ * apply_combined_delta
+ *
+ * Apply the view delta accumulated from the terms in the tuplestores to the
+ * view, and clear the tuplestores. All the terms must be counted by the same
+ * count column, and must not touch the same rows of the view.
+ */
+static void
+apply_combined_delta(Oid matviewOid, MV_TriggerHashEntry *entry, Tuplestorestate *old_tuplestore,
+					 Tuplestorestate *new_tuplestore, TupleDesc tupdesc_old,
+					 TupleDesc tupdesc_new, Query *query, bool use_count, char *count_colname)
+{
+	int old_depth = immv_maintenance_depth;
+	instr_time step_start;
+
+	PG_TRY();
+	{
+		/* apply the delta tables to the materialized view */
+		INSTR_TIME_SET_CURRENT(step_start);
+		IvmExplainSetStep(matviewOid, "apply_delta");
+		apply_delta(matviewOid,
+					old_tuplestore,
+					new_tuplestore,
+					tupdesc_old,
+					tupdesc_new,
+					query,
+					use_count,
+					count_colname,
+					entry->lock_scope == IVM_LOCK_SCOPE_GROUP,
+					&entry->stat);
+		entry->stat.apply_delta_time += ImmvStatElapsed(step_start);
+		IvmExplainSetStep(matviewOid, NULL);
+	}
+	PG_CATCH();
+	{
+		immv_maintenance_depth = old_depth;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	/* clear view delta tuplestores */
+	if (old_tuplestore)
+		tuplestore_clear(old_tuplestore);
+	if (new_tuplestore)
+		tuplestore_clear(new_tuplestore);
+}
+
+/*
+ * begin_delta_tuplestore
+ *
+ * Create a tuplestore to store view deltas and a DestReceiver which puts
+ * tuples into it. They live until the end of the transaction.
+ */
+static Tuplestorestate *
+begin_delta_tuplestore(DestReceiver **dest)
+{
+	Tuplestorestate *tuplestore;
+	MemoryContext oldcxt = MemoryContextSwitchTo(TopTransactionContext);
+
+	tuplestore = tuplestore_begin_heap(false, false, delta_mem_available());
+	*dest = CreateDestReceiver(DestTuplestore);
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 140000)
+	SetTuplestoreDestReceiverParams(*dest, tuplestore, TopTransactionContext, false, NULL, NULL);
+#else
+	SetTuplestoreDestReceiverParams(*dest, tuplestore, TopTransactionContext, false);
+#endif
+	MemoryContextSwitchTo(oldcxt);
+
+	return tuplestore;
+}
+
+/*
+ * append_delta_tuples
+ *
+ * Move the view delta of a term from src to the end of dst.
+ */
+static void
+append_delta_tuples(Tuplestorestate *dst, Tuplestorestate *src, TupleDesc tupdesc)
+{
+	TupleTableSlot *slot;
+
+	if (src == NULL || tuplestore_tuple_count(src) == 0)
+		return;
+
+	slot = MakeSingleTupleTableSlot(tupdesc, &TTSOpsMinimalTuple);
+	tuplestore_rescan(src);
+	while (tuplestore_gettupleslot(src, true, false, slot))
+		tuplestore_puttupleslot(dst, slot);
+	tuplestore_clear(src);
+
+	ExecDropSingleTupleTableSlot(slot);
+}
+
+/*
+ * add_delta_keys
+ *
+ * Add the keys of rows of the view touched by view deltas to the set
+ * delta_keys, which is created if NULL, unless any of them is already in the
+ * set. Return false if so, that is, if the deltas touch a row of the view
+ * touched by the deltas added before. Keys are compared by their hash values,
+ * so a collision is taken as an overlap, which only costs an extra pass of
+ * maintenance queries. A view without keys is a single row.
+ */
+static bool
+add_delta_keys(HTAB **delta_keys, List *keys, Tuplestorestate *old_tuplestore,
+			   TupleDesc tupdesc_old, Tuplestorestate *new_tuplestore, TupleDesc tupdesc_new)
+{
+	uint32 *hashes[2];
+	int64 nhashes[2];
+	bool overlap = false;
+	int i;
+	int64 j;
+
+	if (*delta_keys == NULL)
+	{
+		HASHCTL ctl;
+
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(uint32);
+		ctl.entrysize = sizeof(uint32);
+		ctl.hcxt = CurrentMemoryContext;
+		*delta_keys = hash_create("IMMV delta keys",
+								  MV_INIT_QUERYHASHSIZE,
+								  &ctl,
+								  HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	}
+
+	hashes[0] = get_delta_key_hashes(old_tuplestore, tupdesc_old, keys, &nhashes[0]);
+	hashes[1] = get_delta_key_hashes(new_tuplestore, tupdesc_new, keys, &nhashes[1]);
+
+	for (i = 0; i < 2 && !overlap; i++)
+	{
+		for (j = 0; j < nhashes[i] && !overlap; j++)
+			overlap = (hash_search(*delta_keys, &hashes[i][j], HASH_FIND, NULL) != NULL);
+	}
+
+	for (i = 0; i < 2; i++)
+	{
+		for (j = 0; j < nhashes[i] && !overlap; j++)
+			(void) hash_search(*delta_keys, &hashes[i][j], HASH_ENTER, NULL);
+		if (hashes[i])
+			pfree(hashes[i]);
+	}
+
+	return !overlap;
+}
+
+/*
+ * forget_delta_keys
+ *
+ * Discard the set of keys touched by the deltas after they are applied.
+ */
+static void
+forget_delta_keys(HTAB **delta_keys)
+{
+	if (*delta_keys)
+		hash_destroy(*delta_keys);
+	*delta_keys = NULL;
+}
+
 /*
  * rewrite_query_for_preupdate_state
  *
@@ -1284,7 +2339,7 @@ register_delta_ENRs(ParseState *pstate, Query *query, List *tables)
 		count = 0;
 		foreach (lc2, table->old_tuplestores)
 		{
-			Tuplestorestate *oldtable = (Tuplestorestate *) lfirst(lc2);
+			Tuplestorestate *oldtable = delta_store_get_tuplestore(lfirst(lc2));
 			EphemeralNamedRelation enr = palloc(sizeof(EphemeralNamedRelationData));
 			ParseNamespaceItem *nsitem;
 
@@ -1308,7 +2363,7 @@ register_delta_ENRs(ParseState *pstate, Query *query, List *tables)
 		count = 0;
 		foreach (lc2, table->new_tuplestores)
 		{
-			Tuplestorestate *newtable = (Tuplestorestate *) lfirst(lc2);
+			Tuplestorestate *newtable = delta_store_get_tuplestore(lfirst(lc2));
 			EphemeralNamedRelation enr = palloc(sizeof(EphemeralNamedRelationData));
 			ParseNamespaceItem *nsitem;
 
@@ -1822,7 +2877,7 @@ calc_delta(MV_TriggerTable *table, List *rte_path, Query *query, DestReceiver *d
 	{
 		/* Replace the modified table with the old delta table and calculate the old view delta. */
 		lfirst(lc) = union_ENRs(rte, table->table_id, table->old_rtes, "old", queryEnv);
-		refresh_immv_datafill(dest_old, query, queryEnv, tupdesc_old, "");
+		refresh_immv_datafill(dest_old, query, queryEnv, tupdesc_old, IvmExplainQueryString(query));
 	}
 
 	/* Generate new delta */
@@ -1830,7 +2885,7 @@ calc_delta(MV_TriggerTable *table, List *rte_path, Query *query, DestReceiver *d
 	{
 		/* Replace the modified table with the new delta table and calculate the new view delta*/
 		lfirst(lc) = union_ENRs(rte, table->table_id, table->new_rtes, "new", queryEnv);
-		refresh_immv_datafill(dest_new, query, queryEnv, tupdesc_new, "");
+		refresh_immv_datafill(dest_new, query, queryEnv, tupdesc_new, IvmExplainQueryString(query));
 	}
 
 	in_delta_calculation = false;
@@ -1883,144 +2938,326 @@ getRteListCell(Query *query, List *rte_path)
 #define IVM_colname(type, col) makeObjectName("__ivm_" type, col, "_")
 
 /*
- * apply_delta
+ * get_maint_desc
  *
- * Apply deltas to the materialized view. In outer join cases, this requires
- * the view maintenance graph.
+ * Return the maintenance descriptor of the IMMV, building it if it is not
+ * cached in the backend or has been invalidated. query is the view
+ * definition query of the IMMV.
  */
-static void
-apply_delta(Oid matviewOid, Tuplestorestate *old_tuplestores, Tuplestorestate *new_tuplestores,
-			TupleDesc tupdesc_old, TupleDesc tupdesc_new, Query *query, bool use_count,
-			char *count_colname)
+static MV_MaintDesc *
+get_maint_desc(Relation matviewRel, Query *query)
 {
-	StringInfoData querybuf;
-	StringInfoData target_list_buf;
-	StringInfo aggs_list_buf = NULL;
-	StringInfo aggs_set_old = NULL;
-	StringInfo aggs_set_new = NULL;
-	Relation matviewRel;
-	char *matviewname;
+	Oid matviewOid = RelationGetRelid(matviewRel);
+	MV_MaintDesc *desc;
+	MemoryContext oldcxt;
+	StringInfoData buf;
+	StringInfoData set_old;
+	StringInfoData set_new;
+	Datum keyattnums;
+	Datum aggkinds;
+	Datum *elems;
+	int nelems;
 	ListCell *lc;
 	int i;
-	List *keys = NIL;
-	List *minmax_list = NIL;
-	List *is_min_list = NIL;
+	bool found;
 
-	/*
-	 * get names of the materialized view and delta tables
-	 */
+	if (!mv_maint_desc_cache)
+	{
+		HASHCTL ctl;
+
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(Oid);
+		ctl.entrysize = sizeof(MV_MaintDesc);
+		mv_maint_desc_cache = hash_create("IMMV maintenance descriptors",
+										  MV_INIT_QUERYHASHSIZE,
+										  &ctl,
+										  HASH_ELEM | HASH_BLOBS);
+		CacheRegisterRelcacheCallback(invalidate_maint_desc, (Datum) 0);
+		/* The name is qualified by the schema, whose renaming doesn't touch the relcache */
+		CacheRegisterSyscacheCallback(NAMESPACEOID, invalidate_maint_desc_namespace, (Datum) 0);
+	}
 
-	matviewRel = table_open(matviewOid, NoLock);
-	matviewname = quote_qualified_identifier(get_namespace_name(RelationGetNamespace(matviewRel)),
-											 RelationGetRelationName(matviewRel));
+	desc = (MV_MaintDesc *) hash_search(mv_maint_desc_cache, &matviewOid, HASH_ENTER, &found);
+	if (found && desc->valid)
+		return desc;
 
-	/*
-	 * Build parts of the maintenance queries
-	 */
+	/* discard the old descriptor, or one left half-built by an error */
+	if (found && desc->cxt)
+		MemoryContextDelete(desc->cxt);
+	desc->valid = false;
+	desc->cxt = AllocSetContextCreate(CacheMemoryContext,
+									  "IMMV maintenance descriptor",
+									  ALLOCSET_SMALL_SIZES);
 
-	initStringInfo(&querybuf);
-	initStringInfo(&target_list_buf);
+	fetch_maint_desc(matviewOid, query, &keyattnums, &aggkinds);
 
-	if (query->hasAggs)
-	{
-		if (old_tuplestores && tuplestore_tuple_count(old_tuplestores) > 0)
-			aggs_set_old = makeStringInfo();
-		if (new_tuplestores && tuplestore_tuple_count(new_tuplestores) > 0)
-			aggs_set_new = makeStringInfo();
-		aggs_list_buf = makeStringInfo();
-	}
+	oldcxt = MemoryContextSwitchTo(desc->cxt);
+
+	desc->matviewname =
+		quote_qualified_identifier(get_namespace_name(RelationGetNamespace(matviewRel)),
+								   RelationGetRelationName(matviewRel));
 
 	/* build string of target list */
+	initStringInfo(&buf);
 	for (i = 0; i < matviewRel->rd_att->natts; i++)
 	{
 		Form_pg_attribute attr = TupleDescAttr(matviewRel->rd_att, i);
-		char *resname = NameStr(attr->attname);
 
 		if (i != 0)
-			appendStringInfo(&target_list_buf, ", ");
-		appendStringInfo(&target_list_buf, "%s", quote_qualified_identifier(NULL, resname));
+			appendStringInfo(&buf, ", ");
+		appendStringInfo(&buf, "%s", quote_qualified_identifier(NULL, NameStr(attr->attname)));
 	}
+	desc->target_list = buf.data;
+
+	/* copy attributes of key columns, which outlive the relcache entry */
+	desc->keys = NIL;
+	deconstruct_array(DatumGetArrayTypeP(keyattnums),
+					  INT2OID,
+					  sizeof(int16),
+					  true,
+					  TYPALIGN_SHORT,
+					  &elems,
+					  NULL,
+					  &nelems);
+	for (i = 0; i < nelems; i++)
+	{
+		Form_pg_attribute attr = (Form_pg_attribute) palloc(ATTRIBUTE_FIXED_PART_SIZE);
 
-	i = 0;
-	foreach (lc, query->targetList)
+		memcpy(attr,
+			   TupleDescAttr(matviewRel->rd_att, DatumGetInt16(elems[i]) - 1),
+			   ATTRIBUTE_FIXED_PART_SIZE);
+		desc->keys = lappend(desc->keys, attr);
+	}
+	desc->sort_columns = get_sort_columns(matviewRel, desc->keys);
+
+	/* For views with aggregates, we need to build SET clause for updating aggregate values. */
+	desc->aggs_list = desc->aggs_set_old = desc->aggs_set_new = NULL;
+	desc->minmax_list = desc->is_min_list = NIL;
+	if (query->hasAggs)
 	{
-		TargetEntry *tle = (TargetEntry *) lfirst(lc);
-		Form_pg_attribute attr = TupleDescAttr(matviewRel->rd_att, i);
-		char *resname = NameStr(attr->attname);
+		initStringInfo(&buf);
+		initStringInfo(&set_old);
+		initStringInfo(&set_new);
+
+		deconstruct_array(DatumGetArrayTypeP(aggkinds),
+						  CHAROID,
+						  sizeof(char),
+						  true,
+						  TYPALIGN_CHAR,
+						  &elems,
+						  NULL,
+						  &nelems);
+		i = 0;
+		foreach (lc, query->targetList)
+		{
+			TargetEntry *tle = (TargetEntry *) lfirst(lc);
+			char *resname = pstrdup(NameStr(TupleDescAttr(matviewRel->rd_att, i)->attname));
+			char kind = (i < nelems) ? DatumGetChar(elems[i]) : IVM_AGG_NONE;
 
-		i++;
+			i++;
 
-		if (tle->resjunk)
-			continue;
+			switch (kind)
+			{
+				case IVM_AGG_NONE:
+					break;
+				case IVM_AGG_COUNT:
+					append_set_clause_for_count(resname, &set_old, &set_new, &buf);
+					break;
+				case IVM_AGG_SUM:
+					append_set_clause_for_sum(resname, &set_old, &set_new, &buf);
+					break;
+				case IVM_AGG_AVG:
+					Assert(IsA(tle->expr, Aggref));
+					append_set_clause_for_avg(
+						resname,
+						&set_old,
+						&set_new,
+						&buf,
+						format_type_be_qualified(((Aggref *) tle->expr)->aggtype));
+					break;
+				case IVM_AGG_MIN:
+				case IVM_AGG_MAX:
+					append_set_clause_for_minmax(resname,
+												 &set_old,
+												 &set_new,
+												 &buf,
+												 kind == IVM_AGG_MIN);
+
+					/* make a resname list of min and max aggregates */
+					desc->minmax_list = lappend(desc->minmax_list, resname);
+					desc->is_min_list = lappend_int(desc->is_min_list, kind == IVM_AGG_MIN);
+					break;
+				default:
+					elog(ERROR, "unrecognized aggregate kind: %c", kind);
+			}
+		}
 
-		/*
-		 * For views without aggregates, all attributes are used as keys to identify a
-		 * tuple in a view.
-		 */
-		if (!query->hasAggs)
-			keys = lappend(keys, attr);
+		desc->aggs_list = buf.data;
+		desc->aggs_set_old = set_old.data;
+		desc->aggs_set_new = set_new.data;
+	}
 
-		/* For views with aggregates, we need to build SET clause for updating aggregate
-		 * values. */
-		if (query->hasAggs && IsA(tle->expr, Aggref))
-		{
-			Aggref *aggref = (Aggref *) tle->expr;
-			const char *aggname = get_func_name(aggref->aggfnoid);
+	MemoryContextSwitchTo(oldcxt);
 
-			/*
-			 * We can use function names here because it is already checked if these
-			 * can be used in IMMV by its OID at the definition time.
-			 */
+	desc->valid = true;
 
-			/* count */
-			if (!strcmp(aggname, "count"))
-				append_set_clause_for_count(resname, aggs_set_old, aggs_set_new, aggs_list_buf);
+	return desc;
+}
 
-			/* sum */
-			else if (!strcmp(aggname, "sum"))
-				append_set_clause_for_sum(resname, aggs_set_old, aggs_set_new, aggs_list_buf);
+/*
+ * fetch_maint_desc
+ *
+ * Get the parts of the maintenance descriptor stored in pg_ivm_immv. They
+ * are derived from the query for IMMVs created by older versions.
+ */
+static void
+fetch_maint_desc(Oid matviewOid, Query *query, Datum *keyattnums, Datum *aggkinds)
+{
+	Relation pgIvmImmv = table_open(PgIvmImmvRelationId(), AccessShareLock);
+	TupleDesc tupdesc = RelationGetDescr(pgIvmImmv);
+	SysScanDesc scan;
+	ScanKeyData key;
+	HeapTuple tup;
+	bool keys_isnull = true;
+	bool kinds_isnull = true;
 
-			/* avg */
-			else if (!strcmp(aggname, "avg"))
-				append_set_clause_for_avg(resname,
-										  aggs_set_old,
-										  aggs_set_new,
-										  aggs_list_buf,
-										  format_type_be_qualified(aggref->aggtype));
-
-			/* min/max */
-			else if (!strcmp(aggname, "min") || !strcmp(aggname, "max"))
-			{
-				bool is_min = (!strcmp(aggname, "min"));
+	ScanKeyInit(&key,
+				Anum_pg_ivm_immv_immvrelid,
+				BTEqualStrategyNumber,
+				F_OIDEQ,
+				ObjectIdGetDatum(matviewOid));
+	scan = systable_beginscan(pgIvmImmv, PgIvmImmvPrimaryKeyIndexId(), true, NULL, 1, &key);
 
-				append_set_clause_for_minmax(resname,
-											 aggs_set_old,
-											 aggs_set_new,
-											 aggs_list_buf,
-											 is_min);
+	tup = systable_getnext(scan);
+	if (HeapTupleIsValid(tup))
+	{
+		*keyattnums = heap_getattr(tup, Anum_pg_ivm_immv_keyattnums, tupdesc, &keys_isnull);
+		*aggkinds = heap_getattr(tup, Anum_pg_ivm_immv_aggkinds, tupdesc, &kinds_isnull);
+	}
 
-				/* make a resname list of min and max aggregates */
-				minmax_list = lappend(minmax_list, resname);
-				is_min_list = lappend_int(is_min_list, is_min);
-			}
-			else
-				elog(ERROR, "unsupported aggregate function: %s", aggname);
-		}
+	if (keys_isnull || kinds_isnull)
+		BuildImmvMaintDesc(query, keyattnums, aggkinds);
+	else
+	{
+		*keyattnums = PointerGetDatum(DatumGetArrayTypePCopy(*keyattnums));
+		*aggkinds = PointerGetDatum(DatumGetArrayTypePCopy(*aggkinds));
 	}
 
-	/* If we have GROUP BY clause, we use its entries as keys. */
-	if (query->hasAggs && query->groupClause)
+	systable_endscan(scan);
+	table_close(pgIvmImmv, NoLock);
+}
+
+/*
+ * invalidate_maint_desc
+ *
+ * Relcache invalidation callback. Descriptors are only marked invalid here,
+ * since one may be in use by the maintenance running now, and are rebuilt
+ * when they are needed next time.
+ */
+static void
+invalidate_maint_desc(Datum arg, Oid relid)
+{
+	HASH_SEQ_STATUS status;
+	MV_MaintDesc *desc;
+
+	if (OidIsValid(relid))
 	{
-		foreach (lc, query->groupClause)
-		{
-			SortGroupClause *sgcl = (SortGroupClause *) lfirst(lc);
-			TargetEntry *tle = get_sortgroupclause_tle(sgcl, query->targetList);
-			Form_pg_attribute attr = TupleDescAttr(matviewRel->rd_att, tle->resno - 1);
+		desc = (MV_MaintDesc *) hash_search(mv_maint_desc_cache, &relid, HASH_FIND, NULL);
+		if (desc)
+			desc->valid = false;
+		return;
+	}
+
+	hash_seq_init(&status, mv_maint_desc_cache);
+	while ((desc = (MV_MaintDesc *) hash_seq_search(&status)) != NULL)
+		desc->valid = false;
+}
+
+/*
+ * invalidate_maint_desc_namespace
+ *
+ * Syscache invalidation callback of pg_namespace. A schema may be renamed,
+ * so all descriptors are invalidated.
+ */
+static void
+invalidate_maint_desc_namespace(Datum arg, int cacheid, uint32 hashvalue)
+{
+	invalidate_maint_desc(arg, InvalidOid);
+}
+
+/*
+ * apply_delta
+ *
+ * Apply deltas to the materialized view. In outer join cases, this requires
+ * the view maintenance graph. If lock_groups is true, the view is not locked
+ * exclusively, so groups touched by the deltas are locked before applying.
+ * Sizes of the deltas and the time to recalculate min/max are added to stat.
+ */
+static void
+apply_delta(Oid matviewOid, Tuplestorestate *old_tuplestores, Tuplestorestate *new_tuplestores,
+			TupleDesc tupdesc_old, TupleDesc tupdesc_new, Query *query, bool use_count,
+			char *count_colname, bool lock_groups, ImmvStatCounters *stat)
+{
+	StringInfoData target_list_buf;
+	StringInfo aggs_list_buf = NULL;
+	StringInfo aggs_set_old = NULL;
+	StringInfo aggs_set_new = NULL;
+	Relation matviewRel;
+	MV_MaintDesc *desc;
+	char *matviewname;
+	List *keys;
+	List *minmax_list;
+	List *is_min_list;
+	List *sort_columns;
+
+	matviewRel = table_open(matviewOid, NoLock);
+
+	/*
+	 * Get parts of the maintenance queries from the maintenance descriptor.
+	 * The strings are copied as they may be appended to.
+	 */
+	desc = get_maint_desc(matviewRel, query);
+	matviewname = desc->matviewname;
+	keys = desc->keys;
+	minmax_list = desc->minmax_list;
+	is_min_list = desc->is_min_list;
+	sort_columns = desc->sort_columns;
+
+	initStringInfo(&target_list_buf);
+	appendStringInfoString(&target_list_buf, desc->target_list);
 
-			keys = lappend(keys, attr);
+	if (desc->aggs_list)
+	{
+		if (old_tuplestores && tuplestore_tuple_count(old_tuplestores) > 0)
+		{
+			aggs_set_old = makeStringInfo();
+			appendStringInfoString(aggs_set_old, desc->aggs_set_old);
+		}
+		if (new_tuplestores && tuplestore_tuple_count(new_tuplestores) > 0)
+		{
+			aggs_set_new = makeStringInfo();
+			appendStringInfoString(aggs_set_new, desc->aggs_set_new);
 		}
+		aggs_list_buf = makeStringInfo();
+		appendStringInfoString(aggs_list_buf, desc->aggs_list);
 	}
 
+	/*
+	 * Concurrent transactions updating or inserting the same group have to be
+	 * serialized. Only inserting tuples into a view without counting doesn't
+	 * conflict with others. Queries below are executed with new snapshots
+	 * taken after these locks are acquired, so changes committed during the
+	 * wait are visible at READ COMMITTED.
+	 */
+	if (lock_groups &&
+		(use_count || (old_tuplestores && tuplestore_tuple_count(old_tuplestores) > 0)))
+		lock_delta_groups(matviewOid,
+						  keys,
+						  old_tuplestores,
+						  tupdesc_old,
+						  new_tuplestores,
+						  tupdesc_new);
+
 	/* Start maintaining the materialized view. */
 	OpenImmvIncrementalMaintenance();
 
@@ -2036,6 +3273,10 @@ apply_delta(Oid matviewOid, Tuplestorestate *old_tuplestores, Tuplestorestate *n
 		uint64 num_recalc;
 		int rc;
 
+		stat->old_rows += tuplestore_tuple_count(old_tuplestores);
+
+		sort_delta_by_index_key(old_tuplestores, tupdesc_old, sort_columns);
+
 		/* convert tuplestores to ENR, and register for SPI */
 		enr->md.name = pstrdup(OLD_DELTA_ENRNAME);
 		enr->md.reliddesc = InvalidOid;
@@ -2068,7 +3309,16 @@ apply_delta(Oid matviewOid, Tuplestorestate *old_tuplestores, Tuplestorestate *n
 		 * on some tuples. TIDs and keys such tuples are returned as a result of the above query.
 		 */
 		if (minmax_list && tuptable_recalc)
+		{
+			instr_time recalc_start;
+
+			INSTR_TIME_SET_CURRENT(recalc_start);
+			IvmExplainSetStep(matviewOid, "recalc_and_set_values");
 			recalc_and_set_values(tuptable_recalc, num_recalc, minmax_list, keys, matviewRel);
+			IvmExplainSetStep(matviewOid, "apply_delta");
+			stat->recalc_time += ImmvStatElapsed(recalc_start);
+			stat->recalc_groups += num_recalc;
+		}
 	}
 	/* For tuple insertion */
 	if (new_tuplestores && tuplestore_tuple_count(new_tuplestores) > 0)
@@ -2076,6 +3326,10 @@ apply_delta(Oid matviewOid, Tuplestorestate *old_tuplestores, Tuplestorestate *n
 		EphemeralNamedRelation enr = palloc(sizeof(EphemeralNamedRelationData));
 		int rc;
 
+		stat->new_rows += tuplestore_tuple_count(new_tuplestores);
+
+		sort_delta_by_index_key(new_tuplestores, tupdesc_new, sort_columns);
+
 		/* convert tuplestores to ENR, and register for SPI */
 		enr->md.name = pstrdup(NEW_DELTA_ENRNAME);
 		enr->md.reliddesc = InvalidOid;
@@ -2111,6 +3365,364 @@ apply_delta(Oid matviewOid, Tuplestorestate *old_tuplestores, Tuplestorestate *n
 		elog(ERROR, "SPI_finish failed");
 }
 
+/*
+ * lock_delta_groups
+ *
+ * Lock groups of the view touched by the deltas. The locks are acquired in
+ * the order of partitions to avoid deadlocks among maintenances, and they are
+ * held until the end of the transaction.
+ */
+static void
+lock_delta_groups(Oid matviewOid, List *keys, Tuplestorestate *old_tuplestores,
+				  TupleDesc tupdesc_old, Tuplestorestate *new_tuplestores, TupleDesc tupdesc_new)
+{
+	bool *touched = palloc0(sizeof(bool) * IVM_GROUP_LOCK_PARTITIONS);
+	int i;
+
+	if (old_tuplestores)
+		mark_delta_groups(old_tuplestores, tupdesc_old, keys, touched);
+	if (new_tuplestores)
+		mark_delta_groups(new_tuplestores, tupdesc_new, keys, touched);
+
+	for (i = 0; i < IVM_GROUP_LOCK_PARTITIONS; i++)
+	{
+		LOCKTAG tag;
+
+		if (!touched[i])
+			continue;
+
+		SET_LOCKTAG_ADVISORY(tag, MyDatabaseId, matviewOid, i, IVM_GROUP_LOCKTAG_FIELD4);
+
+		/* Wait or raise an error as well as IVM_immediate_before does. */
+		if (!IsolationUsesXactSnapshot())
+			(void) LockAcquire(&tag, ExclusiveLock, false, false);
+		else if (LockAcquire(&tag, ExclusiveLock, false, true) == LOCKACQUIRE_NOT_AVAIL)
+			ereport(ERROR,
+					(errcode(ERRCODE_LOCK_NOT_AVAILABLE),
+					 errmsg("could not obtain lock on materialized view \"%s\" during incremental "
+							"maintenance",
+							get_rel_name(matviewOid))));
+	}
+
+	pfree(touched);
+}
+
+/*
+ * mark_delta_groups
+ *
+ * Mark lock partitions of groups appearing in the delta tuplestore.
+ */
+static void
+mark_delta_groups(Tuplestorestate *tuplestore, TupleDesc tupdesc, List *keys, bool *touched)
+{
+	uint32 *hashes;
+	int64 nhashes;
+	int64 i;
+
+	hashes = get_delta_key_hashes(tuplestore, tupdesc, keys, &nhashes);
+	for (i = 0; i < nhashes; i++)
+		touched[hashes[i] % IVM_GROUP_LOCK_PARTITIONS] = true;
+
+	if (hashes)
+		pfree(hashes);
+}
+
+/*
+ * get_delta_key_hashes
+ *
+ * Return hash values of the keys of rows of the view touched by each tuple
+ * in the delta tuplestore, and set their number to *nhashes. The key columns
+ * are looked up in the delta by name because it can have additional columns.
+ * A key whose type has no hash function doesn't contribute to the hash
+ * value. A view without keys is a single group whose hash value is 0.
+ */
+static uint32 *
+get_delta_key_hashes(Tuplestorestate *tuplestore, TupleDesc tupdesc, List *keys, int64 *nhashes)
+{
+	TupleTableSlot *slot;
+	int nkeys = list_length(keys);
+	AttrNumber *attnums;
+	FmgrInfo **hashfuncs;
+	Oid *collations;
+	uint32 *hashes;
+	int64 n = 0;
+	ListCell *lc;
+	int i;
+
+	*nhashes = 0;
+	if (tuplestore == NULL || tuplestore_tuple_count(tuplestore) == 0)
+		return NULL;
+
+	hashes = (uint32 *) MemoryContextAllocHuge(CurrentMemoryContext,
+											   sizeof(uint32) *
+												   tuplestore_tuple_count(tuplestore));
+
+	if (keys == NIL)
+	{
+		hashes[0] = 0;
+		*nhashes = 1;
+		return hashes;
+	}
+
+	attnums = palloc(sizeof(AttrNumber) * nkeys);
+	hashfuncs = palloc(sizeof(FmgrInfo *) * nkeys);
+	collations = palloc(sizeof(Oid) * nkeys);
+
+	i = 0;
+	foreach (lc, keys)
+	{
+		Form_pg_attribute attr = (Form_pg_attribute) lfirst(lc);
+		TypeCacheEntry *typentry = lookup_type_cache(attr->atttypid, TYPECACHE_HASH_PROC_FINFO);
+		int j;
+
+		attnums[i] = InvalidAttrNumber;
+		for (j = 0; j < tupdesc->natts; j++)
+		{
+			if (!strcmp(NameStr(TupleDescAttr(tupdesc, j)->attname), NameStr(attr->attname)))
+			{
+				attnums[i] = j + 1;
+				break;
+			}
+		}
+		if (attnums[i] == InvalidAttrNumber)
+			elog(ERROR, "could not find column \"%s\" in view delta", NameStr(attr->attname));
+
+		hashfuncs[i] = OidIsValid(typentry->hash_proc) ? &typentry->hash_proc_finfo : NULL;
+		collations[i] = attr->attcollation;
+		i++;
+	}
+
+	slot = MakeSingleTupleTableSlot(tupdesc, &TTSOpsMinimalTuple);
+	tuplestore_rescan(tuplestore);
+	while (tuplestore_gettupleslot(tuplestore, true, false, slot))
+	{
+		uint32 hashkey = 0;
+
+		for (i = 0; i < nkeys; i++)
+		{
+			Datum value;
+			bool isnull;
+			uint32 hkey = 0;
+
+			value = slot_getattr(slot, attnums[i], &isnull);
+			if (!isnull && hashfuncs[i] != NULL)
+				hkey = DatumGetUInt32(FunctionCall1Coll(hashfuncs[i], collations[i], value));
+
+			hashkey = hash_combine(hashkey, hkey);
+		}
+
+		hashes[n++] = hashkey;
+	}
+	tuplestore_rescan(tuplestore);
+
+	ExecDropSingleTupleTableSlot(slot);
+	pfree(attnums);
+	pfree(hashfuncs);
+	pfree(collations);
+
+	*nhashes = n;
+	return hashes;
+}
+
+/*
+ * sort_delta_by_index_key
+ *
+ * Sort tuples in the delta tuplestore by the given columns of the view, see
+ * get_sort_columns. When the view is joined with a large delta using the
+ * index, this makes the index and heap of the view visited in order instead
+ * of randomly. Small deltas are not worth sorting; see
+ * pg_ivm.delta_sort_threshold.
+ */
+static void
+sort_delta_by_index_key(Tuplestorestate *tuplestore, TupleDesc tupdesc, List *sort_columns)
+{
+	Tuplesortstate *sortstate;
+	TupleTableSlot *slot;
+	AttrNumber *attnums;
+	Oid *sortOperators;
+	Oid *collations;
+	bool *nullsFirst;
+	int nkeys = list_length(sort_columns);
+	ListCell *lc;
+	int i;
+
+	if (sort_columns == NIL || ivm_delta_sort_threshold < 0 ||
+		tuplestore_tuple_count(tuplestore) < ivm_delta_sort_threshold)
+		return;
+
+	attnums = palloc(sizeof(AttrNumber) * nkeys);
+	sortOperators = palloc(sizeof(Oid) * nkeys);
+	collations = palloc(sizeof(Oid) * nkeys);
+	nullsFirst = palloc(sizeof(bool) * nkeys);
+
+	i = 0;
+	foreach (lc, sort_columns)
+	{
+		Form_pg_attribute attr = (Form_pg_attribute) lfirst(lc);
+		TypeCacheEntry *typentry = lookup_type_cache(attr->atttypid, TYPECACHE_LT_OPR);
+		int j;
+
+		attnums[i] = InvalidAttrNumber;
+		for (j = 0; j < tupdesc->natts; j++)
+		{
+			if (!strcmp(NameStr(TupleDescAttr(tupdesc, j)->attname), NameStr(attr->attname)))
+			{
+				attnums[i] = j + 1;
+				break;
+			}
+		}
+		if (attnums[i] == InvalidAttrNumber)
+			break;
+
+		sortOperators[i] = typentry->lt_opr;
+		collations[i] = attr->attcollation;
+		nullsFirst[i] = false;
+		i++;
+	}
+
+	/* Give up sorting if any column is missing in the delta. */
+	if (i < nkeys)
+	{
+		pfree(attnums);
+		pfree(sortOperators);
+		pfree(collations);
+		pfree(nullsFirst);
+		return;
+	}
+
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 150000)
+	sortstate = tuplesort_begin_heap(tupdesc,
+									 nkeys,
+									 attnums,
+									 sortOperators,
+									 collations,
+									 nullsFirst,
+									 work_mem,
+									 NULL,
+									 TUPLESORT_NONE);
+#else
+	sortstate = tuplesort_begin_heap(tupdesc,
+									 nkeys,
+									 attnums,
+									 sortOperators,
+									 collations,
+									 nullsFirst,
+									 work_mem,
+									 NULL,
+									 false);
+#endif
+
+	slot = MakeSingleTupleTableSlot(tupdesc, &TTSOpsMinimalTuple);
+
+	tuplestore_rescan(tuplestore);
+	while (tuplestore_gettupleslot(tuplestore, true, false, slot))
+		tuplesort_puttupleslot(sortstate, slot);
+	tuplesort_performsort(sortstate);
+
+	/* Replace the contents of the tuplestore with sorted tuples */
+	tuplestore_clear(tuplestore);
+	while (tuplesort_gettupleslot(sortstate, true, false, slot, NULL))
+		tuplestore_puttupleslot(tuplestore, slot);
+
+	tuplesort_end(sortstate);
+	ExecDropSingleTupleTableSlot(slot);
+	pfree(attnums);
+	pfree(sortOperators);
+	pfree(collations);
+	pfree(nullsFirst);
+}
+
+/*
+ * get_sort_columns
+ *
+ * Return a list of attributes to sort deltas of the view by, which are the
+ * columns of a unique index on the view or the given keys if there is no
+ * such index. The attributes are copied into the current memory context.
+ * NIL is returned if any of the columns is not sortable.
+ */
+static List *
+get_sort_columns(Relation matviewRel, List *keys)
+{
+	List *columns = get_unique_index_columns(matviewRel);
+	List *result = NIL;
+	ListCell *lc;
+
+	if (columns == NIL)
+		columns = keys;
+
+	foreach (lc, columns)
+	{
+		Form_pg_attribute attr = (Form_pg_attribute) lfirst(lc);
+		TypeCacheEntry *typentry = lookup_type_cache(attr->atttypid, TYPECACHE_LT_OPR);
+		Form_pg_attribute copy;
+
+		if (!OidIsValid(typentry->lt_opr))
+		{
+			list_free_deep(result);
+			result = NIL;
+			break;
+		}
+
+		copy = (Form_pg_attribute) palloc(ATTRIBUTE_FIXED_PART_SIZE);
+		memcpy(copy, attr, ATTRIBUTE_FIXED_PART_SIZE);
+		result = lappend(result, copy);
+	}
+
+	if (columns != keys)
+		list_free(columns);
+
+	return result;
+}
+
+/*
+ * get_unique_index_columns
+ *
+ * Return a list of attributes of a unique btree index on the view, such as
+ * the one created by CreateIndexOnIMMV. Expression and partial indexes are
+ * ignored. NIL is returned if there is no such index.
+ */
+static List *
+get_unique_index_columns(Relation matviewRel)
+{
+	List *indexoidlist = RelationGetIndexList(matviewRel);
+	List *columns = NIL;
+	ListCell *lc;
+
+	foreach (lc, indexoidlist)
+	{
+		Oid indexoid = lfirst_oid(lc);
+		Relation indexRel = index_open(indexoid, AccessShareLock);
+		Form_pg_index index = indexRel->rd_index;
+		int i;
+
+		if (index->indisunique && index->indisvalid && indexRel->rd_rel->relam == BTREE_AM_OID &&
+			RelationGetIndexPredicate(indexRel) == NIL)
+		{
+			for (i = 0; i < index->indnkeyatts; i++)
+			{
+				AttrNumber attnum = index->indkey.values[i];
+
+				if (attnum <= 0)
+				{
+					list_free(columns);
+					columns = NIL;
+					break;
+				}
+				columns = lappend(columns, TupleDescAttr(matviewRel->rd_att, attnum - 1));
+			}
+		}
+
+		index_close(indexRel, AccessShareLock);
+
+		if (columns != NIL)
+			break;
+	}
+
+	list_free(indexoidlist);
+
+	return columns;
+}
+
 /*
  * append_set_clause_for_count
  *
@@ -2801,6 +4413,10 @@ recalc_and_set_values(SPITupleTable *tuptable_recalc, int64 num_tuples, List *na
 	Datum *keyVals = NULL, *vals = NULL;
 	int num_vals = list_length(namelist);
 	int num_keys = list_length(keys);
+	bool batch = false;
+	Oid *arrayTypes = NULL;
+	Datum **batchVals = NULL;
+	bool **batchNulls = NULL;
 	uint64 i;
 
 	/* If we have keys, initialize arrays for them. */
@@ -2860,28 +4476,105 @@ recalc_and_set_values(SPITupleTable *tuptable_recalc, int64 num_tuples, List *na
 
 		Assert(tupdesc_newvals->natts == num_vals);
 
-		/* Set the new values as parameters */
-		for (j = 0; j < tupdesc_newvals->natts; j++)
+		/*
+		 * On the first tuple, check if the new values can be passed as
+		 * arrays, so that all view tuples are updated by one query. This is
+		 * impossible if any type doesn't have its array type.
+		 */
+		if (i == 0)
 		{
-			if (i == 0)
+			for (j = 0; j < tupdesc_newvals->natts; j++)
 				types[j] = TupleDescAttr(tupdesc_newvals, j)->atttypid;
+			types[j] = TIDOID;
+
+			arrayTypes = palloc(sizeof(Oid) * (num_vals + 1));
+			batch = (num_tuples > 1);
+			for (j = 0; j <= num_vals && batch; j++)
+			{
+				arrayTypes[j] = get_array_type(types[j]);
+				if (!OidIsValid(arrayTypes[j]))
+					batch = false;
+			}
+
+			if (batch)
+			{
+				batchVals = palloc(sizeof(Datum *) * (num_vals + 1));
+				batchNulls = palloc(sizeof(bool *) * (num_vals + 1));
+				for (j = 0; j <= num_vals; j++)
+				{
+					batchVals[j] = palloc(sizeof(Datum) * num_tuples);
+					batchNulls[j] = palloc(sizeof(bool) * num_tuples);
+				}
+			}
+		}
 
+		/* Set the new values as parameters */
+		for (j = 0; j < tupdesc_newvals->natts; j++)
+		{
 			vals[j] = SPI_getbinval(tuptable_newvals->vals[0], tupdesc_newvals, j + 1, &isnull);
 			if (isnull)
 				nulls[j] = 'n';
 			else
 				nulls[j] = ' ';
+
+			if (batch)
+			{
+				batchVals[j][i] = vals[j];
+				batchNulls[j][i] = isnull;
+			}
 		}
 		/* Set TID of the view tuple to be updated as a parameter */
-		types[j] = TIDOID;
 		vals[j] = SPI_getbinval(tuptable_recalc->vals[i], tupdesc_recalc, 1, &isnull);
 		nulls[j] = ' ';
 
+		if (batch)
+		{
+			batchVals[j][i] = vals[j];
+			batchNulls[j][i] = false;
+			continue;
+		}
+
 		/* Update the view tuple to the new values */
 		plan = get_plan_for_set_values(matviewRel, namelist, types);
 		if (SPI_execute_plan(plan, vals, nulls, false, 0) != SPI_OK_UPDATE)
 			elog(ERROR, "SPI_execute_plan");
 	}
+
+	/* Update all view tuples to the new values at once */
+	if (batch)
+	{
+		SPIPlanPtr plan;
+		Datum *params = palloc(sizeof(Datum) * (num_vals + 1));
+		int j;
+
+		for (j = 0; j <= num_vals; j++)
+		{
+			int dims[1];
+			int lbs[1];
+			int16 typlen;
+			bool typbyval;
+			char typalign;
+			/* The TID array comes first in the parameters. */
+			int paramno = (j == num_vals ? 0 : j + 1);
+
+			dims[0] = (int) num_tuples;
+			lbs[0] = 1;
+			get_typlenbyvalalign(types[j], &typlen, &typbyval, &typalign);
+			params[paramno] = PointerGetDatum(construct_md_array(batchVals[j],
+																 batchNulls[j],
+																 1,
+																 dims,
+																 lbs,
+																 types[j],
+																 typlen,
+																 typbyval,
+																 typalign));
+		}
+
+		plan = get_plan_for_set_values_batch(matviewRel, namelist, arrayTypes);
+		if (SPI_execute_plan(plan, params, NULL, false, 0) != SPI_OK_UPDATE)
+			elog(ERROR, "SPI_execute_plan");
+	}
 }
 
 /*
@@ -3032,6 +4725,86 @@ get_plan_for_set_values(Relation matviewRel, List *namelist, Oid *valTypes)
 	return plan;
 }
 
+/*
+ * get_plan_for_set_values_batch
+ *
+ * Create or fetch a plan for applying new values of many view tuples at
+ * once. The first parameter is an array of TIDs of tuples to be updated, and
+ * the others are arrays of the new values for attributes in namelist.
+ * arrayTypes is an array of the array types of the values followed by that
+ * of TID.
+ */
+static SPIPlanPtr
+get_plan_for_set_values_batch(Relation matviewRel, List *namelist, Oid *arrayTypes)
+{
+	MV_QueryKey key;
+	SPIPlanPtr plan;
+	char *matviewname;
+
+	matviewname = quote_qualified_identifier(get_namespace_name(RelationGetNamespace(matviewRel)),
+											 RelationGetRelationName(matviewRel));
+
+	/* Fetch or prepare a saved plan for the real check */
+	mv_BuildQueryKey(&key, RelationGetRelid(matviewRel), MV_PLAN_SET_VALUES_BATCH);
+	if ((plan = mv_FetchPreparedPlan(&key)) == NULL)
+	{
+		ListCell *lc;
+		StringInfoData str;
+		Oid *argtypes;
+		int num_vals = list_length(namelist);
+		int i;
+
+		/*
+		 * Build a query string for applying min/max values. This is like
+		 *
+		 *  UPDATE matviewname AS mv
+		 *   SET (x1, x2) = ROW(v.__ivm_v1, v.__ivm_v2)
+		 *   FROM unnest($1, $2, $3) AS v(__ivm_tid, __ivm_v1, __ivm_v2)
+		 *   WHERE mv.ctid = v.__ivm_tid;
+		 */
+
+		initStringInfo(&str);
+		appendStringInfo(&str, "UPDATE %s AS mv SET (", matviewname);
+		foreach (lc, namelist)
+		{
+			appendStringInfo(&str, "%s", (char *) lfirst(lc));
+			if (lnext(namelist, lc))
+				appendStringInfoString(&str, ", ");
+		}
+		appendStringInfo(&str, ") = ROW(");
+		for (i = 1; i <= num_vals; i++)
+			appendStringInfo(&str, "%sv.__ivm_v%d", (i == 1 ? "" : ", "), i);
+
+		appendStringInfo(&str, ") FROM pg_catalog.unnest(");
+		for (i = 1; i <= num_vals + 1; i++)
+			appendStringInfo(&str, "%s$%d", (i == 1 ? "" : ", "), i);
+
+		appendStringInfo(&str, ") AS v(__ivm_tid");
+		for (i = 1; i <= num_vals; i++)
+			appendStringInfo(&str, ", __ivm_v%d", i);
+
+		appendStringInfo(&str, ") WHERE mv.ctid OPERATOR(pg_catalog.=) v.__ivm_tid");
+
+		/* The TID array comes first in the parameters. */
+		argtypes = palloc(sizeof(Oid) * (num_vals + 1));
+		argtypes[0] = arrayTypes[num_vals];
+		for (i = 0; i < num_vals; i++)
+			argtypes[i + 1] = arrayTypes[i];
+
+		plan = SPI_prepare(str.data, num_vals + 1, argtypes);
+		if (plan == NULL)
+			elog(ERROR,
+				 "SPI_prepare returned %s for %s",
+				 SPI_result_code_string(SPI_result),
+				 str.data);
+
+		SPI_keepplan(plan);
+		mv_HashPreparedPlan(&key, plan);
+	}
+
+	return plan;
+}
+
 /*
  * generate_equal
  *
@@ -3191,6 +4964,10 @@ AtAbort_IVM()
 			clean_up_IVM_hash_entry(entry, true);
 	}
 
+	/* Delta stores are released with TopTransactionContext anyway. */
+	mv_delta_stores = NIL;
+	mv_delta_held_bytes = 0;
+
 	in_delta_calculation = false;
 }
 
@@ -3212,15 +4989,9 @@ clean_up_IVM_hash_entry(MV_TriggerHashEntry *entry, bool is_abort)
 		ListCell *lc2;
 
 		foreach (lc2, table->old_tuplestores)
-		{
-			Tuplestorestate *tup = (Tuplestorestate *) lfirst(lc2);
-			tuplestore_end(tup);
-		}
+			delta_store_end((MV_DeltaStore *) lfirst(lc2));
 		foreach (lc2, table->new_tuplestores)
-		{
-			Tuplestorestate *tup = (Tuplestorestate *) lfirst(lc2);
-			tuplestore_end(tup);
-		}
+			delta_store_end((MV_DeltaStore *) lfirst(lc2));
 
 		list_free(table->old_tuplestores);
 		list_free(table->new_tuplestores);
@@ -0,0 +1,168 @@
+-- catalog
+
+ALTER TABLE pg_catalog.pg_ivm_immv ADD COLUMN ismultiset bool NOT NULL DEFAULT false;
+ALTER TABLE pg_catalog.pg_ivm_immv ADD COLUMN keyattnums int2[];
+ALTER TABLE pg_catalog.pg_ivm_immv ADD COLUMN aggkinds "char"[];
+
+-- functions
+
+CREATE FUNCTION create_immv(text, text, text)
+RETURNS bigint
+STRICT
+AS 'MODULE_PATHNAME', 'create_immv'
+LANGUAGE C;
+
+/*
+ * Expand each row of a multiset IMMV into as many rows as its multiplicity
+ */
+CREATE FUNCTION pg_ivm_expand_immv(immv anyelement)
+RETURNS SETOF anyelement
+STABLE
+AS $$
+DECLARE
+	relid	REGCLASS;
+
+BEGIN
+	SELECT typrelid INTO relid FROM pg_catalog.pg_type
+	WHERE oid = pg_catalog.pg_typeof(immv);
+
+	IF NOT EXISTS (
+		SELECT 1 FROM pg_catalog.pg_ivm_immv
+		WHERE immvrelid = relid AND ismultiset)
+	THEN
+		RAISE EXCEPTION '"%" is not a multiset IMMV', pg_catalog.pg_typeof(immv);
+	END IF;
+
+	RETURN QUERY EXECUTE pg_catalog.format(
+		'SELECT v.* FROM %s AS v, pg_catalog.generate_series(1, v.__ivm_count__)',
+		relid);
+END;
+$$ LANGUAGE plpgsql;
+
+CREATE FUNCTION pg_ivm_delta_mem_stats(
+  OUT held_bytes bigint,
+  OUT peak_bytes bigint,
+  OUT spilled_bytes bigint,
+  OUT spilled_deltas bigint,
+  OUT spilled_file_bytes bigint,
+  OUT shared_deltas bigint)
+RETURNS record
+VOLATILE
+AS 'MODULE_PATHNAME', 'pg_ivm_delta_mem_stats'
+LANGUAGE C;
+
+CREATE FUNCTION pg_ivm_stat_immv(
+  OUT dbid oid,
+  OUT immvrelid oid,
+  OUT calls bigint,
+  OUT total_time float8,
+  OUT max_time float8,
+  OUT rewrite_time float8,
+  OUT calc_delta_time float8,
+  OUT apply_delta_time float8,
+  OUT recalc_time float8,
+  OUT lock_wait_time float8,
+  OUT old_rows bigint,
+  OUT new_rows bigint,
+  OUT recalc_groups bigint,
+  OUT full_refreshes bigint)
+RETURNS SETOF record
+VOLATILE
+AS 'MODULE_PATHNAME', 'pg_ivm_stat_immv'
+LANGUAGE C;
+
+CREATE FUNCTION pg_ivm_stat_immv_reset()
+RETURNS void
+VOLATILE
+AS 'MODULE_PATHNAME', 'pg_ivm_stat_immv_reset'
+LANGUAGE C;
+
+REVOKE ALL ON FUNCTION pg_ivm_stat_immv_reset() FROM PUBLIC;
+
+CREATE FUNCTION pg_ivm_scheduler_stats(
+  OUT policy text,
+  OUT running integer,
+  OUT queued integer,
+  OUT admitted bigint,
+  OUT give_ups bigint,
+  OUT reschedules bigint,
+  OUT wait_time float8,
+  OUT max_wait_time float8,
+  OUT adaptive_policy text,
+  OUT epochs bigint,
+  OUT policy_switches bigint,
+  OUT immv_exclusive_locks bigint,
+  OUT immv_row_exclusive_locks bigint,
+  OUT reaped_queries bigint,
+  OUT queue_timeouts bigint,
+  OUT partition_collisions bigint)
+RETURNS record
+VOLATILE
+AS 'MODULE_PATHNAME', 'pg_ivm_scheduler_stats'
+LANGUAGE C;
+
+CREATE FUNCTION pg_ivm_scheduler_stats_reset()
+RETURNS void
+VOLATILE
+AS 'MODULE_PATHNAME', 'pg_ivm_scheduler_stats_reset'
+LANGUAGE C;
+
+REVOKE ALL ON FUNCTION pg_ivm_scheduler_stats_reset() FROM PUBLIC;
+
+CREATE FUNCTION pg_ivm_scheduler_trace(
+  OUT seq bigint,
+  OUT event_time timestamptz,
+  OUT event text,
+  OUT pid integer,
+  OUT dbid oid,
+  OUT xid xid,
+  OUT policy text,
+  OUT job_size float8,
+  OUT score float8,
+  OUT num_affected integer,
+  OUT affected_tables oid[])
+RETURNS SETOF record
+VOLATILE
+AS 'MODULE_PATHNAME', 'pg_ivm_scheduler_trace'
+LANGUAGE C;
+
+CREATE FUNCTION pg_ivm_scheduler_trace_dump(filename text)
+RETURNS bigint
+STRICT VOLATILE
+AS 'MODULE_PATHNAME', 'pg_ivm_scheduler_trace_dump'
+LANGUAGE C;
+
+CREATE FUNCTION pg_ivm_scheduler_trace_reset()
+RETURNS void
+VOLATILE
+AS 'MODULE_PATHNAME', 'pg_ivm_scheduler_trace_reset'
+LANGUAGE C;
+
+REVOKE ALL ON FUNCTION pg_ivm_scheduler_trace() FROM PUBLIC;
+REVOKE ALL ON FUNCTION pg_ivm_scheduler_trace_dump(text) FROM PUBLIC;
+REVOKE ALL ON FUNCTION pg_ivm_scheduler_trace_reset() FROM PUBLIC;
+
+CREATE FUNCTION pg_ivm_explain_maintenance(
+  immv regclass,
+  dml text,
+  OUT step text,
+  OUT query text,
+  OUT plan text,
+  OUT rows bigint,
+  OUT total_time float8)
+RETURNS SETOF record
+STRICT VOLATILE
+AS 'MODULE_PATHNAME', 'pg_ivm_explain_maintenance'
+LANGUAGE C;
+
+-- views
+
+CREATE VIEW pg_ivm_stat_immv AS
+  SELECT dbid, immvrelid, calls, total_time,
+         CASE WHEN calls > 0 THEN total_time / calls ELSE 0 END AS mean_time,
+         max_time, rewrite_time, calc_delta_time, apply_delta_time,
+         recalc_time, lock_wait_time, old_rows, new_rows, recalc_groups,
+         full_refreshes
+  FROM pg_catalog.pg_ivm_stat_immv();
+
+GRANT SELECT ON pg_ivm_stat_immv TO PUBLIC;
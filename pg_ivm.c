@@ -21,6 +21,8 @@
 #include "catalog/pg_namespace_d.h"
 #include "catalog/pg_trigger_d.h"
 #include "commands/trigger.h"
+#include "common/hashfn.h"
+#include "funcapi.h"
 #include "parser/analyze.h"
 #include "parser/parser.h"
 #include "parser/scansup.h"
@@ -28,12 +30,15 @@
 #include "tcop/utility.h"
 #include "utils/builtins.h"
 #include "utils/fmgroids.h"
+#include "utils/guc.h"
 #include "utils/lsyscache.h"
 #include "utils/regproc.h"
 #include "utils/rel.h"
 #include "utils/varlena.h"
 #include "miscadmin.h"
 #include "storage/ipc.h"
+#include "storage/latch.h"
+#include "utils/wait_event.h"
 #include "optimizer/planner.h"
 #include "executor/execdesc.h"
 #include "executor/executor.h"
@@ -60,9 +65,16 @@ static ExecutorEnd_hook_type PrevExecutionEndHook = NULL;
 static ExecutorRun_hook_type prevExecutorRunHook = NULL;
 static ProcessUtility_hook_type prev_ProcessUtility = NULL;
 
+static ScheduleShared *schedule_shared = NULL;
+static HTAB *queryHashTables[MAX_SCHEDULE_PARTITIONS];
+
+/* Partition of the scheduler state for the current database */
 static ScheduleState *schedule_state = NULL;
 static HTAB *queryHashTable = NULL;
 
+/* Is the partition assigned to another database? */
+static bool schedule_guest = false;
+
 static int nesting_level = 0;
 
 /*
@@ -74,12 +86,36 @@ static int nesting_level = 0;
  */
 static int full_process = 0;
 
+/*
+ * Entry of the top-level statement admitted by the scheduler, whose IMMV
+ * locks are taken by SchedulerLockImmvs.
+ */
+static QueryTableEntry *admitted_query = NULL;
+
+/*
+ * IMMVs locked by SchedulerLockImmvs for the admitted statement and their
+ * lock modes, which are released together when the statement gives up its
+ * slot. They are allocated in TopTransactionContext.
+ */
+static List *sched_locked_immvs = NIL;
+static List *sched_locked_modes = NIL;
+
 /*
  * Flag to indicate if the current query is a utility command.
  * If it is, we will not do order enforcement.
  */
 static bool isUtility = false;
 
+/* GUC variable */
+static int ivm_queue_timeout = 0;
+
+/* Wait event reported while waiting for the admission */
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 170000)
+static uint32 scheduler_wait_event = 0;
+#else
+#define scheduler_wait_event PG_WAIT_EXTENSION
+#endif
+
 void _PG_init(void);
 
 static void IvmXactCallback(XactEvent event, void *arg);
@@ -90,6 +126,13 @@ static void parseNameAndColumns(const char *string, List **names, List **colName
 static void PgIvmObjectAccessHook(ObjectAccessType access, Oid classId, Oid objectId, int subId,
 								  void *arg);
 
+static void attach_schedule_partition(void);
+static void reset_schedule_stats(ScheduleState *state);
+static void AtEOXact_Scheduler(void);
+static void scheduler_shmem_exit(int code, Datum arg);
+static void wait_for_admission(QueryTableEntry *query_entry);
+static void forget_scheduler_locks(bool at_eoxact);
+static void count_wait_time(instr_time wait_start);
 static void pg_hook_shmem_request(void);
 static void pg_hook_shmem_startup(void);
 static PlannedStmt *pg_hook_planner(Query *parse, const char *query_string, int cursor_options,
@@ -108,6 +151,8 @@ PG_FUNCTION_INFO_V1(create_immv);
 PG_FUNCTION_INFO_V1(refresh_immv);
 PG_FUNCTION_INFO_V1(IVM_prevent_immv_change);
 PG_FUNCTION_INFO_V1(get_immv_def);
+PG_FUNCTION_INFO_V1(pg_ivm_scheduler_stats);
+PG_FUNCTION_INFO_V1(pg_ivm_scheduler_stats_reset);
 void getLocksHeldByMe(StringInfo info);
 
 static inline void
@@ -131,6 +176,14 @@ IvmXactCallback(XactEvent event, void *arg)
 {
 	if (event == XACT_EVENT_ABORT)
 		AtAbort_IVM();
+
+	if (event == XACT_EVENT_COMMIT || event == XACT_EVENT_ABORT)
+		AtEOXact_Scheduler();
+
+	if (event == XACT_EVENT_COMMIT)
+		AtEOXact_ImmvStat(true);
+	else if (event == XACT_EVENT_ABORT || event == XACT_EVENT_PREPARE)
+		AtEOXact_ImmvStat(false);
 }
 
 static void
@@ -138,7 +191,12 @@ IvmSubXactCallback(SubXactEvent event, SubTransactionId mySubid, SubTransactionI
 				   void *arg)
 {
 	if (event == SUBXACT_EVENT_ABORT_SUB)
+	{
 		AtAbort_IVM();
+		AtEOSubXact_ImmvStat(false, mySubid, parentSubid);
+	}
+	else if (event == SUBXACT_EVENT_COMMIT_SUB)
+		AtEOSubXact_ImmvStat(true, mySubid, parentSubid);
 }
 
 /*
@@ -151,6 +209,86 @@ _PG_init(void)
 	RegisterXactCallback(IvmXactCallback, NULL);
 	RegisterSubXactCallback(IvmSubXactCallback, NULL);
 
+	DefineCustomIntVariable("pg_ivm.delta_sort_threshold",
+							"Sets the minimum number of tuples in a view delta to sort it "
+							"by the view's index key before applying.",
+							"-1 disables the sort.",
+							&ivm_delta_sort_threshold,
+							1000,
+							-1,
+							INT_MAX,
+							PGC_USERSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_ivm.delta_mem",
+							"Sets the maximum memory to be used for deltas pending for view "
+							"maintenance in a transaction.",
+							"Deltas exceeding this are spilled to temporary files.",
+							&ivm_delta_mem,
+							65536,
+							64,
+							MAX_KILOBYTES,
+							PGC_USERSET,
+							GUC_UNIT_KB,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomEnumVariable("pg_ivm.schedule_policy",
+							 "Sets the policy to choose queries to be admitted.",
+							 NULL,
+							 &ivm_schedule_policy,
+							 SCHEDULE_POLICY_HOT_TABLE_FIRST,
+							 schedule_policy_options,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("pg_ivm.adaptive_epoch",
+							"Sets the length of an epoch of the adaptive scheduling policy.",
+							"The adaptive policy uses the policy chosen for an epoch until "
+							"it ends.",
+							&ivm_adaptive_epoch,
+							1000,
+							10,
+							INT_MAX / 1000,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_ivm.queue_timeout",
+							"Sets the maximum time a statement waits for the query scheduler.",
+							"A value of 0 turns off the timeout.",
+							&ivm_queue_timeout,
+							0,
+							0,
+							INT_MAX,
+							PGC_USERSET,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("pg_ivm.scheduler_trace",
+							 "Records decisions of the query scheduler.",
+							 "Events are shown by pg_ivm_scheduler_trace().",
+							 &ivm_scheduler_trace,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	MarkGUCPrefixReserved("pg_ivm");
+
 	PrevObjectAccessHook = object_access_hook;
 	object_access_hook = PgIvmObjectAccessHook;
 
@@ -255,6 +393,9 @@ end:
 
 /*
  * User interface for creating an IMMV
+ *
+ * The optional third argument is the storage mode of the IMMV, "rows" or
+ * "multiset".
  */
 Datum
 create_immv(PG_FUNCTION_ARGS)
@@ -263,6 +404,7 @@ create_immv(PG_FUNCTION_ARGS)
 	text *t_sql = PG_GETARG_TEXT_PP(1);
 	char *relname = text_to_cstring(t_relname);
 	char *sql = text_to_cstring(t_sql);
+	bool multiset = false;
 	List *parsetree_list;
 	RawStmt *parsetree;
 	Query *query;
@@ -274,6 +416,19 @@ create_immv(PG_FUNCTION_ARGS)
 	CreateTableAsStmt *ctas;
 	StringInfoData command_buf;
 
+	if (PG_NARGS() > 2)
+	{
+		char *storage = text_to_cstring(PG_GETARG_TEXT_PP(2));
+
+		if (pg_strcasecmp(storage, "multiset") == 0)
+			multiset = true;
+		else if (pg_strcasecmp(storage, "rows") != 0)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("invalid IMMV storage mode \"%s\"", storage),
+					 errhint("Valid storage modes are \"rows\" and \"multiset\".")));
+	}
+
 	parseNameAndColumns(relname, &names, &colNames);
 
 	initStringInfo(&command_buf);
@@ -316,7 +471,7 @@ create_immv(PG_FUNCTION_ARGS)
 	query = transformStmt(pstate, (Node *) ctas);
 	Assert(query->commandType == CMD_UTILITY && IsA(query->utilityStmt, CreateTableAsStmt));
 
-	ExecCreateImmv(pstate, (CreateTableAsStmt *) query->utilityStmt, NULL, NULL, &qc);
+	ExecCreateImmv(pstate, (CreateTableAsStmt *) query->utilityStmt, NULL, NULL, &qc, multiset);
 
 	PG_RETURN_INT64(qc.nprocessed);
 }
@@ -461,7 +616,7 @@ get_immv_def(PG_FUNCTION_ARGS)
 		PG_RETURN_NULL();
 
 	matviewRel = table_open(matviewOid, AccessShareLock);
-	query = get_immv_query(matviewRel);
+	query = get_immv_query(matviewRel, NULL);
 	if (query == NULL)
 	{
 		table_close(matviewRel, NoLock);
@@ -474,6 +629,105 @@ get_immv_def(PG_FUNCTION_ARGS)
 	PG_RETURN_TEXT_P(cstring_to_text(querystring));
 }
 
+/*
+ * pg_ivm_scheduler_stats
+ *
+ * Show the state and statistics of the query scheduler for the current
+ * database.
+ */
+Datum
+pg_ivm_scheduler_stats(PG_FUNCTION_ARGS)
+{
+	TupleDesc tupdesc;
+	Datum values[16];
+	bool nulls[16];
+
+	if (!schedule_shared)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_ivm must be loaded via shared_preload_libraries")));
+
+	attach_schedule_partition();
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	memset(nulls, 0, sizeof(nulls));
+	values[0] = CStringGetTextDatum(GetConfigOption("pg_ivm.schedule_policy", false, false));
+
+	LWLockAcquire(schedule_state->lock, LW_SHARED);
+	values[1] = Int32GetDatum(schedule_state->runningQuery);
+	values[2] = Int32GetDatum(schedule_state->querynum);
+	if (ivm_schedule_policy == SCHEDULE_POLICY_ADAPTIVE)
+		values[8] = CStringGetTextDatum(
+			schedule_policy_options[schedule_state->bandit.policy].name);
+	else
+		nulls[8] = true;
+	values[9] = Int64GetDatum((int64) schedule_state->bandit.epochs);
+	values[10] = Int64GetDatum((int64) schedule_state->bandit.switches);
+	LWLockRelease(schedule_state->lock);
+
+	values[3] = Int64GetDatum((int64) pg_atomic_read_u64(&schedule_state->admitted));
+	values[4] = Int64GetDatum((int64) pg_atomic_read_u64(&schedule_state->give_ups));
+	values[5] = Int64GetDatum((int64) pg_atomic_read_u64(&schedule_state->reschedules));
+	values[6] = Float8GetDatum(pg_atomic_read_u64(&schedule_state->wait_time) / 1000.0);
+	values[7] = Float8GetDatum(pg_atomic_read_u64(&schedule_state->max_wait_time) / 1000.0);
+	values[11] = Int64GetDatum((int64) pg_atomic_read_u64(&schedule_state->exclusive_locks));
+	values[12] = Int64GetDatum((int64) pg_atomic_read_u64(&schedule_state->row_exclusive_locks));
+	values[13] = Int64GetDatum((int64) pg_atomic_read_u64(&schedule_state->reaped));
+	values[14] = Int64GetDatum((int64) pg_atomic_read_u64(&schedule_state->queue_timeouts));
+	values[15] = Int64GetDatum((int64) pg_atomic_read_u64(&schedule_state->collisions));
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/*
+ * pg_ivm_scheduler_stats_reset
+ *
+ * Reset the statistics of the query scheduler for the current database.
+ */
+Datum
+pg_ivm_scheduler_stats_reset(PG_FUNCTION_ARGS)
+{
+	if (!schedule_shared)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_ivm must be loaded via shared_preload_libraries")));
+
+	attach_schedule_partition();
+
+	reset_schedule_stats(schedule_state);
+
+	/* What the adaptive policy learned is kept */
+	LWLockAcquire(schedule_state->lock, LW_EXCLUSIVE);
+	schedule_state->bandit.epochs = 0;
+	schedule_state->bandit.switches = 0;
+	LWLockRelease(schedule_state->lock);
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * reset_schedule_stats
+ *
+ * Reset the statistics of the scheduler partition except the state of the
+ * adaptive policy.
+ */
+static void
+reset_schedule_stats(ScheduleState *state)
+{
+	pg_atomic_write_u64(&state->admitted, 0);
+	pg_atomic_write_u64(&state->give_ups, 0);
+	pg_atomic_write_u64(&state->reschedules, 0);
+	pg_atomic_write_u64(&state->wait_time, 0);
+	pg_atomic_write_u64(&state->max_wait_time, 0);
+	pg_atomic_write_u64(&state->exclusive_locks, 0);
+	pg_atomic_write_u64(&state->row_exclusive_locks, 0);
+	pg_atomic_write_u64(&state->reaped, 0);
+	pg_atomic_write_u64(&state->queue_timeouts, 0);
+	pg_atomic_write_u64(&state->collisions, 0);
+}
+
 /*
  * object_access_hook function for dropping an IMMV
  */
@@ -506,7 +760,10 @@ PgIvmObjectAccessHook(ObjectAccessType access, Oid classId, Oid objectId, int su
 		tup = systable_getnext(scan);
 
 		if (HeapTupleIsValid(tup))
+		{
 			CatalogTupleDelete(pgIvmImmv, &tup->t_self);
+			ImmvStatDropAtCommit(objectId);
+		}
 
 		systable_endscan(scan);
 		table_close(pgIvmImmv, NoLock);
@@ -549,8 +806,11 @@ pg_hook_shmem_request(void)
 	if (PrevShmemRequestHook)
 		PrevShmemRequestHook();
 
-	RequestAddinShmemSpace(SEGMENT_SIZE + HASH_TABLE_SIZE);
-	RequestNamedLWLockTranche("pg_hook", 1);
+	RequestAddinShmemSpace(add_size(SEGMENT_SIZE, HASH_TABLE_SIZE));
+	RequestNamedLWLockTranche("pg_hook", MAX_SCHEDULE_PARTITIONS + 1);
+
+	ImmvStatShmemRequest();
+	SchedTraceShmemRequest();
 }
 
 static void
@@ -558,6 +818,7 @@ pg_hook_shmem_startup(void)
 {
 	HASHCTL info;
 	bool found = false;
+	int i;
 
 	if (PrevShmemStartupHook)
 		PrevShmemStartupHook();
@@ -566,20 +827,194 @@ pg_hook_shmem_startup(void)
 	info.keysize = sizeof(QueryTableKey);
 	info.entrysize = sizeof(QueryTableEntry);
 
-	queryHashTable =
-		ShmemInitHash("QueryTable", MAX_QUERY_NUM, MAX_QUERY_NUM, &info, HASH_ELEM | HASH_BLOBS);
+	for (i = 0; i < MAX_SCHEDULE_PARTITIONS; i++)
+	{
+		char name[NAMEDATALEN];
+
+		snprintf(name, sizeof(name), "QueryTable %d", i);
+		queryHashTables[i] = ShmemInitHash(name,
+										   MAX_QUERY_NUM,
+										   MAX_QUERY_NUM,
+										   &info,
+										   HASH_ELEM | HASH_BLOBS);
+	}
 
 	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
 
-	schedule_state = ShmemInitStruct("pg_hook", SEGMENT_SIZE, &found);
+	schedule_shared = ShmemInitStruct("pg_hook", SEGMENT_SIZE, &found);
 
 	if (!found)
 	{
+		LWLockPadded *locks = GetNamedLWLockTranche("pg_hook");
+
 		/*Fisrt time through, initialize data structures*/
-		schedule_state->lock = &(GetNamedLWLockTranche("pg_hook")->lock);
+		schedule_shared->lock = &locks[0].lock;
+		for (i = 0; i < MAX_SCHEDULE_PARTITIONS; i++)
+		{
+			ScheduleState *state = &schedule_shared->partitions[i];
+
+			memset(state, 0, sizeof(ScheduleState));
+			state->dbid = InvalidOid;
+			state->lock = &locks[i + 1].lock;
+			dlist_init(&state->fifo);
+			pg_atomic_init_u64(&state->next_arrival, 0);
+			pg_atomic_init_u64(&state->admitted, 0);
+			pg_atomic_init_u64(&state->give_ups, 0);
+			pg_atomic_init_u64(&state->reschedules, 0);
+			pg_atomic_init_u64(&state->wait_time, 0);
+			pg_atomic_init_u64(&state->max_wait_time, 0);
+			pg_atomic_init_u64(&state->exclusive_locks, 0);
+			pg_atomic_init_u64(&state->row_exclusive_locks, 0);
+			pg_atomic_init_u64(&state->reaped, 0);
+			pg_atomic_init_u64(&state->queue_timeouts, 0);
+			pg_atomic_init_u64(&state->collisions, 0);
+			SchedBanditInit(&state->bandit);
+		}
 	}
 
 	LWLockRelease(AddinShmemInitLock);
+
+	ImmvStatShmemStartup();
+	SchedTraceShmemStartup();
+}
+
+/*
+ * attach_schedule_partition
+ *
+ * Set schedule_state and queryHashTable to the partition of the scheduler
+ * state for the current database, assigning a free partition to the
+ * database on its first use. If no partition is free, the database shares
+ * a partition chosen by the hash of its OID with other databases. The
+ * partition is released when the last backend attached to it exits.
+ */
+static void
+attach_schedule_partition(void)
+{
+	ScheduleState *state;
+	int part = -1;
+	int i;
+	bool first_guest = false;
+
+	if (schedule_state)
+		return;
+
+	LWLockAcquire(schedule_shared->lock, LW_EXCLUSIVE);
+
+	for (i = 0; i < MAX_SCHEDULE_PARTITIONS; i++)
+	{
+		if (schedule_shared->partitions[i].dbid == MyDatabaseId)
+		{
+			part = i;
+			break;
+		}
+	}
+	if (part < 0)
+	{
+		for (i = 0; i < MAX_SCHEDULE_PARTITIONS; i++)
+		{
+			state = &schedule_shared->partitions[i];
+			if (!OidIsValid(state->dbid))
+			{
+				/* Statistics of the previous database are not ours */
+				state->dbid = MyDatabaseId;
+				reset_schedule_stats(state);
+				SchedBanditInit(&state->bandit);
+				part = i;
+				break;
+			}
+		}
+	}
+	if (part < 0)
+	{
+		part = hash_uint32((uint32) MyDatabaseId) % MAX_SCHEDULE_PARTITIONS;
+		schedule_guest = true;
+	}
+
+	state = &schedule_shared->partitions[part];
+	state->nbackends++;
+	if (schedule_guest)
+	{
+		first_guest = (state->nguests++ == 0);
+		pg_atomic_fetch_add_u64(&state->collisions, 1);
+	}
+
+	LWLockRelease(schedule_shared->lock);
+
+	/* Report only the start of sharing, not every backend */
+	if (first_guest)
+		elog(LOG,
+			 "no free scheduler partition for database %u, sharing partition %d",
+			 MyDatabaseId,
+			 part);
+
+	schedule_state = state;
+	queryHashTable = queryHashTables[part];
+
+	before_shmem_exit(scheduler_shmem_exit, (Datum) 0);
+}
+
+/*
+ * scheduler_shmem_exit
+ *
+ * Remove queries of this backend from the query table at exit, so that a
+ * FATAL error or pg_terminate_backend() between LogQuery and
+ * RemoveLoggedQuery does not leak the entry and the slot. Then detach from
+ * the partition, releasing it if this is the last backend using it.
+ */
+static void
+scheduler_shmem_exit(int code, Datum arg)
+{
+	int removed;
+
+	/* The lock may be held if we are exiting in the middle of scheduling */
+	LWLockReleaseAll();
+
+	LWLockAcquire(schedule_state->lock, LW_EXCLUSIVE);
+	removed = ReapQueries(queryHashTable, schedule_state, MyProcPid);
+	if (removed > 0)
+	{
+		pg_atomic_fetch_add_u64(&schedule_state->reaped, removed);
+		Reschedule(queryHashTable, schedule_state);
+	}
+	LWLockRelease(schedule_state->lock);
+
+	LWLockAcquire(schedule_shared->lock, LW_EXCLUSIVE);
+	if (schedule_guest)
+		schedule_state->nguests--;
+	if (--schedule_state->nbackends == 0)
+		schedule_state->dbid = InvalidOid;
+	LWLockRelease(schedule_shared->lock);
+
+	admitted_query = NULL;
+	forget_scheduler_locks(true);
+}
+
+/*
+ * AtEOXact_Scheduler
+ *
+ * Remove queries of the backend left in the query table at the end of a
+ * transaction, such as a statement whose portal was started by Bind but
+ * failed before it was executed, or a cursor rolled back to a savepoint. No
+ * query of the backend survives the end of the transaction, as holdable
+ * cursors finish their queries before commit.
+ */
+static void
+AtEOXact_Scheduler(void)
+{
+	int removed;
+
+	full_process = 0;
+	admitted_query = NULL;
+	forget_scheduler_locks(true);
+
+	if (!schedule_state || !ForgetLoggedQueries())
+		return;
+
+	LWLockAcquire(schedule_state->lock, LW_EXCLUSIVE);
+	removed = ReapQueries(queryHashTable, schedule_state, MyProcPid);
+	if (removed > 0)
+		Reschedule(queryHashTable, schedule_state);
+	LWLockRelease(schedule_state->lock);
 }
 
 static PlannedStmt *
@@ -595,29 +1030,32 @@ pg_hook_planner(Query *parse, const char *query_string, int cursor_options,
 void
 pg_hook_execution_start(QueryDesc *queryDesc, int eflags)
 {
-	int status, i, j, iter;
 	QueryTableEntry *query_entry;
-	RefedImmv *refed_immv;
-	LOCKTAG tag;
-	Bitmapset *newlyLocked = NULL;
-	StringInfoData info;
+	instr_time wait_start;
+
+	IvmExplainExecutorStart(queryDesc, eflags);
 
 	if (PrevExecutionStartHook)
 		PrevExecutionStartHook(queryDesc, eflags);
 	else
 		standard_ExecutorStart(queryDesc, eflags);
 
+	IvmExplainExecutorStarted(queryDesc, eflags);
+
 	if (strcmp(queryDesc->sourceText, "") == 0 ||
 		(eflags & (EXEC_FLAG_EXPLAIN_GENERIC | EXEC_FLAG_EXPLAIN_ONLY)) ||
 		!enable_enforce(nesting_level))
 		return;
 
+	attach_schedule_partition();
+
 	full_process++;
 
+	INSTR_TIME_SET_CURRENT(wait_start);
+
 	LWLockAcquire(schedule_state->lock, LW_EXCLUSIVE);
 
-	query_entry =
-		LogQuery(queryHashTable, schedule_state, queryDesc->plannedstmt, queryDesc->sourceText);
+	query_entry = LogQuery(queryHashTable, schedule_state, queryDesc);
 
 	Reschedule(queryHashTable, schedule_state);
 
@@ -626,15 +1064,90 @@ pg_hook_execution_start(QueryDesc *queryDesc, int eflags)
 
 	LWLockRelease(schedule_state->lock);
 
-waiting:
+	/*
+	 * Only a slot is reserved here. Locks on IMMVs are taken when a base
+	 * table is actually modified, see SchedulerLockImmvs.
+	 *
+	 * The executor is not run if the wait is canceled, so the query must be
+	 * removed here instead of pg_hook_executor_run.
+	 */
+	PG_TRY();
+	{
+		wait_for_admission(query_entry);
+	}
+	PG_CATCH();
+	{
+		full_process--;
+		LWLockAcquire(schedule_state->lock, LW_EXCLUSIVE);
+		RemoveLoggedQuery(queryDesc, queryHashTable, schedule_state);
+		Reschedule(queryHashTable, schedule_state);
+		LWLockRelease(schedule_state->lock);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+	admitted_query = query_entry;
+	forget_scheduler_locks(false);
+
+	pg_atomic_fetch_add_u64(&schedule_state->admitted, 1);
+	count_wait_time(wait_start);
+
+	elog(IVM_LOG_LEVEL, "Admitted xid %d", query_entry->xid);
+}
+
+/*
+ * wait_for_admission
+ *
+ * Wait until the scheduler makes the query available to run. The backend
+ * sleeps on its latch, which Reschedule sets when admitting the query, and
+ * the wait is reported as a wait event and can be canceled by interrupts
+ * including statement_timeout. If pg_ivm.queue_timeout elapses first, an
+ * error is raised.
+ */
+static void
+wait_for_admission(QueryTableEntry *query_entry)
+{
+	int status;
+	instr_time wait_start;
+	instr_time last_reap;
+
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 170000)
+	if (scheduler_wait_event == 0)
+		scheduler_wait_event = WaitEventExtensionNew("IvmSchedulerQueue");
+#endif
+
+	INSTR_TIME_SET_CURRENT(wait_start);
+	last_reap = wait_start;
+
 	for (;;)
 	{
 		int running;
+		long timeout = SCHEDULER_WAIT_TIMEOUT;
+
 		LWLockAcquire(schedule_state->lock, LW_SHARED);
 		status = query_entry->status;
 		running = schedule_state->runningQuery;
 		LWLockRelease(schedule_state->lock);
 
+		/*
+		 * Look for queries left by backends which exited without removing
+		 * them, which would hold slots forever.
+		 */
+		if (status != QUERY_AVAILABLE && ImmvStatElapsed(last_reap) >= SCHEDULER_REAP_INTERVAL)
+		{
+			int removed;
+
+			LWLockAcquire(schedule_state->lock, LW_EXCLUSIVE);
+			removed = ReapQueries(queryHashTable, schedule_state, 0);
+			if (removed > 0)
+				pg_atomic_fetch_add_u64(&schedule_state->reaped, removed);
+			Reschedule(queryHashTable, schedule_state);
+			status = query_entry->status;
+			running = schedule_state->runningQuery;
+			LWLockRelease(schedule_state->lock);
+
+			INSTR_TIME_SET_CURRENT(last_reap);
+		}
+
 		/* Check if no query is running and this query is also not available
 		 * If so, We trigger a rescheduling to wake it up.
 		 */
@@ -649,55 +1162,245 @@ waiting:
 		if (status == QUERY_AVAILABLE)
 			break;
 
-		pg_usleep(30);
+		if (ivm_queue_timeout > 0)
+		{
+			double elapsed = ImmvStatElapsed(wait_start);
+
+			if (elapsed >= ivm_queue_timeout)
+			{
+				pg_atomic_fetch_add_u64(&schedule_state->queue_timeouts, 1);
+				ereport(ERROR,
+						(errcode(ERRCODE_QUERY_CANCELED),
+						 errmsg("canceling statement due to pg_ivm queue timeout"),
+						 errdetail("The statement waited %.3f ms for the query scheduler.",
+								   elapsed)));
+			}
+			timeout = Min(timeout, (long) (ivm_queue_timeout - elapsed) + 1);
+		}
+
+		(void) WaitLatch(MyLatch,
+						 WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+						 timeout,
+						 scheduler_wait_event);
+		ResetLatch(MyLatch);
+
+		CHECK_FOR_INTERRUPTS();
 	}
+}
 
-	newlyLocked = NULL;
+/*
+ * count_wait_time
+ *
+ * Add the time waited for the scheduler since wait_start to the statistics.
+ */
+static void
+count_wait_time(instr_time wait_start)
+{
+	uint64 wait_time = (uint64) (ImmvStatElapsed(wait_start) * 1000.0);
+	uint64 max_wait_time;
+
+	pg_atomic_fetch_add_u64(&schedule_state->wait_time, wait_time);
+	max_wait_time = pg_atomic_read_u64(&schedule_state->max_wait_time);
+	while (wait_time > max_wait_time &&
+		   !pg_atomic_compare_exchange_u64(&schedule_state->max_wait_time,
+										   &max_wait_time,
+										   wait_time))
+		;
+}
+
+/*
+ * SchedulerLockImmvs
+ *
+ * Lock IMMVs defined on a base table which the admitted statement is about
+ * to modify. This is called from IVM_immediate_before, so IMMVs are not
+ * locked while the statement only reads tables, and IMMVs on tables which
+ * are only read are not locked at all. If any of the IMMVs is locked by
+ * another query, release the slot and every IMMV lock taken for the
+ * statement so far, including those taken for tables modified earlier in
+ * the statement, and wait for the admission again as ExecutorStart does.
+ * Keeping the earlier locks while waiting could make two statements give
+ * up on each other's locks forever. They are taken again together with the
+ * new ones after the admission; at READ COMMITTED the maintenance sees
+ * changes committed meanwhile, as with deferred IMMV locks. Under a
+ * transaction snapshot it doesn't, so an error is raised instead.
+ *
+ * The IMMVs and the lock modes are taken from the IVM triggers of the table
+ * fired by the same event as the given trigger: every IMMV has a BEFORE
+ * trigger for each operation on each of its base tables, whose arguments
+ * are the IMMV and its lock scope. IMMVs maintained under RowExclusiveLock
+ * are locked in the mode so that concurrent statements share them, and
+ * IMMVs whose ExclusiveLock is deferred to the maintenance are locked in
+ * AccessShareLock, which is not counted in the statistics.
+ */
+void
+SchedulerLockImmvs(Relation rel, Trigger *trigger)
+{
+	TriggerDesc *trigdesc = rel->trigdesc;
+	Oid *immvs;
+	LOCKMODE *modes;
+	bool *newlyLocked;
+	int nimmvs = 0;
+	int nnew;
+	int maxlocks;
+	StringInfoData info;
+	instr_time wait_start;
+	MemoryContext oldcxt;
+	ListCell *lc1, *lc2;
+	int i, j;
+	bool waited = false;
+	bool requeued = false;
+
+	if (admitted_query == NULL || trigdesc == NULL)
+		return;
+
+	/* Room for the locks taken earlier, which may have to be taken again */
+	maxlocks = trigdesc->numtriggers + list_length(sched_locked_immvs);
+	immvs = (Oid *) palloc(sizeof(Oid) * maxlocks);
+	modes = (LOCKMODE *) palloc(sizeof(LOCKMODE) * maxlocks);
+	newlyLocked = (bool *) palloc(sizeof(bool) * maxlocks);
 
-	for (i = 0; i < MAX_AFFECTED_TABLE && query_entry->affected_tables[i] != 0; i++)
+	for (i = 0; i < trigdesc->numtriggers; i++)
 	{
-		refed_immv = getRefrenceImmv(query_entry->affected_tables[i]);
+		Trigger *t = &trigdesc->triggers[i];
 
-		if (refed_immv == NULL)
+		if (t->tgfoid != trigger->tgfoid || t->tgtype != trigger->tgtype || t->tgnargs < 2)
 			continue;
 
-		for (j = 0; j < refed_immv->refed_table_num; j++)
-		{
-			SetLocktagRelationOid(&tag, refed_immv->refed_table[j]);
+		immvs[nimmvs] = DatumGetObjectId(DirectFunctionCall1(oidin, CStringGetDatum(t->tgargs[0])));
+		modes[nimmvs] = GetIvmSchedulerLockMode(t);
+		nimmvs++;
+	}
+	nnew = nimmvs;
 
-			if (LockHeldByMe(&tag, ExclusiveLock))
-			{
-				continue;
-			}
-			else if (ConditionalLockRelationOid(refed_immv->refed_table[j], ExclusiveLock))
+	INSTR_TIME_SET_CURRENT(wait_start);
+
+retry:
+	memset(newlyLocked, 0, sizeof(bool) * nimmvs);
+
+	for (j = 0; j < nimmvs; j++)
+	{
+		LOCKTAG tag;
+
+		SetLocktagRelationOid(&tag, immvs[j]);
+
+		if (LockHeldByMe(&tag, modes[j]))
+		{
+			continue;
+		}
+		else if (ConditionalLockRelationOid(immvs[j], modes[j]))
+		{
+			newlyLocked[j] = true;
+		}
+		else
+		{
+			for (i = 0; i < j; i++)
 			{
-				newlyLocked = bms_add_member(newlyLocked, refed_immv->refed_table[j]);
+				if (newlyLocked[i])
+					UnlockRelationOid(immvs[i], modes[i]);
 			}
-			else
+
+			/*
+			 * Release the locks taken for the statement before this call.
+			 * IVM_immediate_before has locked them again in the same modes,
+			 * so they are released as many times as they are held.
+			 */
+			if (sched_locked_immvs != NIL)
 			{
-				iter = -1;
-				while ((iter = bms_next_member(newlyLocked, iter)) >= 0)
+				if (IsolationUsesXactSnapshot())
+					ereport(ERROR,
+							(errcode(ERRCODE_LOCK_NOT_AVAILABLE),
+							 errmsg("could not obtain lock on materialized view \"%s\" during "
+									"incremental maintenance",
+									get_rel_name(immvs[j]))));
+
+				forboth (lc1, sched_locked_immvs, lc2, sched_locked_modes)
 				{
-					UnlockRelationOid(iter, ExclusiveLock);
+					SetLocktagRelationOid(&tag, lfirst_oid(lc1));
+					while (LockHeldByMe(&tag, lfirst_int(lc2)))
+						UnlockRelationOid(lfirst_oid(lc1), lfirst_int(lc2));
+
+					/* Take it again together with the new ones after the admission */
+					if (!requeued)
+					{
+						immvs[nimmvs] = lfirst_oid(lc1);
+						modes[nimmvs] = lfirst_int(lc2);
+						nimmvs++;
+					}
 				}
-				getLocksHeldByMe(&info);
-				bms_free(newlyLocked);
-
-				LWLockAcquire(schedule_state->lock, LW_EXCLUSIVE);
-				query_entry->status = QUERY_GIVE_UP;
-				schedule_state->runningQuery--;
-				Reschedule(queryHashTable, schedule_state);
-				LWLockRelease(schedule_state->lock);
-				goto waiting;
+				requeued = true;
 			}
+
+			pg_atomic_fetch_add_u64(&schedule_state->give_ups, 1);
+
+			LWLockAcquire(schedule_state->lock, LW_EXCLUSIVE);
+			admitted_query->status = QUERY_GIVE_UP;
+			schedule_state->runningQuery--;
+			SchedTraceRecord(SCHED_EVENT_GIVE_UP, admitted_query, 0);
+			Reschedule(queryHashTable, schedule_state);
+			LWLockRelease(schedule_state->lock);
+
+			wait_for_admission(admitted_query);
+			waited = true;
+			goto retry;
+		}
+	}
+
+	/* Remember the new locks, which are counted only once */
+	oldcxt = MemoryContextSwitchTo(TopTransactionContext);
+	for (j = 0; j < nnew; j++)
+	{
+		if (!newlyLocked[j])
+			continue;
+		if (modes[j] == RowExclusiveLock)
+			pg_atomic_fetch_add_u64(&schedule_state->row_exclusive_locks, 1);
+		else if (modes[j] == ExclusiveLock)
+			pg_atomic_fetch_add_u64(&schedule_state->exclusive_locks, 1);
+
+		forboth (lc1, sched_locked_immvs, lc2, sched_locked_modes)
+		{
+			if (lfirst_oid(lc1) == immvs[j] && lfirst_int(lc2) == modes[j])
+				break;
+		}
+		if (lc1 == NULL)
+		{
+			sched_locked_immvs = lappend_oid(sched_locked_immvs, immvs[j]);
+			sched_locked_modes = lappend_int(sched_locked_modes, modes[j]);
 		}
 	}
+	MemoryContextSwitchTo(oldcxt);
+
+	if (waited)
+		count_wait_time(wait_start);
 
 	getLocksHeldByMe(&info);
 	elog(IVM_LOG_LEVEL,
-		 "Got all necessary locks to run xid %d,I'm holding %s.",
-		 query_entry->xid,
+		 "Got all necessary locks on %s to run xid %d,I'm holding %s.",
+		 RelationGetRelationName(rel),
+		 admitted_query->xid,
 		 info.data);
+
+	pfree(immvs);
+	pfree(modes);
+	pfree(newlyLocked);
+}
+
+/*
+ * forget_scheduler_locks
+ *
+ * Forget the IMMV locks taken by the scheduler for the admitted statement.
+ * The locks themselves are held until the end of the transaction. At the end
+ * of the transaction the lists are freed with TopTransactionContext.
+ */
+static void
+forget_scheduler_locks(bool at_eoxact)
+{
+	if (!at_eoxact)
+	{
+		list_free(sched_locked_immvs);
+		list_free(sched_locked_modes);
+	}
+	sched_locked_immvs = NIL;
+	sched_locked_modes = NIL;
 }
 
 void
@@ -719,11 +1422,10 @@ pg_hook_executor_run(QueryDesc *queryDesc, ScanDirection direction, uint64 count
 			full_process)
 		{
 			full_process--;
+			admitted_query = NULL;
+			forget_scheduler_locks(false);
 			LWLockAcquire(schedule_state->lock, LW_EXCLUSIVE);
-			schedule_state->runningQuery--;
 			RemoveLoggedQuery(queryDesc, queryHashTable, schedule_state);
-			Assert(schedule_state->runningQuery >= 0 &&
-				   schedule_state->runningQuery <= MAX_CONCURRENT_QUERY);
 			Reschedule(queryHashTable, schedule_state);
 			LWLockRelease(schedule_state->lock);
 		}
@@ -737,14 +1439,11 @@ pg_hook_executor_run(QueryDesc *queryDesc, ScanDirection direction, uint64 count
 	if (!(strcmp(queryDesc->sourceText, "") == 0) && enable_enforce(nesting_level) && full_process)
 	{
 		full_process--;
+		admitted_query = NULL;
+		forget_scheduler_locks(false);
 		LWLockAcquire(schedule_state->lock, LW_EXCLUSIVE);
 		RemoveLoggedQuery(queryDesc, queryHashTable, schedule_state);
-		schedule_state->runningQuery--;
 		Reschedule(queryHashTable, schedule_state);
-
-		Assert(schedule_state->runningQuery >= 0 &&
-			   schedule_state->runningQuery <= MAX_CONCURRENT_QUERY);
-
 		LWLockRelease(schedule_state->lock);
 	}
 }
@@ -762,21 +1461,54 @@ getLocksHeldByMe(StringInfo info)
 		{
 			appendStringInfo(info, "%d ", all_immvs[i]);
 		}
+		else if (LockHeldByMe(&tag, RowExclusiveLock))
+		{
+			appendStringInfo(info, "%d(RowExclusiveLock) ", all_immvs[i]);
+		}
 	}
 }
 
 void
 pg_hook_execution_finish(QueryDesc *queryDesc)
 {
-	if (PrevExecutionFinishHook)
-		PrevExecutionFinishHook(queryDesc);
-	else
-		standard_ExecutorFinish(queryDesc);
+	/* AFTER triggers of the query, including IVM triggers, fire here */
+	IVM_BeginQueryFinish();
+	PG_TRY();
+	{
+		if (PrevExecutionFinishHook)
+			PrevExecutionFinishHook(queryDesc);
+		else
+			standard_ExecutorFinish(queryDesc);
+	}
+	PG_CATCH();
+	{
+		IVM_EndQueryFinish();
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+	IVM_EndQueryFinish();
 }
 
 void
 pg_hook_executor_end(QueryDesc *queryDesc)
 {
+	IvmExplainExecutorEnd(queryDesc);
+
+	/*
+	 * A portal may be closed without running the query, e.g. a cursor which
+	 * was never fetched from, so remove the query if it is still logged.
+	 */
+	if (schedule_state && IsLoggedQuery(queryDesc))
+	{
+		full_process--;
+		admitted_query = NULL;
+		forget_scheduler_locks(false);
+		LWLockAcquire(schedule_state->lock, LW_EXCLUSIVE);
+		RemoveLoggedQuery(queryDesc, queryHashTable, schedule_state);
+		Reschedule(queryHashTable, schedule_state);
+		LWLockRelease(schedule_state->lock);
+	}
+
 	if (PrevExecutionEndHook)
 		PrevExecutionEndHook(queryDesc);
 	else
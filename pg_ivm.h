@@ -25,26 +25,57 @@
 #include "nodes/plannodes.h"
 #include "utils/hsearch.h"
 #include "executor/execdesc.h"
+#include "utils/tuplestore.h"
+#include "portability/instr_time.h"
+#include "datatype/timestamp.h"
+#include "lib/ilist.h"
+#include "storage/latch.h"
+#include "storage/lockdefs.h"
+#include "utils/reltrigger.h"
 
-#define Natts_pg_ivm_immv 3
+#include "schedpolicy.h"
+
+#define Natts_pg_ivm_immv 6
 
 #define Anum_pg_ivm_immv_immvrelid 1
 #define Anum_pg_ivm_immv_viewdef 2
 #define Anum_pg_ivm_immv_ispopulated 3
+#define Anum_pg_ivm_immv_ismultiset 4
+#define Anum_pg_ivm_immv_keyattnums 5
+#define Anum_pg_ivm_immv_aggkinds 6
+
+/* Kinds of IMMV columns stored in pg_ivm_immv.aggkinds */
+#define IVM_AGG_NONE 'n'  /* not an aggregate */
+#define IVM_AGG_COUNT 'c' /* count() */
+#define IVM_AGG_SUM 's'	  /* sum() */
+#define IVM_AGG_AVG 'a'	  /* avg() */
+#define IVM_AGG_MIN 'm'	  /* min() */
+#define IVM_AGG_MAX 'M'	  /* max() */
 
 #define IVM_LOG_LEVEL DEBUG1
+
+/*
+ * Lock scopes of IVM triggers, passed as the second trigger argument.
+ * For compatibility, "true" and "false" written by older versions are
+ * read as IVM_LOCK_SCOPE_VIEW and IVM_LOCK_SCOPE_GROUP respectively.
+ */
+#define IVM_LOCK_SCOPE_VIEW 'v'	 /* ExclusiveLock on the whole IMMV */
+#define IVM_LOCK_SCOPE_GROUP 'g' /* RowExclusiveLock and locks on touched groups */
+#define IVM_LOCK_SCOPE_DEFERRED 'd' /* ExclusiveLock taken just before maintenance */
+
 /* pg_ivm.c */
 
 extern void CreateChangePreventTrigger(Oid matviewOid);
 extern Oid PgIvmImmvRelationId(void);
 extern Oid PgIvmImmvPrimaryKeyIndexId(void);
 extern bool isImmv(Oid immv_oid);
+extern void SchedulerLockImmvs(Relation rel, Trigger *trigger);
 
 /* createas.c */
 
 extern ObjectAddress ExecCreateImmv(ParseState *pstate, CreateTableAsStmt *stmt,
 									ParamListInfo params, QueryEnvironment *queryEnv,
-									QueryCompletion *qc);
+									QueryCompletion *qc, bool multiset);
 extern void CreateIvmTriggersOnBaseTables(Query *qry, Oid matviewOid);
 extern void CreateIndexOnIMMV(Query *query, Relation matviewRel);
 extern Query *rewriteQueryForIMMV(Query *query, List *colNames);
@@ -53,22 +84,80 @@ extern void makeIvmAggColumn(ParseState *pstate, Aggref *aggref, char *resname,
 
 /* matview.c */
 
-extern Query *get_immv_query(Relation matviewRel);
+extern int ivm_delta_sort_threshold;
+extern int ivm_delta_mem;
+
+extern Query *get_immv_query(Relation matviewRel, bool *multiset);
+extern void BuildImmvMaintDesc(Query *query, Datum *keyattnums, Datum *aggkinds);
 extern ObjectAddress ExecRefreshImmv(const RangeVar *relation, bool skipData,
 									 const char *queryString, QueryCompletion *qc);
 extern bool ImmvIncrementalMaintenanceIsEnabled(void);
-extern Query *get_immv_query(Relation matviewRel);
 extern Datum IVM_immediate_before(PG_FUNCTION_ARGS);
 extern Datum IVM_immediate_maintenance(PG_FUNCTION_ARGS);
 extern Query *rewrite_query_for_exists_subquery(Query *query);
 extern Datum ivm_visible_in_prestate(PG_FUNCTION_ARGS);
+extern Datum pg_ivm_delta_mem_stats(PG_FUNCTION_ARGS);
 extern void AtAbort_IVM(void);
+extern void IVM_BeginQueryFinish(void);
+extern void IVM_EndQueryFinish(void);
 extern char *getColumnNameStartWith(RangeTblEntry *rte, char *str, int *attnum);
 extern bool isIvmName(const char *s);
+extern LOCKMODE GetIvmSchedulerLockMode(Trigger *trigger);
+
+/* compactdelta.c */
+
+typedef struct CompactDelta CompactDelta;
+
+extern CompactDelta *compact_delta_begin(TupleDesc tupdesc);
+extern void compact_delta_put(CompactDelta *cd, TupleTableSlot *slot);
+extern void compact_delta_finish(CompactDelta *cd);
+extern void compact_delta_read(CompactDelta *cd, Tuplestorestate *tuplestore);
+extern void compact_delta_end(CompactDelta *cd);
+extern int64 compact_delta_bytes(CompactDelta *cd);
+
+/* explain.c */
+
+extern void IvmExplainSetStep(Oid immvid, const char *step);
+extern const char *IvmExplainQueryString(Query *query);
+extern void IvmExplainExecutorStart(QueryDesc *queryDesc, int eflags);
+extern void IvmExplainExecutorStarted(QueryDesc *queryDesc, int eflags);
+extern void IvmExplainExecutorEnd(QueryDesc *queryDesc);
+extern Datum pg_ivm_explain_maintenance(PG_FUNCTION_ARGS);
+
+/* immvstat.c */
+
+/* Cumulative counters of maintenance of an IMMV; times are in milliseconds */
+typedef struct ImmvStatCounters
+{
+	int64 calls;			 /* number of incremental maintenances */
+	double total_time;		 /* total time of maintenances */
+	double max_time;		 /* maximum time of a maintenance */
+	double rewrite_time;	 /* time to rewrite the view definition query */
+	double calc_delta_time;	 /* time to calculate view deltas */
+	double apply_delta_time; /* time to apply view deltas, including recalc_time */
+	double recalc_time;		 /* time to recalculate min/max values */
+	double lock_wait_time;	 /* time to wait for the lock on the IMMV */
+	int64 old_rows;			 /* tuples in old view deltas */
+	int64 new_rows;			 /* tuples in new view deltas */
+	int64 recalc_groups;	 /* groups whose min/max values are recalculated */
+	int64 full_refreshes;	 /* refreshes from scratch */
+} ImmvStatCounters;
+
+extern void ImmvStatShmemRequest(void);
+extern void ImmvStatShmemStartup(void);
+extern void ImmvStatReport(Oid immvid, const ImmvStatCounters *counters);
+extern void ImmvStatDropAtCommit(Oid immvid);
+extern void AtEOXact_ImmvStat(bool isCommit);
+extern void AtEOSubXact_ImmvStat(bool isCommit, SubTransactionId mySubid,
+								 SubTransactionId parentSubid);
+extern double ImmvStatElapsed(instr_time start);
+extern Datum pg_ivm_stat_immv(PG_FUNCTION_ARGS);
+extern Datum pg_ivm_stat_immv_reset(PG_FUNCTION_ARGS);
 
 /* ruleutils.c */
 
 extern char *pg_ivm_get_viewdef(Relation immvrel, bool pretty);
+extern char *pg_ivm_get_querydef(Query *query, bool pretty);
 
 /* subselect.c */
 extern void inline_cte(PlannerInfo *root, CommonTableExpr *cte);
@@ -82,24 +171,41 @@ extern void inline_cte(PlannerInfo *root, CommonTableExpr *cte);
  * which is not scalable. Maybe we should seek for a better solution.
  */
 
-#define QUERY_BLOCKED 0
-#define QUERY_AVAILABLE 1
-#define QUERY_ALLOWED 2
-#define QUERY_GIVE_UP 3
-
 /* Configurable parameters */
 #define MAX_QUERY_NUM 1000
-#define MAX_QUERY_LENGTH ((Size) 8192)
 #define MAX_AFFECTED_TABLE 100
 
 #define MAX_CONCURRENT_QUERY 4
 
-#define HASH_TABLE_SIZE (MAX_QUERY_NUM * sizeof(QueryTableEntry))
+/* Interval in milliseconds of looking for queries of exited backends while waiting */
+#define SCHEDULER_REAP_INTERVAL 1000
 
+/*
+ * Timeout in milliseconds of a wait for the admission. Waiting queries are
+ * woken up by their latches when admitted, so this only bounds the delay of
+ * looking for idle slots and queries of exited backends.
+ */
+#define SCHEDULER_WAIT_TIMEOUT 10
+
+/*
+ * The scheduler state is partitioned by database, and each partition has
+ * its own lock, query table of MAX_QUERY_NUM queries and MAX_CONCURRENT_QUERY
+ * slots. A partition is released when the last backend using it exits.
+ * Databases beyond MAX_SCHEDULE_PARTITIONS share partitions.
+ */
+#define MAX_SCHEDULE_PARTITIONS 8
+
+#define HASH_TABLE_SIZE \
+	(MAX_SCHEDULE_PARTITIONS * hash_estimate_size(MAX_QUERY_NUM, sizeof(QueryTableEntry)))
+
+/*
+ * Queries are identified by executions rather than by their text, which is
+ * the same for every execution of a prepared statement.
+ */
 typedef struct QueryTableKey
 {
-	char query_string[MAX_QUERY_LENGTH];
-	uint32 pid;
+	uint32 pid;	  /* backend executing the query */
+	uint64 execid; /* sequence number of the execution in the backend */
 } QueryTableKey;
 
 /* Data Structure for metadata like quries, affected tables, immvs or something else */
@@ -112,11 +218,24 @@ typedef struct QueryTableEntry
 	Oid affected_tables[MAX_AFFECTED_TABLE];
 	int status;
 	TransactionId xid;
+	TimestampTz enqueue_time; /* time logged in the query table */
+	uint64 arrival;			  /* arrival sequence number in the partition */
+	dlist_node fifo_node;	  /* link in the FIFO of the partition */
+	Latch *latch;			  /* latch of the backend, set when admitted */
+
+	/* Estimates of the size of the job, see LogQuery */
+	Cost total_cost;	/* planner's total cost of the statement */
+	double result_rows; /* rows to be modified in result relations */
+	double ivm_fanout;	/* dependent IMMVs x estimated delta rows */
+	double job_size;	/* total_cost plus cost of maintaining IMMVs */
 } QueryTableEntry;
 
-/* Saving all necessary information we need for query scheduling*/
+/* Saving all necessary information we need for query scheduling of a database */
 typedef struct SchedueState
 {
+	Oid dbid; /* database using this partition, or InvalidOid if free */
+	int nbackends; /* backends attached to this partition */
+	int nguests;   /* backends of other databases among them */
 	int querynum;
 	int runningQuery;
 
@@ -126,16 +245,62 @@ typedef struct SchedueState
 	LWLock *lock;
 	int query_status[MAX_QUERY_NUM];
 
+	/*
+	 * Queries in the query table in the order of arrival. Entries of the
+	 * query table are linked directly, as shared memory is mapped at the
+	 * same address in all backends.
+	 */
+	dlist_head fifo;
+	pg_atomic_uint64 next_arrival; /* arrival sequence number of the next query */
+
+	/* Statistics shown by pg_ivm_scheduler_stats() */
+	pg_atomic_uint64 admitted;		/* queries which got all necessary locks */
+	pg_atomic_uint64 give_ups;		/* times queries gave up on a lock conflict */
+	pg_atomic_uint64 reschedules;	/* calls of Reschedule() */
+	pg_atomic_uint64 wait_time;		/* total time to be admitted, in microseconds */
+	pg_atomic_uint64 max_wait_time; /* maximum time to be admitted, in microseconds */
+	pg_atomic_uint64 exclusive_locks;	  /* ExclusiveLocks taken on IMMVs */
+	pg_atomic_uint64 row_exclusive_locks; /* RowExclusiveLocks taken on IMMVs */
+	pg_atomic_uint64 reaped;			  /* queries of exited backends removed */
+	pg_atomic_uint64 queue_timeouts;	  /* queries canceled by pg_ivm.queue_timeout */
+	pg_atomic_uint64 collisions;		  /* attaches of backends of other databases */
+
+	/* State of the adaptive policy */
+	SchedBandit bandit;
 } ScheduleState;
 
-#define SEGMENT_SIZE (sizeof(ScheduleState))
+typedef struct ScheduleShared
+{
+	LWLock *lock; /* protects assignment of partitions and their backend counts */
+	ScheduleState partitions[MAX_SCHEDULE_PARTITIONS];
+} ScheduleShared;
+
+#define SEGMENT_SIZE (sizeof(ScheduleShared))
 
 /* querysched.c */
 
-extern QueryTableEntry *LogQuery(HTAB *queryTable, ScheduleState *state, PlannedStmt *plannedstmt,
-								 const char *query_string);
+extern int ivm_schedule_policy;
+extern int ivm_adaptive_epoch;
+extern const struct config_enum_entry schedule_policy_options[];
+
+extern QueryTableEntry *LogQuery(HTAB *queryTable, ScheduleState *state, QueryDesc *queryDesc);
 extern void Reschedule(HTAB *queryTable, ScheduleState *state);
 extern void RemoveLoggedQuery(QueryDesc *queryDesc, HTAB *queryHashTable,
 							  ScheduleState *schedule_state);
+extern void RemoveQueryEntry(HTAB *queryTable, ScheduleState *state, QueryTableEntry *query_entry);
+extern int ReapQueries(HTAB *queryTable, ScheduleState *state, int pid);
+extern bool IsLoggedQuery(QueryDesc *queryDesc);
+extern bool ForgetLoggedQueries(void);
+
+/* schedtrace.c */
+
+extern bool ivm_scheduler_trace;
+
+extern void SchedTraceShmemRequest(void);
+extern void SchedTraceShmemStartup(void);
+extern void SchedTraceRecord(SchedEventType type, const QueryTableEntry *query_entry, double score);
+extern Datum pg_ivm_scheduler_trace(PG_FUNCTION_ARGS);
+extern Datum pg_ivm_scheduler_trace_dump(PG_FUNCTION_ARGS);
+extern Datum pg_ivm_scheduler_trace_reset(PG_FUNCTION_ARGS);
 
 #endif
@@ -7,32 +7,97 @@
 #include "access/xact.h"
 #include "nodes/plannodes.h"
 #include "utils/builtins.h"
+#include "access/table.h"
+#include "storage/latch.h"
 #include "storage/lmgr.h"
+#include "storage/procarray.h"
+#include "utils/guc.h"
+#include "utils/inval.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+#include "utils/timestamp.h"
 
 #include "pg_ivm.h"
 
-void RescheduleUseMinTableAffected(HTAB *queryTable, ScheduleState *state);
-void RescheduleUseFCFS(HTAB *queryTable, ScheduleState *state);
-void RescheduleUseHotTableFirst(HTAB *queryTable, ScheduleState *state);
-
-typedef struct TableRef
+/* GUC variables */
+int ivm_schedule_policy = SCHEDULE_POLICY_HOT_TABLE_FIRST;
+int ivm_adaptive_epoch = 1000;
+
+const struct config_enum_entry schedule_policy_options[] = {
+	{ "fcfs", SCHEDULE_POLICY_FCFS, false },
+	{ "min_table_affected", SCHEDULE_POLICY_MIN_TABLE_AFFECTED, false },
+	{ "hot_table_first", SCHEDULE_POLICY_HOT_TABLE_FIRST, false },
+	{ "sjf", SCHEDULE_POLICY_SHORTEST_JOB_FIRST, false },
+	{ "adaptive", SCHEDULE_POLICY_ADAPTIVE, false },
+	{ NULL, 0, false }
+};
+
+/*
+ * Cost of maintaining IMMVs for a row of a base table delta, in the units of
+ * planner costs. Applying a delta row runs queries on the IMMV through SPI,
+ * which is far more expensive than processing a tuple in a plan.
+ */
+#define IVM_DELTA_ROW_COST 10.0
+
+/*
+ * QueryExecution
+ *
+ * An execution of the backend logged in the query table. An execution is
+ * identified by its QueryDesc while it runs, as portals of the extended
+ * query protocol may run several statements of the same text at a time.
+ */
+typedef struct QueryExecution
+{
+	QueryDesc *queryDesc;
+	QueryTableKey key;
+} QueryExecution;
+
+/* List of QueryExecution in TopMemoryContext */
+static List *query_executions = NIL;
+static uint64 next_execid = 0;
+
+/*
+ * IvmFootprint
+ *
+ * Numbers of IMMVs maintained by AFTER triggers of a base table for each
+ * operation, which are the same for every execution of statements on the
+ * table until its triggers change. They are cached in the backend and
+ * invalidated by relcache invalidation of the table.
+ */
+typedef struct IvmFootprint
 {
-	Oid oid;
-	int num_of_ref;
-} TableRef;
+	Oid relid;
+	int ins_immvs;
+	int del_immvs;
+	int upd_immvs;
+} IvmFootprint;
+
+static HTAB *footprint_cache = NULL;
+
+static void estimate_job_size(QueryTableEntry *query_entry, PlannedStmt *plannedStmt);
+static IvmFootprint *get_footprint(Oid relid);
+static void invalidate_footprint(Datum arg, Oid relid);
+static QueryExecution *find_execution(QueryDesc *queryDesc);
+static void admit_query(QueryTableEntry *query_entry, double score);
 
 QueryTableEntry *
-LogQuery(HTAB *queryTable, ScheduleState *state, PlannedStmt *plannedStmt, const char *query_string)
+LogQuery(HTAB *queryTable, ScheduleState *state, QueryDesc *queryDesc)
 {
+	PlannedStmt *plannedStmt = queryDesc->plannedstmt;
 	int oidIndex;
 	bool found;
 	QueryTableEntry *query_entry;
+	QueryExecution *execution;
+	MemoryContext oldcxt;
 	ListCell *roid;
 	QueryTableKey key;
 
+	if (list_length(plannedStmt->relationOids) > MAX_AFFECTED_TABLE)
+		elog(ERROR, "Too many affected tables for query: %s", queryDesc->sourceText);
+
 	memset(&key, 0, sizeof(QueryTableKey));
 	key.pid = MyProcPid;
-	strcpy(key.query_string, query_string);
+	key.execid = ++next_execid;
 
 	if (state->querynum >= MAX_QUERY_NUM)
 		ereport(ERROR, (errcode(ERRCODE_OUT_OF_MEMORY), errmsg("Too many queries in the system")));
@@ -42,239 +107,448 @@ LogQuery(HTAB *queryTable, ScheduleState *state, PlannedStmt *plannedStmt, const
 	query_entry = (QueryTableEntry *) hash_search(queryTable, &key, HASH_ENTER, &found);
 
 	if (found)
-	{
-		ereport(ERROR,
-				(errcode(ERRCODE_DUPLICATE_OBJECT),
-				 errmsg("Found duplicate entry key, query_string: %s, previous query_string: %s",
-						query_string,
-						query_entry->key.query_string)));
-	}
+		elog(ERROR, "duplicate execution %lu of pid %d", (unsigned long) key.execid, MyProcPid);
 
 	memset(query_entry, 0, sizeof(QueryTableEntry));
-	strcpy(query_entry->key.query_string, query_string);
-	query_entry->key.pid = MyProcPid;
+	query_entry->key = key;
 	query_entry->status = QUERY_BLOCKED;
 	query_entry->xid = GetCurrentTransactionId();
+	query_entry->enqueue_time = GetCurrentTimestamp();
+	query_entry->arrival = pg_atomic_fetch_add_u64(&state->next_arrival, 1);
+	query_entry->latch = MyLatch;
+	dlist_push_tail(&state->fifo, &query_entry->fifo_node);
 
 	elog(IVM_LOG_LEVEL, "Logging Transactionid: %u", query_entry->xid);
 
 	/* Not sure if this is correct.*/
 	oidIndex = 0;
 	foreach (roid, plannedStmt->relationOids)
+		query_entry->affected_tables[oidIndex++] = lfirst_oid(roid);
+
+	estimate_job_size(query_entry, plannedStmt);
+
+	oldcxt = MemoryContextSwitchTo(TopMemoryContext);
+	execution = (QueryExecution *) palloc(sizeof(QueryExecution));
+	execution->queryDesc = queryDesc;
+	execution->key = key;
+	query_executions = lappend(query_executions, execution);
+	MemoryContextSwitchTo(oldcxt);
+
+	SchedTraceRecord(SCHED_EVENT_ENQUEUE, query_entry, 0);
+
+	return query_entry;
+}
+
+/*
+ * estimate_job_size
+ *
+ * Estimate the size of the job of a statement from the plan. The rows to be
+ * modified are the estimated rows of the subplan of ModifyTable, and each of
+ * them generates deltas for every IMMV maintained by AFTER triggers for the
+ * operation on the result relations; UPDATE generates old and new deltas.
+ */
+static void
+estimate_job_size(QueryTableEntry *query_entry, PlannedStmt *plannedStmt)
+{
+	Plan *plan = plannedStmt->planTree;
+	double rows_per_immv = 0;
+	int nimmvs = 0;
+	ListCell *lc;
+
+	query_entry->total_cost = plan->total_cost;
+	query_entry->result_rows = 0;
+	query_entry->ivm_fanout = 0;
+
+	if (IsA(plan, ModifyTable) && outerPlan(plan) != NULL)
+		query_entry->result_rows = outerPlan(plan)->plan_rows;
+
+	switch (plannedStmt->commandType)
 	{
-		if (oidIndex > MAX_AFFECTED_TABLE)
+		case CMD_INSERT:
+		case CMD_DELETE:
+			rows_per_immv = query_entry->result_rows;
+			break;
+		case CMD_UPDATE:
+			rows_per_immv = query_entry->result_rows * 2;
+			break;
+		default:
+			break;
+	}
+
+	if (rows_per_immv > 0)
+	{
+		foreach (lc, plannedStmt->resultRelations)
 		{
-			elog(ERROR, "Too many affected tables for query: %s", query_string);
+			RangeTblEntry *rte = rt_fetch(lfirst_int(lc), plannedStmt->rtable);
+			IvmFootprint *footprint = get_footprint(rte->relid);
+
+			if (plannedStmt->commandType == CMD_INSERT)
+				nimmvs += footprint->ins_immvs;
+			else if (plannedStmt->commandType == CMD_DELETE)
+				nimmvs += footprint->del_immvs;
+			else
+				nimmvs += footprint->upd_immvs;
 		}
-		query_entry->affected_tables[oidIndex++] = lfirst_oid(roid);
-		// elog(IVM_LOG_LEVEL, "Logging affected table: %d", lfirst_oid(roid));
 	}
-	return query_entry;
+
+	query_entry->ivm_fanout = nimmvs * rows_per_immv;
+	query_entry->job_size = query_entry->total_cost + query_entry->ivm_fanout * IVM_DELTA_ROW_COST;
+
+	elog(IVM_LOG_LEVEL,
+		 "Job size of xid %u: cost %.2f, rows %.0f, fan-out %.0f",
+		 query_entry->xid,
+		 query_entry->total_cost,
+		 query_entry->result_rows,
+		 query_entry->ivm_fanout);
 }
 
-void
-RemoveLoggedQuery(QueryDesc *queryDesc, HTAB *queryHashTable, ScheduleState *schedule_state)
+/*
+ * get_footprint
+ *
+ * Return the numbers of IMMVs maintained for modifications of a table,
+ * counting its IVM triggers unless they are cached.
+ */
+static IvmFootprint *
+get_footprint(Oid relid)
 {
-	QueryTableEntry *query;
+	IvmFootprint *footprint;
+	IvmFootprint counts;
+	Relation rel;
 	bool found;
-	QueryTableKey key;
+	int i;
 
-	memset(&key, 0, sizeof(QueryTableKey));
-	key.pid = MyProcPid;
-	strcpy(key.query_string, queryDesc->sourceText);
+	if (footprint_cache == NULL)
+	{
+		HASHCTL ctl;
+
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(Oid);
+		ctl.entrysize = sizeof(IvmFootprint);
+		footprint_cache =
+			hash_create("pg_ivm footprint cache", 64, &ctl, HASH_ELEM | HASH_BLOBS);
+		CacheRegisterRelcacheCallback(invalidate_footprint, (Datum) 0);
+	}
 
-	query = hash_search(queryHashTable, &key, HASH_REMOVE, &found);
+	footprint = (IvmFootprint *) hash_search(footprint_cache, &relid, HASH_FIND, &found);
+	if (found)
+		return footprint;
 
-	if (!found || query == NULL)
+	memset(&counts, 0, sizeof(counts));
+
+	/* Result relations are already locked by ExecutorStart. */
+	rel = table_open(relid, NoLock);
+	for (i = 0; rel->trigdesc && i < rel->trigdesc->numtriggers; i++)
 	{
-		elog(IVM_LOG_LEVEL, "Pid:%d: Cannot find Query:%s", MyProcPid, queryDesc->sourceText);
-		return;
+		const char *tgname = rel->trigdesc->triggers[i].tgname;
+
+		if (strncmp(tgname, "IVM_trigger_ins_after", strlen("IVM_trigger_ins_after")) == 0)
+			counts.ins_immvs++;
+		else if (strncmp(tgname, "IVM_trigger_del_after", strlen("IVM_trigger_del_after")) == 0)
+			counts.del_immvs++;
+		else if (strncmp(tgname, "IVM_trigger_upd_after", strlen("IVM_trigger_upd_after")) == 0)
+			counts.upd_immvs++;
 	}
+	table_close(rel, NoLock);
 
-	elog(IVM_LOG_LEVEL, "Removing Query xid:%d", query->xid);
-	schedule_state->querynum--;
-}
+	footprint = (IvmFootprint *) hash_search(footprint_cache, &relid, HASH_ENTER, &found);
+	counts.relid = relid;
+	*footprint = counts;
 
-/* TODO: Implement a heuristic based rescheduling algorithm*/
-/* I noticed that some uneffective strategy will cause additionally deadlock.*/
-void
-Reschedule(HTAB *queryTable, ScheduleState *state)
-{
-	// RescheduleUseFCFS(queryTable, state);
-	// RescheduleUseMinTableAffected(queryTable, state);
-	RescheduleUseHotTableFirst(queryTable, state);
+	return footprint;
 }
 
-void
-RescheduleUseHotTableFirst(HTAB *queryTable, ScheduleState *state)
+/*
+ * invalidate_footprint
+ *
+ * Relcache invalidation callback, which is called when triggers of a table
+ * are created or dropped among others.
+ */
+static void
+invalidate_footprint(Datum arg, Oid relid)
 {
 	HASH_SEQ_STATUS status;
-	QueryTableEntry *query_entry;
-	List *listing = NIL;
-	List *sorted = NIL;
-	List *hot_score = NIL;
-	ListCell *curr;
-	HASHCTL hash_ctl;
-	HTAB *table_ref;
-	TableRef *table;
-	int temp;
-	int i, j, avaliable = 0;
-
-	avaliable = MAX_CONCURRENT_QUERY - state->runningQuery;
-
-	if (avaliable <= 0)
-		return;
+	IvmFootprint *footprint;
 
-	hash_seq_init(&status, queryTable);
+	if (OidIsValid(relid))
+	{
+		hash_search(footprint_cache, &relid, HASH_REMOVE, NULL);
+		return;
+	}
 
-	memset(&hash_ctl, 0, sizeof(hash_ctl));
-	hash_ctl.keysize = sizeof(Oid);
-	hash_ctl.entrysize = sizeof(TableRef);
+	hash_seq_init(&status, footprint_cache);
+	while ((footprint = (IvmFootprint *) hash_seq_search(&status)) != NULL)
+		hash_search(footprint_cache, &footprint->relid, HASH_REMOVE, NULL);
+}
 
-	table_ref = hash_create("TableRef", 10, &hash_ctl, HASH_ELEM | HASH_BLOBS);
+static QueryExecution *
+find_execution(QueryDesc *queryDesc)
+{
+	ListCell *lc;
 
-	while ((query_entry = (QueryTableEntry *) hash_seq_search(&status)) != NULL)
+	foreach (lc, query_executions)
 	{
-		listing = lappend(listing, query_entry);
-		for (j = 0; j < MAX_AFFECTED_TABLE && query_entry->affected_tables[j] != 0; j++)
-		{
-			table = hash_search(table_ref, &query_entry->affected_tables[j], HASH_ENTER, NULL);
-			table->num_of_ref++;
-		}
+		QueryExecution *execution = (QueryExecution *) lfirst(lc);
+
+		if (execution->queryDesc == queryDesc)
+			return execution;
 	}
 
-	foreach (curr, listing)
-	{
-		temp = 0;
-		query_entry = (QueryTableEntry *) lfirst(curr);
-		for (j = 0; j < MAX_AFFECTED_TABLE && query_entry->affected_tables[j] != 0; j++)
-		{
-			table = hash_search(table_ref, &query_entry->affected_tables[j], HASH_ENTER, NULL);
-			temp += table->num_of_ref;
-		}
+	return NULL;
+}
 
-		if (sorted == NIL)
-		{
-			sorted = lappend(sorted, query_entry);
-			hot_score = lappend_int(hot_score, temp);
-			continue;
-		}
+/*
+ * IsLoggedQuery
+ *
+ * Return true if the execution of queryDesc is logged in the query table.
+ */
+bool
+IsLoggedQuery(QueryDesc *queryDesc)
+{
+	return find_execution(queryDesc) != NULL;
+}
 
-		for (i = 0; i < list_length(sorted); i++)
-		{
-			if (list_nth_int(hot_score, i) < temp)
-			{
-				break;
-			}
-		}
+/*
+ * ForgetLoggedQueries
+ *
+ * Forget the executions of the backend, whose queries must be removed from
+ * the query table by the caller, at the end of the transaction running them.
+ * Return true if there were any.
+ */
+bool
+ForgetLoggedQueries(void)
+{
+	if (query_executions == NIL)
+		return false;
+
+	list_free_deep(query_executions);
+	query_executions = NIL;
+	return true;
+}
+
+void
+RemoveLoggedQuery(QueryDesc *queryDesc, HTAB *queryHashTable, ScheduleState *schedule_state)
+{
+	QueryExecution *execution = find_execution(queryDesc);
+	QueryTableEntry *query;
+	bool found;
 
-		sorted = list_insert_nth(sorted, i, query_entry);
-		hot_score = list_insert_nth_int(hot_score, i, temp);
+	if (execution == NULL)
+	{
+		elog(IVM_LOG_LEVEL, "Pid:%d: Cannot find Query:%s", MyProcPid, queryDesc->sourceText);
+		return;
 	}
 
-	foreach (curr, sorted)
+	query = hash_search(queryHashTable, &execution->key, HASH_FIND, &found);
+
+	query_executions = list_delete_ptr(query_executions, execution);
+	pfree(execution);
+
+	if (!found || query == NULL)
 	{
-		query_entry = (QueryTableEntry *) lfirst(curr);
-		if (query_entry->status == QUERY_BLOCKED)
-		{
-			query_entry->status = QUERY_AVAILABLE;
-			state->runningQuery++;
-			avaliable = MAX_CONCURRENT_QUERY - state->runningQuery;
-		}
-		else if (query_entry->status == QUERY_GIVE_UP)
-		{
-			query_entry->status = QUERY_BLOCKED;
-		}
-		if (avaliable <= 0 || state->runningQuery == state->querynum)
-			break;
+		elog(IVM_LOG_LEVEL, "Pid:%d: Cannot find Query:%s", MyProcPid, queryDesc->sourceText);
+		return;
 	}
 
-	hash_destroy(table_ref);
-	list_free(listing);
-	list_free(sorted);
-	list_free(hot_score);
+	SchedBanditComplete(&schedule_state->bandit, GetCurrentTimestamp() - query->enqueue_time);
+	RemoveQueryEntry(queryHashTable, schedule_state, query);
 }
 
+/*
+ * RemoveQueryEntry
+ *
+ * Remove a query from the query table, releasing its slot if it is running.
+ * The caller must hold the lock of the partition in exclusive mode.
+ */
 void
-RescheduleUseFCFS(HTAB *queryTable, ScheduleState *state)
+RemoveQueryEntry(HTAB *queryTable, ScheduleState *state, QueryTableEntry *query_entry)
 {
-	HASH_SEQ_STATUS status;
-	QueryTableEntry *query_entry;
-	int avaliable;
+	elog(IVM_LOG_LEVEL, "Removing Query xid:%d", query_entry->xid);
 
-	avaliable = MAX_CONCURRENT_QUERY - state->runningQuery;
+	if (query_entry->status == QUERY_AVAILABLE)
+		state->runningQuery--;
+	SchedTraceRecord(SCHED_EVENT_COMPLETE, query_entry, 0);
+	dlist_delete(&query_entry->fifo_node);
+	hash_search(queryTable, &query_entry->key, HASH_REMOVE, NULL);
+	state->querynum--;
 
-	if (avaliable <= 0)
-		return;
+	Assert(state->runningQuery >= 0 && state->runningQuery <= MAX_CONCURRENT_QUERY);
+}
+
+/*
+ * ReapQueries
+ *
+ * Remove queries of the backend with the pid, or of backends which no longer
+ * exist if pid is 0, from the query table, releasing the slots of running
+ * ones. Then reconcile the counters of the partition with the queries left.
+ * Return the number of removed queries. The caller must hold the lock of the
+ * partition in exclusive mode.
+ */
+int
+ReapQueries(HTAB *queryTable, ScheduleState *state, int pid)
+{
+	dlist_mutable_iter iter;
+	int removed = 0;
+	int removed_running = 0;
+	int querynum = 0;
+	int running = 0;
 
-	hash_seq_init(&status, queryTable);
-	while ((query_entry = (QueryTableEntry *) hash_seq_search(&status)) != NULL)
+	dlist_foreach_modify (iter, &state->fifo)
 	{
-		if (query_entry->status == QUERY_BLOCKED)
-		{
-			query_entry->status = QUERY_AVAILABLE;
-			state->runningQuery++;
-			avaliable = MAX_CONCURRENT_QUERY - state->runningQuery;
-		}
-		else if (query_entry->status == QUERY_GIVE_UP)
-		{
-			query_entry->status = QUERY_BLOCKED;
-		}
+		QueryTableEntry *query_entry = dlist_container(QueryTableEntry, fifo_node, iter.cur);
 
-		if (avaliable <= 0 || state->runningQuery == state->querynum)
+		if (pid != 0 ? (int) query_entry->key.pid != pid
+					 : BackendPidGetProc(query_entry->key.pid) != NULL)
 		{
-			hash_seq_term(&status);
-			return;
+			querynum++;
+			if (query_entry->status == QUERY_AVAILABLE)
+				running++;
+			continue;
 		}
+
+		elog(IVM_LOG_LEVEL,
+			 "Reaping query of pid %u, xid %u",
+			 query_entry->key.pid,
+			 query_entry->xid);
+
+		if (query_entry->status == QUERY_AVAILABLE)
+			removed_running++;
+		SchedTraceRecord(SCHED_EVENT_COMPLETE, query_entry, 0);
+		dlist_delete(&query_entry->fifo_node);
+		hash_search(queryTable, &query_entry->key, HASH_REMOVE, NULL);
+		removed++;
 	}
+
+	/* Counters should match the queries left unless they were leaked */
+	if (state->querynum - removed != querynum || state->runningQuery - removed_running != running)
+		elog(LOG,
+			 "pg_ivm scheduler reconciled %d queries with %d running, counted as %d with %d running",
+			 querynum,
+			 running,
+			 state->querynum - removed,
+			 state->runningQuery - removed_running);
+
+	state->querynum = querynum;
+	state->runningQuery = running;
+
+	return removed;
 }
 
+/* TODO: Implement a heuristic based rescheduling algorithm*/
+/* I noticed that some uneffective strategy will cause additionally deadlock.*/
+
+/*
+ * Reschedule
+ *
+ * Choose queries to be admitted by the policy set by
+ * pg_ivm.schedule_policy, or by the policy of the current epoch chosen by
+ * the bandit of the partition if it is adaptive. The policies are
+ * implemented in schedpolicy.c, which sees the queries in the FIFO of the
+ * partition as an array of SchedCandidate in the order of arrival.
+ */
 void
-RescheduleUseMinTableAffected(HTAB *queryTable, ScheduleState *state)
+Reschedule(HTAB *queryTable, ScheduleState *state)
 {
-	HASH_SEQ_STATUS status;
 	QueryTableEntry *query_entry;
-	List *sorted = NIL;
-	List *num_of_affected_tables = NIL;
-	ListCell *curr;
-	int j, index;
-	int allowed = 0;
-
-	if (allowed + state->runningQuery == MAX_CONCURRENT_QUERY)
+	QueryTableEntry **entries;
+	SchedulePolicy policy = (SchedulePolicy) ivm_schedule_policy;
+	SchedCandidate *cands;
+	dlist_iter iter;
+	uint32 *tables;
+	int *order;
+	int ncands = 0;
+	int ntables = 0;
+	int i;
+
+	pg_atomic_fetch_add_u64(&state->reschedules, 1);
+
+	if (MAX_CONCURRENT_QUERY - state->runningQuery <= 0 || dlist_is_empty(&state->fifo))
 		return;
 
-	hash_seq_init(&status, queryTable);
+	if (policy == SCHEDULE_POLICY_ADAPTIVE)
+		policy = SchedBanditPolicy(&state->bandit,
+								   GetCurrentTimestamp(),
+								   (int64) ivm_adaptive_epoch * 1000);
 
-	while ((query_entry = (QueryTableEntry *) hash_seq_search(&status)) != NULL)
+	/*
+	 * FCFS admits queries from the head of the FIFO, and stops as soon as the
+	 * slots are full without looking at the rest of the queries.
+	 */
+	if (policy == SCHEDULE_POLICY_FCFS)
 	{
-		for (j = 0; query_entry->affected_tables[j] != 0; j++)
-			;
-		index = 0;
-		foreach (curr, sorted)
+		dlist_foreach (iter, &state->fifo)
 		{
-			if (list_nth_int(num_of_affected_tables, index) > j)
+			int prev_status;
+			bool more;
+
+			query_entry = dlist_container(QueryTableEntry, fifo_node, iter.cur);
+			prev_status = query_entry->status;
+			more = SchedAdmitOne(&query_entry->status,
+								 &state->runningQuery,
+								 state->querynum,
+								 MAX_CONCURRENT_QUERY);
+			if (prev_status == QUERY_BLOCKED && query_entry->status == QUERY_AVAILABLE)
+				admit_query(query_entry, 0);
+			if (!more)
 				break;
-			index++;
 		}
-		sorted = list_insert_nth(sorted, index, query_entry);
-		num_of_affected_tables = list_insert_nth_int(num_of_affected_tables, index, j);
+		return;
 	}
 
-	foreach (curr, sorted)
+	entries = (QueryTableEntry **) palloc(sizeof(QueryTableEntry *) * state->querynum);
+	cands = (SchedCandidate *) palloc(sizeof(SchedCandidate) * state->querynum);
+	order = (int *) palloc(sizeof(int) * state->querynum);
+
+	dlist_foreach (iter, &state->fifo)
 	{
-		query_entry = (QueryTableEntry *) lfirst(curr);
-		if (query_entry->status == QUERY_BLOCKED)
-		{
-			allowed++;
-			query_entry->status = QUERY_AVAILABLE;
-			state->runningQuery++;
-		}
-		else if (query_entry->status == QUERY_GIVE_UP)
-		{
-			query_entry->status = QUERY_BLOCKED;
-		}
-		if (allowed + state->runningQuery >= MAX_CONCURRENT_QUERY ||
-			state->runningQuery == state->querynum)
-			break;
+		SchedCandidate *cand = &cands[ncands];
+		int j;
+
+		Assert(ncands < state->querynum);
+		query_entry = dlist_container(QueryTableEntry, fifo_node, iter.cur);
+
+		for (j = 0; j < MAX_AFFECTED_TABLE && query_entry->affected_tables[j] != 0; j++)
+			;
+
+		cand->status = query_entry->status;
+		cand->naffected = j;
+		cand->affected = query_entry->affected_tables;
+		cand->job_size = query_entry->job_size;
+		cand->arrival = query_entry->arrival;
+		cand->score = 0;
+		ntables += j;
+		entries[ncands++] = query_entry;
 	}
+
+	tables = (uint32 *) palloc(sizeof(uint32) * Max(ntables, 1));
+
+	SchedOrder(policy, cands, ncands, tables, order);
+	SchedAdmit(cands, order, ncands, &state->runningQuery, state->querynum, MAX_CONCURRENT_QUERY);
+
+	for (i = 0; i < ncands; i++)
+	{
+		if (entries[i]->status == cands[i].status)
+			continue;
+
+		entries[i]->status = cands[i].status;
+		if (cands[i].status == QUERY_AVAILABLE)
+			admit_query(entries[i], cands[i].score);
+	}
+
+	pfree(entries);
+	pfree(cands);
+	pfree(order);
+	pfree(tables);
+}
+
+/*
+ * admit_query
+ *
+ * Record the admission of a query and wake up its backend waiting for it.
+ */
+static void
+admit_query(QueryTableEntry *query_entry, double score)
+{
+	SchedTraceRecord(SCHED_EVENT_ADMIT, query_entry, score);
+	if (query_entry->latch)
+		SetLatch(query_entry->latch);
 }
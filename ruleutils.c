@@ -42,7 +42,8 @@
 char *
 pg_ivm_get_viewdef(Relation immvrel, bool pretty)
 {
-	Query *query = get_immv_query(immvrel);
+	bool multiset;
+	Query *query = get_immv_query(immvrel, &multiset);
 	TupleDesc resultDesc = RelationGetDescr(immvrel);
 
 #if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 150000)
@@ -60,6 +61,11 @@ pg_ivm_get_viewdef(Relation immvrel, bool pretty)
 	 * function pg_get_querydef (for PG15 or higher).
 	 */
 	query = copyObject(query);
+
+	/* DISTINCT of a multiset IMMV is not a part of the definition */
+	if (multiset)
+		query->distinctClause = NIL;
+
 	foreach (lc, query->targetList)
 	{
 		TargetEntry *tle = (TargetEntry *) lfirst(lc);
@@ -82,6 +88,13 @@ pg_ivm_get_viewdef(Relation immvrel, bool pretty)
 
 	initStringInfo(&buf);
 
+	/* DISTINCT of a multiset IMMV is not a part of the definition */
+	if (multiset)
+	{
+		query = copyObject(query);
+		query->distinctClause = NIL;
+	}
+
 	/*
 	 * For PG14 or earlier, we use get_query_def which is copied
 	 * from the core because any public function for this purpose
@@ -93,3 +106,31 @@ pg_ivm_get_viewdef(Relation immvrel, bool pretty)
 	return buf.data;
 #endif
 }
+
+/* ----------
+ * pg_ivm_get_querydef
+ *
+ * Public entry point to deparse a query parsetree built for maintenance.
+ *
+ * The result is a palloc'd C string.
+ * ----------
+ */
+char *
+pg_ivm_get_querydef(Query *query, bool pretty)
+{
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 150000)
+	return pg_get_querydef(query, pretty);
+#else
+	StringInfoData buf;
+	int			prettyFlags;
+
+	prettyFlags = GET_PRETTY_FLAGS(pretty);
+
+	initStringInfo(&buf);
+
+	get_query_def(query, &buf, NIL, NULL, true,
+				  prettyFlags, WRAP_COLUMN_DEFAULT, 0);
+
+	return buf.data;
+#endif
+}
@@ -0,0 +1,311 @@
+/*-------------------------------------------------------------------------
+ *
+ * schedpolicy.c
+ *	  scheduling policies of the query scheduler
+ *
+ * The scheduler in querysched.c and the offline simulator in tools/schedsim.c
+ * both choose queries to admit with the functions here, which only see the
+ * queries as an array of SchedCandidate and so do not depend on the backend.
+ *
+ * Portions Copyright (c) 2022, IVM Development Group
+ *
+ *-------------------------------------------------------------------------
+ */
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "schedpolicy.h"
+
+static int oid_cmp(const void *a, const void *b);
+static int count_refs(const uint32_t *tables, int ntables, uint32_t oid);
+static SchedulePolicy bandit_choose(SchedBandit *bandit);
+
+/* Return true if candidate a should be considered before b */
+static inline int
+cand_precedes(const SchedCandidate *a, const SchedCandidate *b)
+{
+	if (a->score != b->score)
+		return a->score < b->score;
+	return a->arrival < b->arrival;
+}
+
+/*
+ * SchedOrder
+ *
+ * Score the candidates by the policy and set order to the indexes of the
+ * candidates in the order they should be considered for admission, lower
+ * score first. Candidates with the same score are ordered by arrival.
+ *
+ * tables is a workspace with room for the affected tables of all the
+ * candidates, used by SCHEDULE_POLICY_HOT_TABLE_FIRST.
+ */
+void
+SchedOrder(SchedulePolicy policy, SchedCandidate *cands, int ncands, uint32_t *tables, int *order)
+{
+	int ntables = 0;
+	int i, j;
+
+	if (policy == SCHEDULE_POLICY_HOT_TABLE_FIRST)
+	{
+		for (i = 0; i < ncands; i++)
+			for (j = 0; j < cands[i].naffected; j++)
+				tables[ntables++] = cands[i].affected[j];
+		qsort(tables, ntables, sizeof(uint32_t), oid_cmp);
+	}
+
+	for (i = 0; i < ncands; i++)
+	{
+		SchedCandidate *cand = &cands[i];
+
+		switch (policy)
+		{
+			case SCHEDULE_POLICY_FCFS:
+				cand->score = 0;
+				break;
+			case SCHEDULE_POLICY_MIN_TABLE_AFFECTED:
+				cand->score = cand->naffected;
+				break;
+			case SCHEDULE_POLICY_HOT_TABLE_FIRST:
+				/* negated number of references to the tables by all queries */
+				cand->score = 0;
+				for (j = 0; j < cand->naffected; j++)
+					cand->score -= count_refs(tables, ntables, cand->affected[j]);
+				break;
+			case SCHEDULE_POLICY_SHORTEST_JOB_FIRST:
+				cand->score = cand->job_size;
+				break;
+			case SCHEDULE_POLICY_ADAPTIVE:
+				/* callers pass the policy chosen by SchedBanditPolicy instead */
+				cand->score = 0;
+				break;
+		}
+	}
+
+	/*
+	 * Insertion sort, which is fast enough for a partition, and moves few
+	 * elements as the candidates are mostly passed in the order of arrival.
+	 */
+	for (i = 0; i < ncands; i++)
+	{
+		for (j = i; j > 0 && cand_precedes(&cands[i], &cands[order[j - 1]]); j--)
+			order[j] = order[j - 1];
+		order[j] = i;
+	}
+}
+
+/*
+ * SchedAdmit
+ *
+ * Make blocked candidates available in the given order while running is
+ * less than max_running, and let candidates which gave up be admitted at
+ * the next time. querynum is the number of queries in the query table.
+ * Return the number of admitted candidates.
+ */
+int
+SchedAdmit(SchedCandidate *cands, const int *order, int ncands, int *running, int querynum,
+		   int max_running)
+{
+	int admitted = 0;
+	int i;
+
+	if (*running >= max_running)
+		return 0;
+
+	for (i = 0; i < ncands; i++)
+	{
+		SchedCandidate *cand = &cands[order[i]];
+		int prev_status = cand->status;
+		int more;
+
+		more = SchedAdmitOne(&cand->status, running, querynum, max_running);
+		if (prev_status == QUERY_BLOCKED && cand->status == QUERY_AVAILABLE)
+			admitted++;
+		if (!more)
+			break;
+	}
+
+	return admitted;
+}
+
+/*
+ * SchedAdmitOne
+ *
+ * Admit a query with the status if it is blocked, or let it be admitted at
+ * the next time if it gave up. Return false if no more queries can be
+ * admitted, that is, if all the slots or all the queries are running.
+ */
+int
+SchedAdmitOne(int *status, int *running, int querynum, int max_running)
+{
+	if (*status == QUERY_BLOCKED)
+	{
+		*status = QUERY_AVAILABLE;
+		(*running)++;
+	}
+	else if (*status == QUERY_GIVE_UP)
+	{
+		*status = QUERY_BLOCKED;
+	}
+
+	return !(*running >= max_running || *running == querynum);
+}
+
+/*
+ * SchedBanditInit
+ *
+ * Initialize the state of the adaptive policy.
+ */
+void
+SchedBanditInit(SchedBandit *bandit)
+{
+	memset(bandit, 0, sizeof(SchedBandit));
+	bandit->policy = SCHEDULE_POLICY_FCFS;
+}
+
+/*
+ * SchedBanditPolicy
+ *
+ * Return the policy to use at now. If the current epoch has lasted for
+ * epoch_length, reward its policy and choose the policy of the next epoch.
+ * An epoch in which no query completed is extended, as there is nothing to
+ * judge the policy by.
+ */
+SchedulePolicy
+SchedBanditPolicy(SchedBandit *bandit, int64_t now, int64_t epoch_length)
+{
+	double score;
+	SchedulePolicy next;
+
+	if (bandit->epoch_start == 0)
+	{
+		bandit->policy = bandit_choose(bandit);
+		bandit->epoch_start = now;
+		return bandit->policy;
+	}
+
+	if (now - bandit->epoch_start < epoch_length || bandit->completed == 0)
+		return bandit->policy;
+
+	/* throughput divided by mean latency */
+	score = (double) bandit->completed * bandit->completed /
+			((double) (now - bandit->epoch_start) * (bandit->latency > 0 ? bandit->latency : 1));
+	if (score > bandit->best_score)
+		bandit->best_score = score;
+
+	bandit->pulls[bandit->policy]++;
+	bandit->rewards[bandit->policy] += score / bandit->best_score;
+	bandit->epochs++;
+
+	next = bandit_choose(bandit);
+	if (next != bandit->policy)
+		bandit->switches++;
+
+	bandit->policy = next;
+	bandit->epoch_start = now;
+	bandit->completed = 0;
+	bandit->latency = 0;
+
+	return bandit->policy;
+}
+
+/*
+ * SchedBanditComplete
+ *
+ * Count a query completed with the latency in microseconds from its
+ * arrival in the current epoch.
+ */
+void
+SchedBanditComplete(SchedBandit *bandit, int64_t latency)
+{
+	bandit->completed++;
+	bandit->latency += latency;
+}
+
+/*
+ * bandit_choose
+ *
+ * Choose the policy with the largest upper confidence bound of the reward,
+ * trying every policy once first.
+ */
+static SchedulePolicy
+bandit_choose(SchedBandit *bandit)
+{
+	SchedulePolicy best = SCHEDULE_POLICY_FCFS;
+	double best_bound = -1;
+	uint64_t total = 0;
+	int i;
+
+	for (i = 0; i < SCHED_BANDIT_ARMS; i++)
+	{
+		if (bandit->pulls[i] == 0)
+			return (SchedulePolicy) i;
+		total += bandit->pulls[i];
+	}
+
+	for (i = 0; i < SCHED_BANDIT_ARMS; i++)
+	{
+		double bound = bandit->rewards[i] / bandit->pulls[i] +
+					   sqrt(2.0 * log((double) total) / bandit->pulls[i]);
+
+		if (bound > best_bound)
+		{
+			best = (SchedulePolicy) i;
+			best_bound = bound;
+		}
+	}
+
+	return best;
+}
+
+static int
+oid_cmp(const void *a, const void *b)
+{
+	uint32_t oa = *(const uint32_t *) a;
+	uint32_t ob = *(const uint32_t *) b;
+
+	if (oa < ob)
+		return -1;
+	if (oa > ob)
+		return 1;
+	return 0;
+}
+
+/*
+ * count_refs
+ *
+ * Return the number of occurrences of oid in the sorted array tables.
+ */
+static int
+count_refs(const uint32_t *tables, int ntables, uint32_t oid)
+{
+	int lo = 0;
+	int hi = ntables;
+	int first;
+
+	/* find the first element not less than oid */
+	while (lo < hi)
+	{
+		int mid = lo + (hi - lo) / 2;
+
+		if (tables[mid] < oid)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	first = lo;
+
+	/* find the first element greater than oid */
+	hi = ntables;
+	while (lo < hi)
+	{
+		int mid = lo + (hi - lo) / 2;
+
+		if (tables[mid] <= oid)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo - first;
+}
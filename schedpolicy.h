@@ -0,0 +1,129 @@
+/*-------------------------------------------------------------------------
+ *
+ * schedpolicy.h
+ *	  scheduling policies of the query scheduler and the trace format
+ *
+ * This header and schedpolicy.c do not depend on the backend, so that the
+ * offline simulator in tools/schedsim.c runs the same policies as the
+ * scheduler does.
+ *
+ * Portions Copyright (c) 2022, IVM Development Group
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef _SCHEDPOLICY_H_
+#define _SCHEDPOLICY_H_
+
+#include <stdint.h>
+
+/* Status of queries in the scheduler */
+#define QUERY_BLOCKED 0
+#define QUERY_AVAILABLE 1
+#define QUERY_ALLOWED 2
+#define QUERY_GIVE_UP 3
+
+/* Scheduling policies, see pg_ivm.schedule_policy */
+typedef enum SchedulePolicy
+{
+	SCHEDULE_POLICY_FCFS,				/* in the order of arrival */
+	SCHEDULE_POLICY_MIN_TABLE_AFFECTED, /* queries affecting fewer tables first */
+	SCHEDULE_POLICY_HOT_TABLE_FIRST,	/* queries on frequently referenced tables first */
+	SCHEDULE_POLICY_SHORTEST_JOB_FIRST, /* queries with smaller estimated job size first */
+	SCHEDULE_POLICY_ADAPTIVE			/* one of the above chosen by SchedBandit */
+} SchedulePolicy;
+
+/*
+ * SchedCandidate
+ *
+ * A query in the query table as seen by the policies. The policies order
+ * candidates by a score, lower first, and earlier arrival first among the
+ * same score.
+ */
+typedef struct SchedCandidate
+{
+	int status;				 /* QUERY_XXX */
+	int naffected;			 /* number of tables in affected */
+	const uint32_t *affected; /* OIDs of tables referenced by the query */
+	double job_size;		 /* estimated size of the job */
+	uint64_t arrival;		 /* arrival sequence number of the query */
+	double score;			 /* set by SchedOrder */
+} SchedCandidate;
+
+extern void SchedOrder(SchedulePolicy policy, SchedCandidate *cands, int ncands, uint32_t *tables,
+					   int *order);
+extern int SchedAdmit(SchedCandidate *cands, const int *order, int ncands, int *running,
+					  int querynum, int max_running);
+extern int SchedAdmitOne(int *status, int *running, int querynum, int max_running);
+
+/*
+ * SchedBandit
+ *
+ * State of SCHEDULE_POLICY_ADAPTIVE, which divides time into epochs and
+ * chooses the policy for each epoch among the others with the UCB1 bandit
+ * algorithm. The reward of an epoch is its throughput divided by the mean
+ * latency of the queries completed in it, relative to the best epoch so far.
+ */
+#define SCHED_BANDIT_ARMS SCHEDULE_POLICY_ADAPTIVE
+
+typedef struct SchedBandit
+{
+	SchedulePolicy policy; /* policy of the current epoch */
+	int64_t epoch_start;   /* start of the current epoch in microseconds, or 0 */
+	uint64_t completed;	   /* queries completed in the current epoch */
+	double latency;		   /* total latency of them in microseconds */
+	double best_score;	   /* best throughput / mean latency of an epoch */
+	uint64_t pulls[SCHED_BANDIT_ARMS]; /* epochs run with each policy */
+	double rewards[SCHED_BANDIT_ARMS]; /* total rewards of each policy */
+	uint64_t epochs;				   /* epochs finished */
+	uint64_t switches;				   /* times the policy changed between epochs */
+} SchedBandit;
+
+extern void SchedBanditInit(SchedBandit *bandit);
+extern SchedulePolicy SchedBanditPolicy(SchedBandit *bandit, int64_t now, int64_t epoch_length);
+extern void SchedBanditComplete(SchedBandit *bandit, int64_t latency);
+
+/*
+ * Trace of scheduler decisions
+ *
+ * Events are recorded in a ring buffer in shared memory when
+ * pg_ivm.scheduler_trace is on, and pg_ivm_scheduler_trace_dump() writes them
+ * to a file as a SchedTraceHeader followed by SchedTraceEvents in the order
+ * of seq.
+ */
+#define SCHED_TRACE_MAGIC 0x49565354 /* "IVST" */
+#define SCHED_TRACE_VERSION 1
+
+/* Maximum number of affected tables recorded in an event */
+#define SCHED_TRACE_MAX_TABLES 16
+
+typedef enum SchedEventType
+{
+	SCHED_EVENT_ENQUEUE,  /* a query is logged in the query table */
+	SCHED_EVENT_ADMIT,	  /* a query is made available to run */
+	SCHED_EVENT_GIVE_UP, /* a query gave up its slot on a lock conflict */
+	SCHED_EVENT_COMPLETE  /* a query is removed from the query table */
+} SchedEventType;
+
+typedef struct SchedTraceHeader
+{
+	uint32_t magic;	  /* SCHED_TRACE_MAGIC */
+	uint32_t version; /* SCHED_TRACE_VERSION */
+	uint64_t nevents; /* number of events following */
+} SchedTraceHeader;
+
+typedef struct SchedTraceEvent
+{
+	uint64_t seq;	   /* sequence number of the event */
+	int64_t time;	   /* microseconds since the PostgreSQL epoch */
+	int32_t pid;	   /* backend running the query */
+	uint32_t dbid;	   /* database of the query */
+	uint32_t xid;	   /* transaction of the query */
+	uint8_t type;	   /* SchedEventType */
+	uint8_t policy;	   /* SchedulePolicy in effect */
+	int16_t naffected; /* number of affected tables, may exceed SCHED_TRACE_MAX_TABLES */
+	double job_size;   /* estimated size of the job */
+	double score;	   /* score given by the policy, for SCHED_EVENT_ADMIT */
+	uint32_t affected[SCHED_TRACE_MAX_TABLES]; /* OIDs of affected tables */
+} SchedTraceEvent;
+
+#endif
@@ -0,0 +1,302 @@
+/*-------------------------------------------------------------------------
+ *
+ * schedtrace.c
+ *	  trace of decisions of the query scheduler
+ *
+ * When pg_ivm.scheduler_trace is on, the scheduler records every query
+ * entering the query table, admitted, giving up its slot and leaving the
+ * query table in a ring buffer in shared memory, with the tables it affects,
+ * its estimated job size and its score under the policy. The buffer keeps
+ * the last SCHED_TRACE_SIZE events of all databases.
+ *
+ * pg_ivm_scheduler_trace() shows the events, and
+ * pg_ivm_scheduler_trace_dump() writes them to a file in the format of
+ * schedpolicy.h, which tools/schedsim.c replays under each policy.
+ *
+ * Portions Copyright (c) 2022, IVM Development Group
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "catalog/pg_authid_d.h"
+#include "catalog/pg_type_d.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "storage/fd.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/acl.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/timestamp.h"
+
+#include "pg_ivm.h"
+
+/* Number of events kept in the ring buffer */
+#define SCHED_TRACE_SIZE 8192
+
+#define SCHED_TRACE_COLS 11
+
+typedef struct SchedTraceShared
+{
+	LWLock *lock;	   /* protects the fields below */
+	uint64 first_seq;  /* sequence number of the first event after reset */
+	uint64 next_seq;   /* sequence number of the next event */
+	SchedTraceEvent events[SCHED_TRACE_SIZE];
+} SchedTraceShared;
+
+/* GUC variable */
+bool ivm_scheduler_trace = false;
+
+static SchedTraceShared *sched_trace = NULL;
+
+static const char *const sched_event_names[] = { "enqueue", "admit", "give_up", "complete" };
+
+PG_FUNCTION_INFO_V1(pg_ivm_scheduler_trace);
+PG_FUNCTION_INFO_V1(pg_ivm_scheduler_trace_dump);
+PG_FUNCTION_INFO_V1(pg_ivm_scheduler_trace_reset);
+
+static SchedTraceEvent *sched_trace_copy(uint64 *nevents);
+static void check_sched_trace(void);
+
+/*
+ * SchedTraceShmemRequest
+ *
+ * Request shared memory and a lock for the ring buffer. This must be called
+ * from shmem_request_hook.
+ */
+void
+SchedTraceShmemRequest(void)
+{
+	RequestAddinShmemSpace(MAXALIGN(sizeof(SchedTraceShared)));
+	RequestNamedLWLockTranche("pg_ivm_trace", 1);
+}
+
+/*
+ * SchedTraceShmemStartup
+ *
+ * Allocate or attach to the ring buffer. This must be called from
+ * shmem_startup_hook.
+ */
+void
+SchedTraceShmemStartup(void)
+{
+	bool found;
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	sched_trace = ShmemInitStruct("pg_ivm_trace", sizeof(SchedTraceShared), &found);
+	if (!found)
+	{
+		sched_trace->lock = &(GetNamedLWLockTranche("pg_ivm_trace")->lock);
+		sched_trace->first_seq = 0;
+		sched_trace->next_seq = 0;
+	}
+
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * SchedTraceRecord
+ *
+ * Record an event of a query in the query table. score is the score given
+ * to the query by the policy for SCHED_EVENT_ADMIT, and ignored otherwise.
+ */
+void
+SchedTraceRecord(SchedEventType type, const QueryTableEntry *query_entry, double score)
+{
+	SchedTraceEvent *event;
+	int naffected;
+	int i;
+
+	if (!ivm_scheduler_trace || !sched_trace)
+		return;
+
+	for (naffected = 0;
+		 naffected < MAX_AFFECTED_TABLE && query_entry->affected_tables[naffected] != 0;
+		 naffected++)
+		;
+
+	LWLockAcquire(sched_trace->lock, LW_EXCLUSIVE);
+
+	event = &sched_trace->events[sched_trace->next_seq % SCHED_TRACE_SIZE];
+	memset(event, 0, sizeof(SchedTraceEvent));
+	event->seq = sched_trace->next_seq++;
+	event->time = GetCurrentTimestamp();
+	event->pid = query_entry->key.pid;
+	event->dbid = MyDatabaseId;
+	event->xid = query_entry->xid;
+	event->type = type;
+	event->policy = ivm_schedule_policy;
+	event->naffected = naffected;
+	event->job_size = query_entry->job_size;
+	event->score = (type == SCHED_EVENT_ADMIT) ? score : 0;
+	for (i = 0; i < naffected && i < SCHED_TRACE_MAX_TABLES; i++)
+		event->affected[i] = query_entry->affected_tables[i];
+
+	LWLockRelease(sched_trace->lock);
+}
+
+/*
+ * sched_trace_copy
+ *
+ * Return a copy of the events in the ring buffer in the order of their
+ * sequence numbers, and set nevents to the number of them.
+ */
+static SchedTraceEvent *
+sched_trace_copy(uint64 *nevents)
+{
+	SchedTraceEvent *events;
+	uint64 first;
+	uint64 seq;
+
+	LWLockAcquire(sched_trace->lock, LW_SHARED);
+
+	first = sched_trace->first_seq;
+	if (sched_trace->next_seq - first > SCHED_TRACE_SIZE)
+		first = sched_trace->next_seq - SCHED_TRACE_SIZE;
+	*nevents = sched_trace->next_seq - first;
+	events = (SchedTraceEvent *) palloc(sizeof(SchedTraceEvent) * Max(*nevents, 1));
+	for (seq = first; seq < sched_trace->next_seq; seq++)
+		events[seq - first] = sched_trace->events[seq % SCHED_TRACE_SIZE];
+
+	LWLockRelease(sched_trace->lock);
+
+	return events;
+}
+
+static void
+check_sched_trace(void)
+{
+	if (!sched_trace)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_ivm must be loaded via shared_preload_libraries")));
+}
+
+/*
+ * pg_ivm_scheduler_trace
+ *
+ * Show the events in the ring buffer.
+ */
+Datum
+pg_ivm_scheduler_trace(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	SchedTraceEvent *events;
+	uint64 nevents;
+	uint64 i;
+
+	check_sched_trace();
+
+	InitMaterializedSRF(fcinfo, 0);
+
+	events = sched_trace_copy(&nevents);
+
+	for (i = 0; i < nevents; i++)
+	{
+		SchedTraceEvent *event = &events[i];
+		Datum values[SCHED_TRACE_COLS];
+		bool nulls[SCHED_TRACE_COLS];
+		Datum affected[SCHED_TRACE_MAX_TABLES];
+		int naffected = Min(event->naffected, SCHED_TRACE_MAX_TABLES);
+		int j;
+
+		for (j = 0; j < naffected; j++)
+			affected[j] = ObjectIdGetDatum(event->affected[j]);
+
+		memset(nulls, 0, sizeof(nulls));
+		values[0] = Int64GetDatum((int64) event->seq);
+		values[1] = TimestampTzGetDatum(event->time);
+		values[2] = CStringGetTextDatum(sched_event_names[event->type]);
+		values[3] = Int32GetDatum(event->pid);
+		values[4] = ObjectIdGetDatum(event->dbid);
+		values[5] = TransactionIdGetDatum(event->xid);
+		values[6] = CStringGetTextDatum(schedule_policy_options[event->policy].name);
+		values[7] = Float8GetDatum(event->job_size);
+		if (event->type == SCHED_EVENT_ADMIT)
+			values[8] = Float8GetDatum(event->score);
+		else
+			nulls[8] = true;
+		values[9] = Int32GetDatum(event->naffected);
+		values[10] = PointerGetDatum(construct_array(affected, naffected, OIDOID, sizeof(Oid), true,
+													 TYPALIGN_INT));
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+
+	pfree(events);
+
+	return (Datum) 0;
+}
+
+/*
+ * pg_ivm_scheduler_trace_dump
+ *
+ * Write the events in the ring buffer to a file, and return the number of
+ * them. A relative path is taken relative to the data directory.
+ */
+Datum
+pg_ivm_scheduler_trace_dump(PG_FUNCTION_ARGS)
+{
+	char *filename = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	SchedTraceHeader header;
+	SchedTraceEvent *events;
+	uint64 nevents;
+	FILE *file;
+
+	check_sched_trace();
+
+	if (!has_privs_of_role(GetUserId(), ROLE_PG_WRITE_SERVER_FILES))
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("permission denied to write a scheduler trace file"),
+				 errdetail("Only roles with privileges of the \"%s\" role may write files on the "
+						   "server.",
+						   "pg_write_server_files")));
+
+	events = sched_trace_copy(&nevents);
+
+	file = AllocateFile(filename, PG_BINARY_W);
+	if (file == NULL)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open file \"%s\" for writing: %m", filename)));
+
+	memset(&header, 0, sizeof(header));
+	header.magic = SCHED_TRACE_MAGIC;
+	header.version = SCHED_TRACE_VERSION;
+	header.nevents = nevents;
+
+	if (fwrite(&header, sizeof(header), 1, file) != 1 ||
+		(nevents > 0 && fwrite(events, sizeof(SchedTraceEvent), nevents, file) != nevents))
+		ereport(ERROR,
+				(errcode_for_file_access(), errmsg("could not write file \"%s\": %m", filename)));
+
+	if (FreeFile(file))
+		ereport(ERROR,
+				(errcode_for_file_access(), errmsg("could not close file \"%s\": %m", filename)));
+
+	pfree(events);
+
+	PG_RETURN_INT64((int64) nevents);
+}
+
+/*
+ * pg_ivm_scheduler_trace_reset
+ *
+ * Discard the events in the ring buffer.
+ */
+Datum
+pg_ivm_scheduler_trace_reset(PG_FUNCTION_ARGS)
+{
+	check_sched_trace();
+
+	LWLockAcquire(sched_trace->lock, LW_EXCLUSIVE);
+	/* keep sequence numbers increasing so that dumps can be told apart */
+	sched_trace->first_seq = sched_trace->next_seq;
+	LWLockRelease(sched_trace->lock);
+
+	PG_RETURN_VOID();
+}
@@ -0,0 +1,37 @@
+# Concurrent maintenance of a join IMMV
+#
+# The IMMV is locked exclusively only just before its maintenance, so a
+# statement modifying one base table doesn't block a statement modifying
+# another one. The maintenance run later sees the change committed in the
+# meantime, and the row joining both changes is not lost.
+
+setup
+{
+  SET client_min_messages TO warning;
+  CREATE TABLE dj_a (i int, x int);
+  CREATE TABLE dj_b (i int, y int);
+  INSERT INTO dj_a VALUES (1, 10), (2, 20);
+  INSERT INTO dj_b VALUES (1, 100), (3, 300);
+  SELECT create_immv('dj_mv', 'SELECT a.i, a.x, b.y FROM dj_a a JOIN dj_b b ON a.i = b.i');
+}
+
+teardown
+{
+  DROP TABLE dj_mv;
+  DROP TABLE dj_a;
+  DROP TABLE dj_b;
+}
+
+# s1 stops between modifying dj_a and maintaining the view
+session s1
+step s1_ins_a	{ WITH r AS (INSERT INTO dj_a VALUES (4, 40) RETURNING i) SELECT pg_advisory_xact_lock(1) FROM r; }
+
+session s2
+step s2_ins_b	{ INSERT INTO dj_b VALUES (4, 400), (2, 200); }
+
+session s3
+step s3_lock	{ SELECT pg_advisory_lock(1); }
+step s3_unlock	{ SELECT pg_advisory_unlock(1); }
+step s3_check	{ SELECT i, x, y FROM dj_mv ORDER BY i; }
+
+permutation s3_lock s1_ins_a s2_ins_b s3_check s3_unlock s3_check
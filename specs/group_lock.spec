@@ -0,0 +1,42 @@
+# Concurrent maintenance of a single-table IMMV
+#
+# Maintenances touching the same group of the view are serialized by the
+# group locks, so a group created by two transactions ends up in one row.
+# Maintenances touching different groups don't block each other.
+
+setup
+{
+  SET client_min_messages TO warning;
+  CREATE TABLE grp_t (g int, v int);
+  INSERT INTO grp_t VALUES (1, 10), (2, 20);
+  SELECT create_immv('grp_mv', 'SELECT g, sum(v) AS total, count(*) AS cnt FROM grp_t GROUP BY g');
+}
+
+teardown
+{
+  DROP TABLE grp_mv;
+  DROP TABLE grp_t;
+}
+
+session s1
+step s1_begin	{ BEGIN; }
+step s1_ins_g1	{ INSERT INTO grp_t VALUES (1, 1); }
+step s1_ins_g3	{ INSERT INTO grp_t VALUES (3, 1); }
+step s1_commit	{ COMMIT; }
+
+session s2
+step s2_ins_g1	{ INSERT INTO grp_t VALUES (1, 2); }
+step s2_ins_g2	{ INSERT INTO grp_t VALUES (2, 2); }
+step s2_ins_g3	{ INSERT INTO grp_t VALUES (3, 2); }
+
+session s3
+step s3_check	{ SELECT g, total, cnt FROM grp_mv ORDER BY g; }
+
+# the same existing group
+permutation s1_begin s1_ins_g1 s2_ins_g1 s1_commit s3_check
+
+# a group created by both sessions
+permutation s1_begin s1_ins_g3 s2_ins_g3 s1_commit s3_check
+
+# different groups, which are hashed into different lock partitions
+permutation s1_begin s1_ins_g1 s2_ins_g2 s3_check s1_commit s3_check
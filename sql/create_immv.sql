@@ -11,6 +11,12 @@ SELECT immvrelid, get_immv_def(immvrelid) FROM pg_ivm_immv ORDER BY 1;
 -- contain immv
 SELECT create_immv('mv_in_immv01', 'SELECT i FROM mv');
 SELECT create_immv('mv_in_immv02', 'SELECT t.i FROM t INNER JOIN mv2 ON t.i = mv2.x');
+INSERT INTO t VALUES (101), (102);
+DELETE FROM t WHERE i <= 4;
+SELECT count(*), min(i), max(i) FROM mv_in_immv01;
+SELECT count(*), min(i), max(i) FROM mv_in_immv02;
+DROP TABLE mv_in_immv01;
+DROP TABLE mv_in_immv02;
 
 -- SQL other than SELECT
 SELECT create_immv('mv_in_create', 'CREATE TABLE in_create(i int)');
@@ -28,3 +34,26 @@ DROP TABLE mv2;
 SELECT immvrelid, get_immv_def(immvrelid) FROM pg_ivm_immv ORDER BY 1;
 
 DROP TABLE t;
+
+-- multiset storage
+CREATE TABLE ms_t (k int, i int, j int, d json);
+INSERT INTO ms_t VALUES (1, 1, 10, '{}'), (2, 1, 10, '{}'), (3, 1, 10, '{}'), (4, 2, 20, '{}'), (5, 2, 20, '{}');
+SELECT create_immv('ms_mv', 'SELECT i, j FROM ms_t', 'multiset');
+SELECT * FROM ms_mv ORDER BY 1;
+INSERT INTO ms_t VALUES (6, 2, 20, '{}'), (7, 3, 30, '{}');
+DELETE FROM ms_t WHERE k IN (1, 2);
+SELECT * FROM ms_mv ORDER BY 1;
+UPDATE ms_t SET i = 3, j = 30 WHERE k = 3;
+SELECT * FROM ms_mv ORDER BY 1;
+SELECT i, j FROM pg_ivm_expand_immv(NULL::ms_mv) ORDER BY 1;
+SELECT get_immv_def('ms_mv');
+SELECT create_immv('ms_rows', 'SELECT i, j FROM ms_t', 'rows');
+SELECT immvrelid, ismultiset FROM pg_ivm_immv ORDER BY 1;
+SELECT * FROM pg_ivm_expand_immv(NULL::ms_rows);
+SELECT create_immv('ms_mv2', 'SELECT i FROM ms_t', 'bag');
+SELECT create_immv('ms_mv2', 'SELECT DISTINCT i FROM ms_t', 'multiset');
+SELECT create_immv('ms_mv2', 'SELECT i, count(*) FROM ms_t GROUP BY i', 'multiset');
+SELECT create_immv('ms_mv2', 'SELECT i, d FROM ms_t', 'multiset');
+DROP TABLE ms_mv;
+DROP TABLE ms_rows;
+DROP TABLE ms_t;
@@ -150,6 +150,22 @@ DELETE FROM mv_base_a;
 SELECT * FROM mv_ivm_min_max;
 ROLLBACK;
 
+-- recalculate min/max values of several groups in one statement
+BEGIN;
+CREATE TABLE minmax_t (g int, v int, s text);
+INSERT INTO minmax_t VALUES
+  (1, 10, 'a'), (1, 20, 'b'), (1, 30, 'c'),
+  (2, 10, 'd'), (2, 20, 'e'),
+  (3, 10, 'f'), (3, 30, 'g'), (3, 30, 'h'),
+  (4, 40, 'i');
+SELECT create_immv('mv_minmax_batch',
+ 'SELECT g, min(v) AS min_v, max(v) AS max_v, min(s) AS min_s, max(s) AS max_s, count(*) AS cnt FROM minmax_t GROUP BY g');
+DELETE FROM minmax_t WHERE (g, v) IN ((1, 10), (1, 30), (2, 20), (3, 10)) OR g = 4;
+SELECT * FROM mv_minmax_batch ORDER BY g;
+UPDATE minmax_t SET v = v + 100 WHERE v = (SELECT min(v) FROM minmax_t m WHERE m.g = minmax_t.g);
+SELECT * FROM mv_minmax_batch ORDER BY g;
+ROLLBACK;
+
 -- Test MIN/MAX after search_path change
 BEGIN;
 SELECT create_immv('mv_ivm_min', 'SELECT MIN(j) FROM mv_base_a');
@@ -271,6 +287,34 @@ SELECT * FROM mv_ivm_exists_subquery ORDER BY i, j;
 SELECT * FROM mv_ivm_exists_subquery2 ORDER BY i, j;
 ROLLBACK;
 
+-- combine the delta terms of several modified tables in one statement
+BEGIN;
+CREATE TABLE ct_r (i int, v int);
+CREATE TABLE ct_s (i int, w int);
+INSERT INTO ct_r VALUES (1, 10), (2, 20), (3, 30);
+INSERT INTO ct_s VALUES (1, 100), (2, 200), (3, 300), (4, 400);
+SELECT create_immv('mv_ct_join', 'SELECT r.i, r.v, s.w FROM ct_r r JOIN ct_s s ON r.i = s.i');
+SELECT create_immv('mv_ct_agg',
+ 'SELECT r.i, count(*) AS cnt, sum(s.w) AS total FROM ct_r r JOIN ct_s s ON r.i = s.i GROUP BY r.i');
+SELECT create_immv('mv_ct_self', 'SELECT t1.i, count(*) AS cnt FROM ct_r t1 JOIN ct_r t2 ON t1.i = t2.i GROUP BY t1.i');
+SELECT create_immv('mv_ct_exists', 'SELECT r.i, r.v FROM ct_r r WHERE EXISTS(SELECT 1 FROM ct_s s WHERE s.i = r.i)');
+-- (4, 40, 400) inserted by the term of ct_r is deleted by the term of ct_s
+WITH
+ ins_r AS (INSERT INTO ct_r VALUES (4, 40), (5, 50) RETURNING 1),
+ ins_s AS (INSERT INTO ct_s VALUES (5, 500), (1, 101) RETURNING 1),
+ del_s AS (DELETE FROM ct_s WHERE i IN (2, 4) RETURNING 1)
+SELECT NULL;
+SELECT * FROM mv_ct_join ORDER BY i, v, w;
+SELECT * FROM mv_ct_agg ORDER BY i;
+SELECT * FROM mv_ct_self ORDER BY i;
+SELECT * FROM mv_ct_exists ORDER BY i, v;
+UPDATE ct_r SET i = 1 WHERE i IN (2, 3);
+SELECT * FROM mv_ct_join ORDER BY i, v, w;
+SELECT * FROM mv_ct_agg ORDER BY i;
+SELECT * FROM mv_ct_self ORDER BY i;
+SELECT * FROM mv_ct_exists ORDER BY i, v;
+ROLLBACK;
+
 -- support simple subquery in FROM clause
 BEGIN;
 SELECT create_immv('mv_ivm_subquery', 'SELECT a.i,a.j FROM mv_base_a a,( SELECT * FROM mv_base_b) b WHERE a.i = b.i');
@@ -664,6 +708,102 @@ CREATE TABLE table_json (j json);
 SELECT create_immv('mv_json', 'SELECT * from table_json');
 ROLLBACK;
 
+-- sort large deltas by the index key of the view
+BEGIN;
+SET LOCAL pg_ivm.delta_sort_threshold = 2;
+CREATE TABLE sort_t (i int, j int);
+SELECT create_immv('mv_sort', 'SELECT i, sum(j) AS s, count(*) AS c FROM sort_t GROUP BY i');
+INSERT INTO sort_t VALUES (3, 30), (1, 10), (2, 20), (3, 3);
+SELECT * FROM mv_sort ORDER BY i;
+DELETE FROM sort_t WHERE j IN (30, 10);
+SELECT * FROM mv_sort ORDER BY i;
+SET LOCAL pg_ivm.delta_sort_threshold = -1;
+INSERT INTO sort_t VALUES (5, 50), (4, 40);
+SELECT * FROM mv_sort ORDER BY i;
+ROLLBACK;
+
+-- spill pending deltas at the minimum pg_ivm.delta_mem
+BEGIN;
+SET LOCAL pg_ivm.delta_mem = 64;
+CREATE TABLE spill_t (i int, flag text, body text);
+INSERT INTO spill_t SELECT i, CASE WHEN i % 3 = 0 THEN NULL ELSE 'flag' || i % 2 END, repeat(md5(i::text), 4)
+ FROM generate_series(1, 180) i;
+INSERT INTO spill_t SELECT i, 'wide', (SELECT string_agg(md5((i * 1000 + g)::text), '') FROM generate_series(1, 100) g)
+ FROM generate_series(1001, 1003) i;
+SELECT create_immv('mv_spill', 'SELECT i, flag, body FROM spill_t');
+WITH
+ del AS (DELETE FROM spill_t WHERE flag = 'wide' RETURNING 1),
+ upd AS (UPDATE spill_t SET flag = 'flag2' WHERE i <= 180 RETURNING 1),
+ ins AS (INSERT INTO spill_t SELECT i, NULL, repeat(md5(i::text), 4) FROM generate_series(181, 360) i RETURNING 1)
+SELECT (SELECT count(*) FROM del) AS del, (SELECT count(*) FROM upd) AS upd, (SELECT count(*) FROM ins) AS ins;
+SELECT count(*), count(flag), count(DISTINCT flag) FROM mv_spill;
+(SELECT * FROM mv_spill EXCEPT ALL SELECT * FROM spill_t)
+UNION ALL
+(SELECT * FROM spill_t EXCEPT ALL SELECT * FROM mv_spill);
+SELECT spilled_deltas > 0 AS spilled, spilled_file_bytes > 0 AS written FROM pg_ivm_delta_mem_stats();
+ROLLBACK;
+
+-- share the delta of a table among IMMVs on it
+BEGIN;
+CREATE TABLE share_t (i int, v int);
+INSERT INTO share_t VALUES (1, 10), (2, 20);
+SELECT create_immv('mv_share1', 'SELECT i, v FROM share_t');
+SELECT create_immv('mv_share2', 'SELECT i, sum(v) AS total FROM share_t GROUP BY i');
+SELECT create_immv('mv_share3', 'SELECT DISTINCT v FROM share_t');
+SELECT shared_deltas AS shared_before FROM pg_ivm_delta_mem_stats() \gset
+INSERT INTO share_t VALUES (3, 30);
+UPDATE share_t SET v = v + 1 WHERE i = 1;
+SELECT shared_deltas - :shared_before AS shared, held_bytes FROM pg_ivm_delta_mem_stats();
+SELECT * FROM mv_share1 ORDER BY i;
+SELECT i, total FROM mv_share2 ORDER BY i;
+SELECT v FROM mv_share3 ORDER BY v;
+ROLLBACK;
+
+-- rebuild the maintenance descriptor after the IMMV is altered
+BEGIN;
+CREATE TABLE desc_t (g int, v int);
+INSERT INTO desc_t VALUES (1, 10), (1, 5), (2, 20);
+SELECT create_immv('mv_desc', 'SELECT g, sum(v) AS total, min(v) AS lo, count(*) AS cnt FROM desc_t GROUP BY g');
+SELECT keyattnums, aggkinds FROM pg_ivm_immv WHERE immvrelid = 'mv_desc'::regclass;
+INSERT INTO desc_t VALUES (1, 1), (3, 30);
+SELECT g, total, lo, cnt FROM mv_desc ORDER BY g;
+ALTER TABLE mv_desc RENAME COLUMN g TO grp;
+DELETE FROM desc_t WHERE v = 1;
+SELECT grp, total, lo, cnt FROM mv_desc ORDER BY grp;
+DROP INDEX mv_desc_index;
+CREATE UNIQUE INDEX ON mv_desc (grp);
+SET LOCAL pg_ivm.delta_sort_threshold = 1;
+INSERT INTO desc_t VALUES (2, 2), (4, 40), (1, 1);
+SELECT grp, total, lo, cnt FROM mv_desc ORDER BY grp;
+-- IMMVs created by older versions have no stored descriptor
+UPDATE pg_ivm_immv SET keyattnums = NULL, aggkinds = NULL WHERE immvrelid = 'mv_desc'::regclass;
+ALTER TABLE mv_desc RENAME COLUMN grp TO g;
+DELETE FROM desc_t WHERE g IN (1, 3) AND v < 30;
+SELECT g, total, lo, cnt FROM mv_desc ORDER BY g;
+-- the name of the IMMV is qualified by the schema
+CREATE SCHEMA desc_s;
+ALTER TABLE mv_desc SET SCHEMA desc_s;
+INSERT INTO desc_t VALUES (2, 1);
+ALTER SCHEMA desc_s RENAME TO desc_s2;
+INSERT INTO desc_t VALUES (4, 4);
+SELECT g, total, lo, cnt FROM desc_s2.mv_desc ORDER BY g;
+ROLLBACK;
+
+-- show plans of queries executed for maintenance
+BEGIN;
+CREATE TABLE explain_t (g int, v int);
+INSERT INTO explain_t VALUES (1, 10), (1, 20), (2, 30);
+SELECT create_immv('mv_explain', 'SELECT g, sum(v) AS total, count(*) AS cnt FROM explain_t GROUP BY g');
+SELECT step, query IS NOT NULL AS has_query, plan LIKE '%actual time=%' AS analyzed, rows, total_time >= 0 AS timed
+  FROM pg_ivm_explain_maintenance('mv_explain', 'INSERT INTO explain_t VALUES (1, 5), (3, 7)');
+SELECT step, query IS NOT NULL AS has_query, plan LIKE '%actual time=%' AS analyzed, rows, total_time >= 0 AS timed
+  FROM pg_ivm_explain_maintenance('mv_explain', 'UPDATE explain_t SET v = v + 1 WHERE g = 1');
+-- the statement is rolled back
+SELECT * FROM explain_t ORDER BY g, v;
+SELECT g, total, cnt FROM mv_explain ORDER BY g;
+SELECT * FROM pg_ivm_explain_maintenance('explain_t', 'DELETE FROM explain_t');
+ROLLBACK;
+
 -- prevent IMMV chanages
 INSERT INTO mv_ivm_1 VALUES(1,1,1);
 UPDATE  mv_ivm_1 SET k = 1 WHERE i = 1;
@@ -37,3 +37,44 @@ SELECT refresh_immv('mv_not_existing', true);
 
 -- Try to refresh a normal table -- error
 SELECT refresh_immv('t', true);
+
+-- IMMVs defined on IMMVs
+CREATE TABLE nt (g int, v int);
+INSERT INTO nt VALUES (1, 10), (1, 20), (2, 30);
+SELECT create_immv('nmv_agg', 'SELECT g, sum(v) AS total, count(*) AS cnt FROM nt GROUP BY g');
+SELECT create_immv('nmv_agg_top', 'SELECT g, total FROM nmv_agg WHERE total > 25');
+SELECT create_immv('nmv_dist', 'SELECT DISTINCT g FROM nt');
+SELECT create_immv('nmv_dist_top', 'SELECT g FROM nmv_dist');
+SELECT create_immv('nmv_all', 'SELECT sum(v) AS total, count(*) AS cnt FROM nt');
+SELECT create_immv('nmv_all_top', 'SELECT total, cnt FROM nmv_all');
+INSERT INTO nt VALUES (3, 40), (1, -15);
+SELECT * FROM nmv_agg_top ORDER BY g;
+
+-- refresh_immv() refreshes the IMMVs defined on the IMMV too
+SELECT refresh_immv('nmv_dist', false);
+SELECT immvrelid, ispopulated FROM pg_ivm_immv WHERE immvrelid::text LIKE 'nmv_dist%' ORDER BY 1;
+INSERT INTO nt VALUES (4, 50);
+SELECT g FROM nmv_dist_top ORDER BY g;
+SELECT refresh_immv('nmv_dist', true);
+SELECT immvrelid, ispopulated FROM pg_ivm_immv WHERE immvrelid::text LIKE 'nmv_dist%' ORDER BY 1;
+INSERT INTO nt VALUES (5, 60);
+SELECT g FROM nmv_dist_top ORDER BY g;
+SELECT * FROM nmv_all_top;
+
+-- TRUNCATE of the base table reaches the IMMVs defined on the IMMVs
+TRUNCATE nt;
+SELECT count(*) FROM nmv_agg_top;
+SELECT count(*) FROM nmv_dist_top;
+SELECT * FROM nmv_all_top;
+
+-- Refreshing the IMMVs defined on the IMMV needs their ownership
+CREATE ROLE regress_ivm_owner;
+ALTER TABLE nt OWNER TO regress_ivm_owner;
+ALTER TABLE nmv_agg OWNER TO regress_ivm_owner;
+SET ROLE regress_ivm_owner;
+SELECT refresh_immv('nmv_agg', true);
+RESET ROLE;
+DROP TABLE nmv_agg_top, nmv_dist_top, nmv_all_top;
+DROP TABLE nmv_agg, nmv_dist, nmv_all;
+DROP TABLE nt;
+DROP ROLE regress_ivm_owner;
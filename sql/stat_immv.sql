@@ -0,0 +1,17 @@
+-- statistics are available only when pg_ivm is loaded via shared_preload_libraries
+CREATE TABLE stat_t (i int, j int);
+SELECT create_immv('stat_mv', 'SELECT i, sum(j) AS s FROM stat_t GROUP BY i');
+SELECT 'stat_mv'::regclass::oid AS stat_mv_oid \gset
+SELECT pg_ivm_stat_immv_reset();
+INSERT INTO stat_t VALUES (1, 10), (2, 20);
+DELETE FROM stat_t WHERE i = 1;
+SELECT refresh_immv('stat_mv', true);
+SELECT calls, old_rows, new_rows, full_refreshes FROM pg_ivm_stat_immv WHERE immvrelid = :stat_mv_oid;
+-- statistics are removed when the IMMV is dropped
+BEGIN;
+DROP TABLE stat_mv;
+ROLLBACK;
+SELECT count(*) FROM pg_ivm_stat_immv WHERE immvrelid = :stat_mv_oid;
+DROP TABLE stat_mv;
+SELECT count(*) FROM pg_ivm_stat_immv WHERE immvrelid = :stat_mv_oid;
+DROP TABLE stat_t;
@@ -0,0 +1,548 @@
+/*-------------------------------------------------------------------------
+ *
+ * schedsim.c
+ *	  replay a trace of the query scheduler under each scheduling policy
+ *
+ * The trace is a file written by pg_ivm_scheduler_trace_dump(). Each query
+ * in it arrives at the time it was logged, and runs for the time it ran
+ * from its last admission to its completion once admitted. Queries are
+ * admitted by the same functions in schedpolicy.c as the scheduler uses,
+ * with at most max_concurrent queries running. A query admitted while a
+ * running query affects one of its tables gives up its slot as a query
+ * failing to lock IMMVs does, and is considered again at the next event.
+ * The adaptive policy runs epochs of the simulated time.
+ *
+ * Usage:
+ *	  make schedsim
+ *	  ./schedsim [-c max_concurrent] [-e adaptive_epoch_ms] [-p policy[,...]] [-n]
+ *		trace_file
+ *
+ * Portions Copyright (c) 2022, IVM Development Group
+ *
+ *-------------------------------------------------------------------------
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "schedpolicy.h"
+
+typedef struct SimJob
+{
+	int32_t pid;
+	int64_t arrival;	  /* time logged in the trace */
+	int64_t admitted;	  /* time last admitted in the trace, or -1 */
+	int64_t completed;	  /* time completed in the trace, or -1 */
+	int64_t service;	  /* time to run once admitted */
+	double job_size;
+	int naffected;
+	uint32_t affected[SCHED_TRACE_MAX_TABLES];
+
+	/* state of the simulation */
+	int status;		/* QUERY_XXX */
+	int running;	/* true if running */
+	int64_t finish; /* time to finish if running */
+	int64_t done;	/* time finished */
+} SimJob;
+
+typedef struct SimResult
+{
+	int njobs;
+	double mean_latency;
+	double p50, p95, p99;
+	double mean_wait;
+	double makespan;
+	long give_ups;
+	SchedBandit bandit; /* state of the adaptive policy at the end */
+} SimResult;
+
+static const char *const policy_names[] = {
+	"fcfs", "min_table_affected", "hot_table_first", "sjf", "adaptive"
+};
+
+#define NUM_POLICIES ((int) (sizeof(policy_names) / sizeof(policy_names[0])))
+
+static SimJob *read_trace(const char *filename, int *njobs);
+static void simulate(SimJob *jobs, int njobs, SchedulePolicy policy, int max_running,
+					 int64_t epoch, int conflicts, SimResult *result);
+static int conflicts_with_running(SimJob *jobs, int njobs, SimJob *job);
+static void summarize(SimJob *jobs, int njobs, int64_t start, SimResult *result);
+static int arrival_cmp(const void *a, const void *b);
+static int latency_cmp(const void *a, const void *b);
+static void print_result(const char *name, const SimResult *result);
+
+static void
+usage(const char *progname)
+{
+	fprintf(stderr,
+			"usage: %s [-c max_concurrent] [-e adaptive_epoch_ms] [-p policy[,...]] [-n] "
+			"trace_file\n"
+			"  -c  number of queries running at a time (default 4)\n"
+			"  -e  length of an epoch of the adaptive policy (default 1000)\n"
+			"  -p  policies to simulate (default all)\n"
+			"  -n  do not let queries give up on conflicting tables\n",
+			progname);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	int max_running = 4;
+	int64_t epoch = 1000 * 1000;
+	int conflicts = 1;
+	int selected[NUM_POLICIES];
+	char *policies = NULL;
+	SimJob *jobs;
+	SimResult result;
+	int njobs;
+	int c;
+	int i;
+
+	while ((c = getopt(argc, argv, "c:e:p:n")) != -1)
+	{
+		switch (c)
+		{
+			case 'c':
+				max_running = atoi(optarg);
+				if (max_running <= 0)
+					usage(argv[0]);
+				break;
+			case 'e':
+				epoch = (int64_t) atoi(optarg) * 1000;
+				if (epoch <= 0)
+					usage(argv[0]);
+				break;
+			case 'p':
+				policies = optarg;
+				break;
+			case 'n':
+				conflicts = 0;
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1)
+		usage(argv[0]);
+
+	for (i = 0; i < NUM_POLICIES; i++)
+		selected[i] = (policies == NULL);
+	if (policies)
+	{
+		char *name;
+
+		for (name = strtok(policies, ","); name; name = strtok(NULL, ","))
+		{
+			for (i = 0; i < NUM_POLICIES; i++)
+			{
+				if (strcmp(name, policy_names[i]) == 0)
+					break;
+			}
+			if (i == NUM_POLICIES)
+			{
+				fprintf(stderr, "unknown policy: %s\n", name);
+				exit(1);
+			}
+			selected[i] = 1;
+		}
+	}
+
+	jobs = read_trace(argv[optind], &njobs);
+	if (njobs == 0)
+	{
+		fprintf(stderr, "no completed queries in %s\n", argv[optind]);
+		exit(1);
+	}
+
+	printf("%-20s %6s %10s %10s %10s %10s %10s %12s %8s\n",
+		   "policy",
+		   "jobs",
+		   "mean",
+		   "p50",
+		   "p95",
+		   "p99",
+		   "mean_wait",
+		   "makespan",
+		   "give_ups");
+
+	/* latencies recorded in the trace, for reference */
+	for (i = 0; i < njobs; i++)
+		jobs[i].done = jobs[i].completed;
+	summarize(jobs, njobs, jobs[0].arrival, &result);
+	result.give_ups = -1;
+	print_result("(trace)", &result);
+
+	for (i = 0; i < NUM_POLICIES; i++)
+	{
+		if (!selected[i])
+			continue;
+		simulate(jobs, njobs, (SchedulePolicy) i, max_running, epoch, conflicts, &result);
+		print_result(policy_names[i], &result);
+		if (i == SCHEDULE_POLICY_ADAPTIVE)
+		{
+			int arm;
+
+			printf("  %lu epochs, %lu switches, epochs per policy:",
+				   (unsigned long) result.bandit.epochs,
+				   (unsigned long) result.bandit.switches);
+			for (arm = 0; arm < SCHED_BANDIT_ARMS; arm++)
+				printf(" %s=%lu", policy_names[arm], (unsigned long) result.bandit.pulls[arm]);
+			printf("\n");
+		}
+	}
+	printf("times in milliseconds\n");
+
+	free(jobs);
+	return 0;
+}
+
+/*
+ * read_trace
+ *
+ * Read a trace file and return the queries completed in it, in the order
+ * of their arrival. Events of a query are matched by the backend, which
+ * runs one top-level statement at a time.
+ */
+static SimJob *
+read_trace(const char *filename, int *njobs)
+{
+	FILE *file;
+	SchedTraceHeader header;
+	SchedTraceEvent event;
+	SimJob *jobs;
+	int *open_jobs; /* index of the job of each backend not completed yet */
+	int nopen = 0;
+	uint64_t i;
+	int n = 0;
+	int j;
+
+	file = fopen(filename, "rb");
+	if (file == NULL)
+	{
+		perror(filename);
+		exit(1);
+	}
+
+	if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != SCHED_TRACE_MAGIC ||
+		header.version != SCHED_TRACE_VERSION)
+	{
+		fprintf(stderr, "%s is not a scheduler trace of this version\n", filename);
+		exit(1);
+	}
+
+	jobs = calloc(header.nevents + 1, sizeof(SimJob));
+	open_jobs = calloc(header.nevents + 1, sizeof(int));
+	if (jobs == NULL || open_jobs == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+
+	for (i = 0; i < header.nevents; i++)
+	{
+		SimJob *job = NULL;
+		int pos = -1;
+
+		if (fread(&event, sizeof(event), 1, file) != 1)
+		{
+			fprintf(stderr, "%s is truncated\n", filename);
+			exit(1);
+		}
+
+		for (j = 0; j < nopen; j++)
+		{
+			if (jobs[open_jobs[j]].pid == event.pid)
+			{
+				job = &jobs[open_jobs[j]];
+				pos = j;
+				break;
+			}
+		}
+
+		switch (event.type)
+		{
+			case SCHED_EVENT_ENQUEUE:
+				/* a previous query of the backend not completed is dropped */
+				job = &jobs[n];
+				job->pid = event.pid;
+				job->arrival = event.time;
+				job->admitted = -1;
+				job->completed = -1;
+				job->job_size = event.job_size;
+				job->naffected = event.naffected < SCHED_TRACE_MAX_TABLES ? event.naffected
+																		  : SCHED_TRACE_MAX_TABLES;
+				memcpy(job->affected, event.affected, sizeof(uint32_t) * job->naffected);
+				if (pos < 0)
+					open_jobs[nopen++] = n;
+				else
+					open_jobs[pos] = n;
+				n++;
+				break;
+			case SCHED_EVENT_ADMIT:
+				if (job)
+					job->admitted = event.time;
+				break;
+			case SCHED_EVENT_GIVE_UP:
+				break;
+			case SCHED_EVENT_COMPLETE:
+				if (job)
+				{
+					job->completed = event.time;
+					job->service = event.time - (job->admitted >= 0 ? job->admitted : job->arrival);
+					open_jobs[pos] = open_jobs[--nopen];
+				}
+				break;
+		}
+	}
+	fclose(file);
+
+	/* drop queries not completed in the trace */
+	for (i = 0, j = 0; i < (uint64_t) n; i++)
+	{
+		if (jobs[i].completed >= 0)
+			jobs[j++] = jobs[i];
+	}
+
+	/* events of different databases may be recorded slightly out of order */
+	qsort(jobs, j, sizeof(SimJob), arrival_cmp);
+
+	free(open_jobs);
+	*njobs = j;
+	return jobs;
+}
+
+/*
+ * simulate
+ *
+ * Run the queries under the policy as a discrete event simulation.
+ */
+static void
+simulate(SimJob *jobs, int njobs, SchedulePolicy policy, int max_running, int64_t epoch,
+		 int conflicts, SimResult *result)
+{
+	SchedBandit bandit;
+	SchedCandidate *cands = calloc(njobs, sizeof(SchedCandidate));
+	SimJob **queued = calloc(njobs, sizeof(SimJob *));
+	int *order = calloc(njobs, sizeof(int));
+	uint32_t *tables = calloc((size_t) njobs * SCHED_TRACE_MAX_TABLES + 1, sizeof(uint32_t));
+	int64_t now = jobs[0].arrival;
+	int next = 0;
+	int nqueued = 0;
+	int running = 0;
+	int ndone = 0;
+	long give_ups = 0;
+	int i;
+
+	if (!cands || !queued || !order || !tables)
+	{
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+
+	SchedBanditInit(&bandit);
+
+	for (i = 0; i < njobs; i++)
+	{
+		jobs[i].status = QUERY_BLOCKED;
+		jobs[i].running = 0;
+		jobs[i].done = -1;
+	}
+
+	while (ndone < njobs)
+	{
+		int64_t next_time;
+		int admitted;
+
+		/*
+		 * Advance to the next arrival or completion. If there is neither,
+		 * queries which gave up are considered again at the same time.
+		 */
+		next_time = (next < njobs) ? jobs[next].arrival : INT64_MAX;
+		for (i = 0; i < njobs; i++)
+		{
+			if (jobs[i].running && jobs[i].finish < next_time)
+				next_time = jobs[i].finish;
+		}
+		if (next_time != INT64_MAX && next_time > now)
+			now = next_time;
+
+		for (i = 0; i < njobs; i++)
+		{
+			if (jobs[i].running && jobs[i].finish <= now)
+			{
+				jobs[i].running = 0;
+				jobs[i].done = now;
+				running--;
+				ndone++;
+				SchedBanditComplete(&bandit, now - jobs[i].arrival);
+			}
+		}
+		while (next < njobs && jobs[next].arrival <= now)
+			queued[nqueued++] = &jobs[next++];
+
+		if (nqueued == 0)
+			continue;
+
+		/* let the policy choose queries to admit */
+		for (i = 0; i < nqueued; i++)
+		{
+			cands[i].status = queued[i]->status;
+			cands[i].naffected = queued[i]->naffected;
+			cands[i].affected = queued[i]->affected;
+			cands[i].job_size = queued[i]->job_size;
+			cands[i].arrival = (uint64_t) (queued[i] - jobs);
+			cands[i].score = 0;
+		}
+		SchedOrder((policy == SCHEDULE_POLICY_ADAPTIVE) ? SchedBanditPolicy(&bandit, now, epoch)
+														: policy,
+				   cands,
+				   nqueued,
+				   tables,
+				   order);
+		admitted = SchedAdmit(cands, order, nqueued, &running, nqueued + running, max_running);
+
+		for (i = 0; i < nqueued; i++)
+			queued[i]->status = cands[i].status;
+		if (admitted == 0)
+			continue;
+
+		/* start admitted queries in the order of admission */
+		for (i = 0; i < nqueued; i++)
+		{
+			SimJob *job = queued[order[i]];
+
+			if (job->status != QUERY_AVAILABLE)
+				continue;
+
+			if (conflicts && conflicts_with_running(jobs, njobs, job))
+			{
+				job->status = QUERY_GIVE_UP;
+				running--;
+				give_ups++;
+				continue;
+			}
+			job->running = 1;
+			job->finish = now + job->service;
+		}
+
+		/* remove started queries from the queue, keeping the order */
+		for (i = 0, admitted = 0; i < nqueued; i++)
+		{
+			if (!queued[i]->running)
+				queued[admitted++] = queued[i];
+		}
+		nqueued = admitted;
+	}
+
+	summarize(jobs, njobs, jobs[0].arrival, result);
+	result->give_ups = give_ups;
+	result->bandit = bandit;
+
+	free(cands);
+	free(queued);
+	free(order);
+	free(tables);
+}
+
+/*
+ * conflicts_with_running
+ *
+ * Return true if a running query affects any of the tables of the job.
+ */
+static int
+conflicts_with_running(SimJob *jobs, int njobs, SimJob *job)
+{
+	int i, j, k;
+
+	for (i = 0; i < njobs; i++)
+	{
+		if (!jobs[i].running)
+			continue;
+		for (j = 0; j < job->naffected; j++)
+			for (k = 0; k < jobs[i].naffected; k++)
+				if (job->affected[j] == jobs[i].affected[k])
+					return 1;
+	}
+	return 0;
+}
+
+/*
+ * summarize
+ *
+ * Compute latencies from arrival to completion, and waits from arrival to
+ * the start of the run, of the jobs.
+ */
+static void
+summarize(SimJob *jobs, int njobs, int64_t start, SimResult *result)
+{
+	int64_t *latencies = calloc(njobs, sizeof(int64_t));
+	int64_t last = start;
+	double total = 0;
+	double wait = 0;
+	int i;
+
+	if (latencies == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+
+	for (i = 0; i < njobs; i++)
+	{
+		latencies[i] = jobs[i].done - jobs[i].arrival;
+		total += latencies[i];
+		wait += (jobs[i].done - jobs[i].service) - jobs[i].arrival;
+		if (jobs[i].done > last)
+			last = jobs[i].done;
+	}
+	qsort(latencies, njobs, sizeof(int64_t), latency_cmp);
+
+	/* nearest-rank percentiles, in milliseconds */
+	result->njobs = njobs;
+	result->mean_latency = total / njobs / 1000.0;
+	result->p50 = latencies[(njobs * 50 + 99) / 100 - 1] / 1000.0;
+	result->p95 = latencies[(njobs * 95 + 99) / 100 - 1] / 1000.0;
+	result->p99 = latencies[(njobs * 99 + 99) / 100 - 1] / 1000.0;
+	result->mean_wait = wait / njobs / 1000.0;
+	result->makespan = (last - start) / 1000.0;
+
+	free(latencies);
+}
+
+static int
+arrival_cmp(const void *a, const void *b)
+{
+	int64_t ta = ((const SimJob *) a)->arrival;
+	int64_t tb = ((const SimJob *) b)->arrival;
+
+	return (ta > tb) - (ta < tb);
+}
+
+static int
+latency_cmp(const void *a, const void *b)
+{
+	int64_t la = *(const int64_t *) a;
+	int64_t lb = *(const int64_t *) b;
+
+	return (la > lb) - (la < lb);
+}
+
+static void
+print_result(const char *name, const SimResult *result)
+{
+	printf("%-20s %6d %10.3f %10.3f %10.3f %10.3f %10.3f %12.3f ",
+		   name,
+		   result->njobs,
+		   result->mean_latency,
+		   result->p50,
+		   result->p95,
+		   result->p99,
+		   result->mean_wait,
+		   result->makespan);
+	if (result->give_ups >= 0)
+		printf("%8ld\n", result->give_ups);
+	else
+		printf("%8s\n", "-");
+}